@@ -29,12 +29,24 @@
 
 #include "object.h"
 #include "array.h"
+#include "refpool.h"
 #include "hash.h"
 
 struct CFWArray {
 	CFWObject obj;
 	void **data;
-	size_t size;
+	size_t size, cap;
+};
+
+struct parallel {
+	CFWArray *array;
+	void* (*map)(void*, void*);
+	bool (*filter)(void*, void*);
+	void* (*reduce)(void*, void*, void*);
+	void *ctx;
+	void **results;
+	bool *keep;
+	size_t chunk_size;
 };
 
 static bool
@@ -45,6 +57,7 @@ ctor(void *ptr, va_list args)
 
 	array->data = NULL;
 	array->size = 0;
+	array->cap = 0;
 
 	while ((obj = va_arg(args, void*)) != NULL)
 		if (!cfw_array_push(array, obj))
@@ -121,6 +134,7 @@ copy(void *ptr)
 		return NULL;
 	}
 	new->size = array->size;
+	new->cap = array->size;
 
 	for (i = 0; i < array->size; i++)
 		new->data[i] = cfw_ref(array->data[i]);
@@ -161,23 +175,36 @@ cfw_array_set(CFWArray *array, size_t index, void *ptr)
 }
 
 bool
-cfw_array_push(CFWArray *array, void *ptr)
+cfw_array_reserve(CFWArray *array, size_t cap)
 {
-	CFWObject *obj = ptr;
 	void **new;
 
-	if (array->data == NULL)
-		new = malloc(sizeof(void*));
-	else
-		new = realloc(array->data, sizeof(void*) * (array->size + 1));
+	if (cap <= array->cap)
+		return true;
 
-	if (new == NULL)
+	if (cap > SIZE_MAX / sizeof(void*))
 		return false;
 
-	new[array->size] = cfw_ref(obj);
+	if ((new = realloc(array->data, sizeof(void*) * cap)) == NULL)
+		return false;
 
 	array->data = new;
-	array->size++;
+	array->cap = cap;
+
+	return true;
+}
+
+bool
+cfw_array_push(CFWArray *array, void *ptr)
+{
+	CFWObject *obj = ptr;
+
+	/* Grow by 1.5x so that pushing is amortized O(1) */
+	if (array->size == array->cap && !cfw_array_reserve(array,
+	    (array->cap < 4 ? 4 : array->cap + array->cap / 2)))
+		return false;
+
+	array->data[array->size++] = cfw_ref(obj);
 
 	return true;
 }
@@ -194,30 +221,10 @@ cfw_array_last(CFWArray *array)
 bool
 cfw_array_pop(CFWArray *array)
 {
-	void **new;
-	void *last;
-
 	if (array->size == 0)
-		return NULL;
-
-	if (array->size == 1) {
-		cfw_unref(array->data[0]);
-		free(array->data);
-		array->data = NULL;
-		array->size = 0;
-		return true;
-	}
-
-	last = array->data[array->size - 1];
-
-	new = realloc(array->data, sizeof(void*) * (array->size - 1));
-	if (new == NULL)
 		return false;
 
-	cfw_unref(last);
-
-	array->data = new;
-	array->size--;
+	cfw_unref(array->data[--array->size]);
 
 	return true;
 }
@@ -270,6 +277,212 @@ cfw_array_find_ptr(CFWArray *array, void *ptr)
 	return SIZE_MAX;
 }
 
+static void
+map_range(void *ptr, size_t start, size_t end)
+{
+	struct parallel *p = ptr;
+	size_t i;
+
+	for (i = start; i < end; i++)
+		p->results[i] = cfw_ref(p->map(p->array->data[i], p->ctx));
+}
+
+static void
+filter_range(void *ptr, size_t start, size_t end)
+{
+	struct parallel *p = ptr;
+	size_t i;
+
+	for (i = start; i < end; i++)
+		p->keep[i] = p->filter(p->array->data[i], p->ctx);
+}
+
+static void
+reduce_chunks(void *ptr, size_t start, size_t end)
+{
+	struct parallel *p = ptr;
+	size_t i;
+
+	for (i = start; i < end; i++) {
+		size_t j, last;
+		void *acc;
+
+		j = i * p->chunk_size;
+		last = j + p->chunk_size;
+		if (last > p->array->size)
+			last = p->array->size;
+
+		acc = p->array->data[j];
+		for (j++; j < last; j++)
+			acc = p->reduce(acc, p->array->data[j], p->ctx);
+
+		/* Partial results may come from the worker's refpool */
+		p->results[i] = cfw_ref(acc);
+	}
+}
+
+static bool
+run_parallel(CFWExecutor *executor, size_t cnt,
+    void (*func)(void*, size_t, size_t), struct parallel *p)
+{
+	if (executor == NULL) {
+		func(p, 0, cnt);
+		return true;
+	}
+
+	return cfw_executor_parallel_for(executor, 0, cnt, 0, func, p);
+}
+
+CFWArray*
+cfw_array_parallel_map(CFWArray *array, CFWExecutor *executor,
+    void* (*func)(void*, void*), void *ctx)
+{
+	struct parallel p = {
+		.array = array,
+		.map = func,
+		.ctx = ctx
+	};
+	CFWArray *new;
+
+	if ((new = cfw_create(cfw_array, (void*)NULL)) == NULL)
+		return NULL;
+
+	if (array->size == 0)
+		return new;
+
+	if ((p.results = malloc(sizeof(void*) * array->size)) == NULL)
+		return NULL;
+
+	if (!run_parallel(executor, array->size, map_range, &p)) {
+		free(p.results);
+		return NULL;
+	}
+
+	new->data = p.results;
+	new->size = array->size;
+	new->cap = array->size;
+
+	return new;
+}
+
+CFWArray*
+cfw_array_parallel_filter(CFWArray *array, CFWExecutor *executor,
+    bool (*func)(void*, void*), void *ctx)
+{
+	struct parallel p = {
+		.array = array,
+		.filter = func,
+		.ctx = ctx
+	};
+	CFWArray *new;
+	size_t i, j, cnt;
+
+	if ((new = cfw_create(cfw_array, (void*)NULL)) == NULL)
+		return NULL;
+
+	if (array->size == 0)
+		return new;
+
+	if ((p.keep = malloc(sizeof(bool) * array->size)) == NULL)
+		return NULL;
+
+	if (!run_parallel(executor, array->size, filter_range, &p)) {
+		free(p.keep);
+		return NULL;
+	}
+
+	for (i = cnt = 0; i < array->size; i++)
+		if (p.keep[i])
+			cnt++;
+
+	if (cnt > 0) {
+		if ((new->data = malloc(sizeof(void*) * cnt)) == NULL) {
+			free(p.keep);
+			return NULL;
+		}
+
+		for (i = j = 0; i < array->size; i++)
+			if (p.keep[i])
+				new->data[j++] = cfw_ref(array->data[i]);
+
+		new->size = cnt;
+		new->cap = cnt;
+	}
+
+	free(p.keep);
+
+	return new;
+}
+
+void*
+cfw_array_parallel_reduce(CFWArray *array, CFWExecutor *executor,
+    void* (*func)(void*, void*, void*), void *ctx)
+{
+	struct parallel p = {
+		.array = array,
+		.reduce = func,
+		.ctx = ctx
+	};
+	size_t i, chunks;
+	void *acc;
+
+	if (array->size == 0)
+		return NULL;
+
+	chunks = (executor != NULL ? cfw_executor_threads(executor) * 4 : 1);
+	if (chunks > array->size)
+		chunks = array->size;
+
+	p.chunk_size = (array->size + chunks - 1) / chunks;
+	chunks = (array->size + p.chunk_size - 1) / p.chunk_size;
+
+	if ((p.results = malloc(sizeof(void*) * chunks)) == NULL)
+		return NULL;
+
+	if (!run_parallel(executor, chunks, reduce_chunks, &p)) {
+		free(p.results);
+		return NULL;
+	}
+
+	/* Combine the per-chunk results in order */
+	acc = p.results[0];
+	for (i = 1; i < chunks; i++)
+		acc = func(acc, p.results[i], ctx);
+
+	cfw_ref(acc);
+
+	for (i = 0; i < chunks; i++)
+		cfw_unref(p.results[i]);
+	free(p.results);
+
+	if (acc == NULL)
+		return NULL;
+
+	if (!cfw_refpool_add(acc)) {
+		cfw_unref(acc);
+		return NULL;
+	}
+
+	return acc;
+}
+
+static bool
+describe(void *ptr, cfw_writer_t write, void *ctx)
+{
+	CFWArray *array = ptr;
+	size_t i;
+
+	if (!write(ctx, "(", 1))
+		return false;
+
+	for (i = 0; i < array->size; i++)
+		if ((i > 0 && !write(ctx, ", ", 2)) ||
+		    !cfw_describe(array->data[i], write, ctx))
+			return false;
+
+	return write(ctx, ")", 1);
+}
+
 static CFWClass class = {
 	.name = "CFWArray",
 	.size = sizeof(CFWArray),
@@ -277,6 +490,7 @@ static CFWClass class = {
 	.dtor = dtor,
 	.equal = equal,
 	.hash = hash,
-	.copy = copy
+	.copy = copy,
+	.describe = describe
 };
 CFWClass *cfw_array = &class;
@@ -28,12 +28,14 @@
 #define __COREFW_ARRAY_H__
 
 #include "class.h"
+#include "executor.h"
 
 typedef struct CFWArray CFWArray;
 extern CFWClass *cfw_array;
 extern size_t cfw_array_size(CFWArray*);
 extern void* cfw_array_get(CFWArray*, size_t);
 extern bool cfw_array_set(CFWArray*, size_t, void*);
+extern bool cfw_array_reserve(CFWArray*, size_t);
 extern bool cfw_array_push(CFWArray*, void*);
 extern void* cfw_array_last(CFWArray*);
 extern bool cfw_array_pop(CFWArray*);
@@ -41,5 +43,11 @@ extern bool cfw_array_contains(CFWArray*, void*);
 extern bool cfw_array_contains_ptr(CFWArray*, void*);
 extern size_t cfw_array_find(CFWArray*, void*);
 extern size_t cfw_array_find_ptr(CFWArray*, void*);
+extern CFWArray* cfw_array_parallel_map(CFWArray*, CFWExecutor*,
+    void* (*)(void*, void*), void*);
+extern CFWArray* cfw_array_parallel_filter(CFWArray*, CFWExecutor*,
+    bool (*)(void*, void*), void*);
+extern void* cfw_array_parallel_reduce(CFWArray*, CFWExecutor*,
+    void* (*)(void*, void*, void*), void*);
 
 #endif
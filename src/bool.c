@@ -71,6 +71,17 @@ copy(void *ptr)
 	return cfw_ref(ptr);
 }
 
+static bool
+describe(void *ptr, cfw_writer_t write, void *ctx)
+{
+	CFWBool *boolean = ptr;
+
+	if (boolean->value)
+		return write(ctx, "true", 4);
+
+	return write(ctx, "false", 5);
+}
+
 bool
 cfw_bool_value(CFWBool *boolean)
 {
@@ -83,6 +94,7 @@ static CFWClass class = {
 	.ctor = ctor,
 	.equal = equal,
 	.hash = hash,
-	.copy = copy
+	.copy = copy,
+	.describe = describe
 };
 CFWClass *cfw_bool = &class;
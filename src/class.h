@@ -32,6 +32,8 @@
 #include <stdint.h>
 #include <stdarg.h>
 
+typedef bool (*cfw_writer_t)(void*, const void*, size_t);
+
 typedef struct CFWClass {
 	const char *name;
 	size_t size;
@@ -40,6 +42,8 @@ typedef struct CFWClass {
 	bool (*equal)(void*, void*);
 	uint32_t (*hash)(void*);
 	void* (*copy)(void*);
+	bool (*describe)(void*, cfw_writer_t, void*);
+	void (*dealloc)(void*);
 } CFWClass;
 
 extern const char* cfw_class_name(CFWClass*);
@@ -0,0 +1,474 @@
+/*
+ * Copyright (c) 2012, Jonathan Schleifer <js@webkeks.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+
+#include <poll.h>
+
+#include "object.h"
+#include "connpool.h"
+#include "futex.h"
+#include "stream.h"
+#include "tcpsocket.h"
+
+#define DEFAULT_MAX_IDLE 8
+
+struct conn {
+	CFWTCPSocket *sock;
+	struct key *key;
+	int64_t created;
+};
+
+struct key {
+	char *host;
+	uint16_t port;
+	struct conn *idle;
+	size_t idle_len, idle_cap, active;
+	struct key *next;
+};
+
+struct CFWConnPool {
+	CFWObject obj;
+	uint32_t lock, released, waiters;
+	struct key *keys;
+	struct conn *out;
+	size_t out_len, out_cap;
+	size_t max_idle, max_per_key;
+	int max_age;
+	bool closed;
+};
+
+static bool
+ctor(void *ptr, va_list args)
+{
+	CFWConnPool *pool = ptr;
+
+	pool->lock = 0;
+	pool->released = 0;
+	pool->waiters = 0;
+	pool->keys = NULL;
+	pool->out = NULL;
+	pool->out_len = 0;
+	pool->out_cap = 0;
+	pool->max_idle = DEFAULT_MAX_IDLE;
+	pool->max_per_key = 0;
+	pool->max_age = 0;
+	pool->closed = false;
+
+	return true;
+}
+
+static void
+dtor(void *ptr)
+{
+	CFWConnPool *pool = ptr;
+	struct key *key, *next;
+	size_t i;
+
+	for (key = pool->keys; key != NULL; key = next) {
+		next = key->next;
+
+		for (i = 0; i < key->idle_len; i++)
+			cfw_unref(key->idle[i].sock);
+
+		free(key->idle);
+		free(key->host);
+		free(key);
+	}
+
+	for (i = 0; i < pool->out_len; i++)
+		cfw_unref(pool->out[i].sock);
+
+	free(pool->out);
+}
+
+static void
+lock(CFWConnPool *pool)
+{
+	uint32_t c = 0;
+
+	if (__atomic_compare_exchange_n(&pool->lock, &c, 1, false,
+	    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+
+	/* 2 means there may be waiters that need a wake up */
+	if (c != 2)
+		c = __atomic_exchange_n(&pool->lock, 2, __ATOMIC_ACQUIRE);
+
+	while (c != 0) {
+		cfw_futex_wait(&pool->lock, 2);
+		c = __atomic_exchange_n(&pool->lock, 2, __ATOMIC_ACQUIRE);
+	}
+}
+
+static void
+unlock(CFWConnPool *pool)
+{
+	if (__atomic_exchange_n(&pool->lock, 0, __ATOMIC_RELEASE) == 2)
+		cfw_futex_wake(&pool->lock, 1);
+}
+
+static void
+notify(CFWConnPool *pool)
+{
+	__atomic_add_fetch(&pool->released, 1, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&pool->waiters, __ATOMIC_SEQ_CST) > 0)
+		cfw_futex_wake(&pool->released, INT_MAX);
+}
+
+static int64_t
+now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void
+cfw_connpool_set_max_idle(CFWConnPool *pool, size_t max_idle)
+{
+	pool->max_idle = max_idle;
+}
+
+void
+cfw_connpool_set_max_age(CFWConnPool *pool, int max_age)
+{
+	pool->max_age = max_age;
+}
+
+void
+cfw_connpool_set_max_per_key(CFWConnPool *pool, size_t max_per_key)
+{
+	pool->max_per_key = max_per_key;
+}
+
+static struct key*
+find_key(CFWConnPool *pool, const char *host, uint16_t port, bool create)
+{
+	struct key *key;
+
+	for (key = pool->keys; key != NULL; key = key->next)
+		if (key->port == port && !strcmp(key->host, host))
+			return key;
+
+	if (!create || (key = malloc(sizeof(*key))) == NULL)
+		return NULL;
+
+	if ((key->host = strdup(host)) == NULL) {
+		free(key);
+		return NULL;
+	}
+
+	key->port = port;
+	key->idle = NULL;
+	key->idle_len = 0;
+	key->idle_cap = 0;
+	key->active = 0;
+	key->next = pool->keys;
+	pool->keys = key;
+
+	return key;
+}
+
+static bool
+expired(CFWConnPool *pool, struct conn *conn, int64_t now)
+{
+	return (pool->max_age > 0 && now - conn->created >= pool->max_age);
+}
+
+/*
+ * An idle connection must have nothing to read. If it has, the peer either
+ * closed it or sent something nobody asked for, and it can't be reused.
+ */
+static bool
+alive(CFWTCPSocket *sock)
+{
+	CFWStream *stream = (CFWStream*)sock;
+	struct pollfd pfd;
+
+	if (stream->read_len > 0 || cfw_stream_at_end(sock))
+		return false;
+
+	pfd.fd = cfw_stream_fd(sock);
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+
+	return (pfd.fd != -1 && poll(&pfd, 1, 0) == 0);
+}
+
+static bool
+check_out(CFWConnPool *pool, struct conn *conn)
+{
+	if (pool->out_len == pool->out_cap) {
+		size_t cap = (pool->out_cap < 16 ? 16 : pool->out_cap * 2);
+		struct conn *new;
+
+		if ((new = realloc(pool->out, cap * sizeof(*new))) == NULL)
+			return false;
+
+		pool->out = new;
+		pool->out_cap = cap;
+	}
+
+	pool->out[pool->out_len++] = *conn;
+
+	return true;
+}
+
+static CFWTCPSocket*
+get(CFWConnPool *pool, const char *host, uint16_t port, bool wait)
+{
+	struct key *key;
+	struct conn conn;
+	int64_t now;
+
+	lock(pool);
+
+	for (;;) {
+		uint32_t seq;
+
+		if (pool->closed ||
+		    (key = find_key(pool, host, port, true)) == NULL) {
+			unlock(pool);
+			return NULL;
+		}
+
+		now = now_ms();
+
+		/* The most recently used connection is the warmest one */
+		while (key->idle_len > 0) {
+			conn = key->idle[--key->idle_len];
+
+			if (expired(pool, &conn, now) || !alive(conn.sock)) {
+				cfw_unref(conn.sock);
+				continue;
+			}
+
+			if (!check_out(pool, &conn)) {
+				cfw_unref(conn.sock);
+				unlock(pool);
+				return NULL;
+			}
+
+			key->active++;
+			unlock(pool);
+
+			return cfw_ref(conn.sock);
+		}
+
+		if (pool->max_per_key == 0 || key->active < pool->max_per_key)
+			break;
+
+		if (!wait) {
+			unlock(pool);
+			return NULL;
+		}
+
+		seq = __atomic_load_n(&pool->released, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&pool->waiters, 1, __ATOMIC_SEQ_CST);
+		unlock(pool);
+
+		cfw_futex_wait(&pool->released, seq);
+
+		__atomic_sub_fetch(&pool->waiters, 1, __ATOMIC_SEQ_CST);
+		lock(pool);
+	}
+
+	/* The slot is taken before connecting, so the cap holds meanwhile */
+	key->active++;
+	unlock(pool);
+
+	conn.key = key;
+	conn.created = now;
+
+	if ((conn.sock = cfw_new(cfw_tcpsocket)) != NULL &&
+	    !cfw_tcpsocket_connect(conn.sock, host, port)) {
+		cfw_unref(conn.sock);
+		conn.sock = NULL;
+	}
+
+	lock(pool);
+
+	if (conn.sock != NULL && !check_out(pool, &conn)) {
+		cfw_unref(conn.sock);
+		conn.sock = NULL;
+	}
+
+	if (conn.sock == NULL) {
+		key->active--;
+		notify(pool);
+	}
+
+	unlock(pool);
+
+	/* The pool keeps its own reference until the socket is put back */
+	return cfw_ref(conn.sock);
+}
+
+CFWTCPSocket*
+cfw_connpool_get(CFWConnPool *pool, const char *host, uint16_t port)
+{
+	return get(pool, host, port, true);
+}
+
+CFWTCPSocket*
+cfw_connpool_try_get(CFWConnPool *pool, const char *host, uint16_t port)
+{
+	return get(pool, host, port, false);
+}
+
+void
+cfw_connpool_put(CFWConnPool *pool, CFWTCPSocket *sock, bool reusable)
+{
+	struct conn conn;
+	struct key *key;
+	size_t i;
+
+	/* Whatever is still buffered has to reach the peer first */
+	if (reusable && !cfw_stream_flush(sock))
+		reusable = false;
+
+	lock(pool);
+
+	for (i = 0; i < pool->out_len; i++)
+		if (pool->out[i].sock == sock)
+			break;
+
+	if (i == pool->out_len) {
+		unlock(pool);
+		cfw_unref(sock);
+		return;
+	}
+
+	conn = pool->out[i];
+	pool->out[i] = pool->out[--pool->out_len];
+	key = conn.key;
+	key->active--;
+
+	if (reusable && !pool->closed && key->idle_len < pool->max_idle &&
+	    !expired(pool, &conn, now_ms()) && alive(sock)) {
+		if (key->idle_len == key->idle_cap) {
+			size_t cap = (key->idle_cap < 4 ? 4 : key->idle_cap * 2);
+			struct conn *new;
+
+			if ((new = realloc(key->idle,
+			    cap * sizeof(*new))) == NULL)
+				reusable = false;
+			else {
+				key->idle = new;
+				key->idle_cap = cap;
+			}
+		}
+
+		if (reusable) {
+			key->idle[key->idle_len++] = conn;
+			conn.sock = NULL;
+		}
+	}
+
+	notify(pool);
+	unlock(pool);
+
+	if (conn.sock != NULL)
+		cfw_unref(conn.sock);
+
+	cfw_unref(sock);
+}
+
+size_t
+cfw_connpool_idle(CFWConnPool *pool, const char *host, uint16_t port)
+{
+	struct key *key;
+	size_t ret;
+
+	lock(pool);
+	ret = ((key = find_key(pool, host, port, false)) != NULL ?
+	    key->idle_len : 0);
+	unlock(pool);
+
+	return ret;
+}
+
+void
+cfw_connpool_prune(CFWConnPool *pool)
+{
+	struct key *key;
+	int64_t now = now_ms();
+	size_t i, j;
+
+	lock(pool);
+
+	for (key = pool->keys; key != NULL; key = key->next) {
+		for (i = j = 0; i < key->idle_len; i++) {
+			if (expired(pool, &key->idle[i], now) ||
+			    !alive(key->idle[i].sock))
+				cfw_unref(key->idle[i].sock);
+			else
+				key->idle[j++] = key->idle[i];
+		}
+
+		key->idle_len = j;
+	}
+
+	unlock(pool);
+}
+
+void
+cfw_connpool_close(CFWConnPool *pool)
+{
+	struct key *key;
+	size_t i;
+
+	lock(pool);
+
+	pool->closed = true;
+
+	for (key = pool->keys; key != NULL; key = key->next) {
+		for (i = 0; i < key->idle_len; i++)
+			cfw_unref(key->idle[i].sock);
+
+		key->idle_len = 0;
+	}
+
+	notify(pool);
+	unlock(pool);
+}
+
+static CFWClass class = {
+	.name = "CFWConnPool",
+	.size = sizeof(CFWConnPool),
+	.ctor = ctor,
+	.dtor = dtor
+};
+CFWClass *cfw_connpool = &class;
@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2012, Jonathan Schleifer <js@webkeks.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __COREFW_CONNPOOL_H__
+#define __COREFW_CONNPOOL_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "class.h"
+#include "tcpsocket.h"
+
+typedef struct CFWConnPool CFWConnPool;
+
+/*
+ * The sockets returned by cfw_connpool_get and cfw_connpool_try_get belong
+ * to the caller. cfw_connpool_put takes that reference, so a socket must not
+ * be released after it has been put back.
+ */
+extern CFWClass *cfw_connpool;
+extern void cfw_connpool_set_max_idle(CFWConnPool*, size_t);
+extern void cfw_connpool_set_max_age(CFWConnPool*, int);
+extern void cfw_connpool_set_max_per_key(CFWConnPool*, size_t);
+extern CFWTCPSocket* cfw_connpool_get(CFWConnPool*, const char*, uint16_t);
+extern CFWTCPSocket* cfw_connpool_try_get(CFWConnPool*, const char*,
+    uint16_t);
+extern void cfw_connpool_put(CFWConnPool*, CFWTCPSocket*, bool);
+extern size_t cfw_connpool_idle(CFWConnPool*, const char*, uint16_t);
+extern void cfw_connpool_prune(CFWConnPool*);
+extern void cfw_connpool_close(CFWConnPool*);
+
+#endif
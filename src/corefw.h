@@ -6,15 +6,33 @@
 #include "array.h"
 #include "bool.h"
 #include "box.h"
+#include "connpool.h"
 #include "double.h"
+#include "executor.h"
 #include "file.h"
+#include "format.h"
 #include "hash.h"
 #include "int.h"
+#include "ioring.h"
+#include "lzstream.h"
 #include "map.h"
+#include "mappedfile.h"
+#include "matcher.h"
+#include "number.h"
+#include "queue.h"
 #include "range.h"
 #include "refpool.h"
+#include "regex.h"
+#include "rope.h"
+#include "runloop.h"
+#include "search.h"
 #include "stream.h"
 #include "string.h"
+#include "stringbuilder.h"
+#include "stringview.h"
+#include "tcpserver.h"
 #include "tcpsocket.h"
+#include "tokenizer.h"
+#include "utf8.h"
 
 #endif
@@ -26,6 +26,7 @@
 
 #include "object.h"
 #include "double.h"
+#include "number.h"
 
 struct CFWDouble {
 	CFWObject obj;
@@ -78,12 +79,22 @@ cfw_double_value(CFWDouble *double_)
 	return double_->value;
 }
 
+static bool
+describe(void *ptr, cfw_writer_t write, void *ctx)
+{
+	CFWDouble *double_ = ptr;
+	char buf[CFW_DOUBLE_BUFSIZE];
+
+	return write(ctx, buf, cfw_format_double(buf, double_->value));
+}
+
 static CFWClass class = {
 	.name = "CFWDouble",
 	.size = sizeof(CFWDouble),
 	.ctor = ctor,
 	.equal = equal,
 	.hash = hash,
-	.copy = copy
+	.copy = copy,
+	.describe = describe
 };
 CFWClass *cfw_double = &class;
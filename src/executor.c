@@ -0,0 +1,532 @@
+/*
+ * Copyright (c) 2012, Jonathan Schleifer <js@webkeks.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+
+#include <unistd.h>
+#include <pthread.h>
+
+#include "object.h"
+#include "refpool.h"
+#include "queue.h"
+#include "executor.h"
+#include "futex.h"
+
+#define DEQUE_SIZE 4096
+#define INJECT_SIZE 4096
+#define CACHE_LINE 64
+
+struct task {
+	CFWObject obj;
+	void (*func)(void*);
+	void *arg;
+	CFWTaskGroup *group;
+};
+
+/*
+ * Chase-Lev deque with a fixed size. The owner pushes and pops at the
+ * bottom, thieves take from the top. If it is full, tasks are run inline.
+ */
+struct deque {
+	intptr_t top;
+	char pad[CACHE_LINE];
+	intptr_t bottom;
+	struct task **tasks;
+};
+
+struct worker {
+	CFWExecutor *executor;
+	pthread_t thread;
+	struct deque deque;
+	uint32_t rand;
+};
+
+struct CFWExecutor {
+	CFWObject obj;
+	struct worker *workers;
+	size_t workers_cnt, started;
+	CFWQueue *inject;
+	uint32_t work_seq, sleepers;
+	bool stop;
+};
+
+struct CFWTaskGroup {
+	CFWObject obj;
+	CFWExecutor *executor;
+	uint32_t pending;
+};
+
+struct chunk {
+	void (*func)(void*, size_t, size_t);
+	void *ctx;
+	size_t start, end;
+};
+
+static __thread struct worker *current;
+
+static void
+task_dtor(void *ptr)
+{
+	struct task *task = ptr;
+
+	cfw_unref(task->group);
+}
+
+static CFWClass task_class = {
+	.name = "CFWExecutorTask",
+	.size = sizeof(struct task),
+	.dtor = task_dtor
+};
+
+static bool
+deque_push(struct deque *deque, struct task *task)
+{
+	intptr_t bottom, top;
+
+	bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+	top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+
+	if (bottom - top >= DEQUE_SIZE)
+		return false;
+
+	__atomic_store_n(&deque->tasks[bottom & (DEQUE_SIZE - 1)], task,
+	    __ATOMIC_RELAXED);
+	__atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+static struct task*
+deque_pop(struct deque *deque)
+{
+	struct task *task;
+	intptr_t bottom, top;
+
+	bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+	__atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+
+	if (top > bottom) {
+		__atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	task = __atomic_load_n(&deque->tasks[bottom & (DEQUE_SIZE - 1)],
+	    __ATOMIC_RELAXED);
+
+	if (top == bottom) {
+		/* Last task, race against thieves */
+		if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1,
+		    false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+			task = NULL;
+
+		__atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+	}
+
+	return task;
+}
+
+static struct task*
+deque_steal(struct deque *deque)
+{
+	struct task *task;
+	intptr_t bottom, top;
+
+	top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+
+	if (top >= bottom)
+		return NULL;
+
+	task = __atomic_load_n(&deque->tasks[top & (DEQUE_SIZE - 1)],
+	    __ATOMIC_RELAXED);
+
+	if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, false,
+	    __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		return NULL;
+
+	return task;
+}
+
+static struct task*
+find_task(CFWExecutor *executor)
+{
+	struct worker *worker = current;
+	struct task *task;
+	size_t i, start, started;
+
+	if (worker != NULL && worker->executor != executor)
+		worker = NULL;
+
+	if (worker != NULL && (task = deque_pop(&worker->deque)) != NULL)
+		return task;
+
+	if ((task = cfw_queue_try_pop(executor->inject)) != NULL)
+		return task;
+
+	if (worker != NULL) {
+		/* xorshift, only needs to spread thieves over victims */
+		worker->rand ^= worker->rand << 13;
+		worker->rand ^= worker->rand >> 17;
+		worker->rand ^= worker->rand << 5;
+		start = worker->rand;
+	} else
+		start = 0;
+
+	started = __atomic_load_n(&executor->started, __ATOMIC_ACQUIRE);
+
+	for (i = 0; i < started; i++) {
+		struct worker *victim;
+
+		victim = &executor->workers[(start + i) % started];
+		if (victim == worker)
+			continue;
+
+		if ((task = deque_steal(&victim->deque)) != NULL)
+			return task;
+	}
+
+	return NULL;
+}
+
+static void
+run_task(struct task *task)
+{
+	CFWRefPool *pool;
+	CFWTaskGroup *group = task->group;
+
+	/* Objects created by the task are released when it finishes */
+	if ((pool = cfw_new(cfw_refpool)) == NULL)
+		abort();
+
+	task->func(task->arg);
+
+	cfw_unref(pool);
+
+	if (group != NULL &&
+	    __atomic_sub_fetch(&group->pending, 1, __ATOMIC_ACQ_REL) == 0)
+		cfw_futex_wake(&group->pending, INT_MAX);
+
+	cfw_unref(task);
+}
+
+static void*
+worker_main(void *ptr)
+{
+	struct worker *worker = ptr;
+	CFWExecutor *executor = worker->executor;
+	CFWRefPool *pool;
+
+	current = worker;
+
+	if ((pool = cfw_new(cfw_refpool)) == NULL)
+		abort();
+
+	for (;;) {
+		struct task *task;
+		uint32_t seq;
+
+		if ((task = find_task(executor)) != NULL) {
+			run_task(task);
+			continue;
+		}
+
+		seq = __atomic_load_n(&executor->work_seq, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&executor->sleepers, 1, __ATOMIC_SEQ_CST);
+
+		if ((task = find_task(executor)) == NULL) {
+			if (__atomic_load_n(&executor->stop,
+			    __ATOMIC_ACQUIRE)) {
+				__atomic_sub_fetch(&executor->sleepers, 1,
+				    __ATOMIC_SEQ_CST);
+				break;
+			}
+
+			cfw_futex_wait(&executor->work_seq, seq);
+		}
+
+		__atomic_sub_fetch(&executor->sleepers, 1, __ATOMIC_SEQ_CST);
+
+		if (task != NULL)
+			run_task(task);
+	}
+
+	cfw_unref(pool);
+
+	return NULL;
+}
+
+static void
+wake_workers(CFWExecutor *executor, int cnt)
+{
+	__atomic_add_fetch(&executor->work_seq, 1, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&executor->sleepers, __ATOMIC_SEQ_CST) > 0)
+		cfw_futex_wake(&executor->work_seq, cnt);
+}
+
+static bool
+ctor(void *ptr, va_list args)
+{
+	CFWExecutor *executor = ptr;
+	size_t i, threads = va_arg(args, size_t);
+
+	executor->workers = NULL;
+	executor->workers_cnt = 0;
+	executor->started = 0;
+	executor->inject = NULL;
+	executor->work_seq = 0;
+	executor->sleepers = 0;
+	executor->stop = false;
+
+	if (threads == 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = (cpus > 0 ? cpus : 1);
+	}
+
+	if ((executor->inject = cfw_new(cfw_queue, (size_t)INJECT_SIZE)) ==
+	    NULL)
+		return false;
+
+	if ((executor->workers = calloc(threads, sizeof(struct worker))) ==
+	    NULL)
+		return false;
+	executor->workers_cnt = threads;
+
+	for (i = 0; i < threads; i++) {
+		struct worker *worker = &executor->workers[i];
+
+		worker->executor = executor;
+		worker->deque.top = 0;
+		worker->deque.bottom = 0;
+		worker->rand = (uint32_t)i * 2654435761u + 1;
+
+		if ((worker->deque.tasks = malloc(DEQUE_SIZE *
+		    sizeof(struct task*))) == NULL)
+			return false;
+	}
+
+	for (i = 0; i < threads; i++) {
+		if (pthread_create(&executor->workers[i].thread, NULL,
+		    worker_main, &executor->workers[i]))
+			return false;
+
+		__atomic_store_n(&executor->started, i + 1, __ATOMIC_RELEASE);
+	}
+
+	return true;
+}
+
+static void
+dtor(void *ptr)
+{
+	CFWExecutor *executor = ptr;
+	size_t i;
+
+	__atomic_store_n(&executor->stop, true, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&executor->work_seq, 1, __ATOMIC_SEQ_CST);
+	cfw_futex_wake(&executor->work_seq, INT_MAX);
+
+	for (i = 0; i < executor->started; i++)
+		pthread_join(executor->workers[i].thread, NULL);
+
+	if (executor->workers != NULL) {
+		for (i = 0; i < executor->workers_cnt; i++)
+			free(executor->workers[i].deque.tasks);
+
+		free(executor->workers);
+	}
+
+	cfw_unref(executor->inject);
+}
+
+size_t
+cfw_executor_threads(CFWExecutor *executor)
+{
+	return executor->workers_cnt;
+}
+
+size_t
+cfw_executor_current_worker(CFWExecutor *executor)
+{
+	if (current == NULL || current->executor != executor)
+		return SIZE_MAX;
+
+	return current - executor->workers;
+}
+
+bool
+cfw_executor_submit(CFWExecutor *executor, CFWTaskGroup *group,
+    void (*func)(void*), void *arg)
+{
+	struct task *task;
+
+	if ((task = cfw_new(&task_class)) == NULL)
+		return false;
+
+	task->func = func;
+	task->arg = arg;
+	task->group = cfw_ref(group);
+
+	if (group != NULL)
+		__atomic_add_fetch(&group->pending, 1, __ATOMIC_ACQ_REL);
+
+	if (current != NULL && current->executor == executor) {
+		if (!deque_push(&current->deque, task)) {
+			run_task(task);
+			return true;
+		}
+	} else {
+		if (!cfw_queue_push(executor->inject, task)) {
+			if (group != NULL)
+				__atomic_sub_fetch(&group->pending, 1,
+				    __ATOMIC_ACQ_REL);
+
+			cfw_unref(task);
+			return false;
+		}
+
+		cfw_unref(task);
+	}
+
+	wake_workers(executor, 1);
+
+	return true;
+}
+
+static void
+run_chunk(void *ptr)
+{
+	struct chunk *chunk = ptr;
+
+	chunk->func(chunk->ctx, chunk->start, chunk->end);
+}
+
+bool
+cfw_executor_parallel_for(CFWExecutor *executor, size_t start, size_t end,
+    size_t grain, void (*func)(void*, size_t, size_t), void *ctx)
+{
+	CFWTaskGroup *group;
+	struct chunk *chunks;
+	size_t i, cnt;
+
+	if (start >= end)
+		return true;
+
+	if (grain == 0)
+		if ((grain = (end - start) / (executor->workers_cnt * 4)) == 0)
+			grain = 1;
+
+	cnt = (end - start - 1) / grain + 1;
+
+	if ((chunks = malloc(cnt * sizeof(struct chunk))) == NULL)
+		return false;
+
+	if ((group = cfw_new(cfw_taskgroup, executor)) == NULL) {
+		free(chunks);
+		return false;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		chunks[i].func = func;
+		chunks[i].ctx = ctx;
+		chunks[i].start = start + i * grain;
+		chunks[i].end = (end - chunks[i].start > grain ?
+		    chunks[i].start + grain : end);
+	}
+
+	/* The caller takes the first chunk itself */
+	for (i = 1; i < cnt; i++)
+		if (!cfw_executor_submit(executor, group, run_chunk,
+		    &chunks[i]))
+			run_chunk(&chunks[i]);
+
+	run_chunk(&chunks[0]);
+
+	cfw_taskgroup_join(group);
+	cfw_unref(group);
+	free(chunks);
+
+	return true;
+}
+
+static bool
+group_ctor(void *ptr, va_list args)
+{
+	CFWTaskGroup *group = ptr;
+
+	/*
+	 * No reference to the executor: Tasks keep their group alive, so the
+	 * last reference to a group may be dropped on a worker thread, which
+	 * must never be the one to destroy the executor.
+	 */
+	group->executor = va_arg(args, CFWExecutor*);
+	group->pending = 0;
+
+	return (group->executor != NULL);
+}
+
+void
+cfw_taskgroup_join(CFWTaskGroup *group)
+{
+	for (;;) {
+		struct task *task;
+		uint32_t pending;
+
+		pending = __atomic_load_n(&group->pending, __ATOMIC_ACQUIRE);
+		if (pending == 0)
+			return;
+
+		/* Help out instead of blocking while there is work */
+		if ((task = find_task(group->executor)) != NULL) {
+			run_task(task);
+			continue;
+		}
+
+		cfw_futex_wait(&group->pending, pending);
+	}
+}
+
+static CFWClass class = {
+	.name = "CFWExecutor",
+	.size = sizeof(CFWExecutor),
+	.ctor = ctor,
+	.dtor = dtor
+};
+CFWClass *cfw_executor = &class;
+
+static CFWClass group_class = {
+	.name = "CFWTaskGroup",
+	.size = sizeof(CFWTaskGroup),
+	.ctor = group_ctor
+};
+CFWClass *cfw_taskgroup = &group_class;
@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2012, Jonathan Schleifer <js@webkeks.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __COREFW_EXECUTOR_H__
+#define __COREFW_EXECUTOR_H__
+
+#include "class.h"
+
+typedef struct CFWExecutor CFWExecutor;
+typedef struct CFWTaskGroup CFWTaskGroup;
+extern CFWClass *cfw_executor;
+extern CFWClass *cfw_taskgroup;
+extern size_t cfw_executor_threads(CFWExecutor*);
+extern bool cfw_executor_submit(CFWExecutor*, CFWTaskGroup*, void (*)(void*),
+    void*);
+extern bool cfw_executor_parallel_for(CFWExecutor*, size_t, size_t, size_t,
+    void (*)(void*, size_t, size_t), void*);
+extern size_t cfw_executor_current_worker(CFWExecutor*);
+extern void cfw_taskgroup_join(CFWTaskGroup*);
+
+#endif
@@ -24,10 +24,12 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <stdlib.h>
 #include <string.h>
 #include <limits.h>
 
 #include <sys/stat.h>
+#include <sys/uio.h>
 
 #include <fcntl.h>
 #include <unistd.h>
@@ -107,14 +109,41 @@ static bool
 file_write(void *ptr, const void *buf, size_t len)
 {
 	CFWFile *file = ptr;
+	const char *pos = buf;
 	ssize_t ret;
 
-	if ((ret = write(file->fd, buf, len)) < len)
-		return false;
+	/* Pipes may accept a large buffer only in parts */
+	while (len > 0) {
+		if ((ret = write(file->fd, pos, len)) <= 0)
+			return false;
+
+		pos += ret;
+		len -= ret;
+	}
 
 	return true;
 }
 
+static ssize_t
+file_readv(void *ptr, const struct iovec *iov, int cnt)
+{
+	CFWFile *file = ptr;
+	ssize_t ret;
+
+	if ((ret = readv(file->fd, iov, cnt)) == 0)
+		file->at_end = true;
+
+	return ret;
+}
+
+static ssize_t
+file_writev(void *ptr, const struct iovec *iov, int cnt)
+{
+	CFWFile *file = ptr;
+
+	return writev(file->fd, iov, cnt);
+}
+
 static bool
 file_at_end(void *ptr)
 {
@@ -128,14 +157,28 @@ file_close(void *ptr)
 {
 	CFWFile *file = ptr;
 
-	close(file->fd);
+	if (file->fd != -1)
+		close(file->fd);
+
+	file->fd = -1;
+}
+
+static int
+file_fd(void *ptr)
+{
+	CFWFile *file = ptr;
+
+	return file->fd;
 }
 
 static struct cfw_stream_ops stream_ops = {
 	.read = file_read,
 	.write = file_write,
 	.at_end = file_at_end,
-	.close = file_close
+	.close = file_close,
+	.readv = file_readv,
+	.writev = file_writev,
+	.fd = file_fd
 };
 
 static bool
@@ -192,7 +235,9 @@ static CFWFile cfw_stdout_ = {
 			.cls = &class,
 			.ref_cnt = INT_MAX
 		},
-		.ops = &stream_ops
+		.ops = &stream_ops,
+		.write_size = CFW_STREAM_BUFSIZE,
+		.line_buffered = true
 	},
 	.fd = 1,
 	.at_end = false
@@ -211,3 +256,16 @@ static CFWFile cfw_stderr_ = {
 CFWFile *cfw_stdin = &cfw_stdin_;
 CFWFile *cfw_stdout = &cfw_stdout_;
 CFWFile *cfw_stderr = &cfw_stderr_;
+
+static void
+flush_stdout(void)
+{
+	cfw_stream_flush(cfw_stdout);
+}
+
+__attribute__((__constructor__))
+static void
+init(void)
+{
+	atexit(flush_stdout);
+}
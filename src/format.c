@@ -0,0 +1,468 @@
+/*
+ * Copyright (c) 2012, Jonathan Schleifer <js@webkeks.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
+#include <stddef.h>
+
+#include "object.h"
+#include "format.h"
+#include "number.h"
+#include "string.h"
+
+/*
+ * Enough for %f of DBL_MAX, which has 309 integer digits, with room for a
+ * moderate width or precision. Longer conversions go to the heap.
+ */
+#define FLOAT_BUFSIZE 1100
+
+struct spec {
+	bool left, plus, space, alt, zero;
+	int width, precision;
+	char length[3];
+	char conv;
+};
+
+static bool
+pad(cfw_writer_t write, void *ctx, char c, size_t len)
+{
+	static const char spaces[] = "                                ";
+	static const char zeros[] = "00000000000000000000000000000000";
+	const char *chars = (c == '0' ? zeros : spaces);
+
+	while (len > 0) {
+		size_t n = (len < sizeof(spaces) - 1 ? len : sizeof(spaces) - 1);
+
+		if (!write(ctx, chars, n))
+			return false;
+
+		len -= n;
+	}
+
+	return true;
+}
+
+static bool
+pad_width(cfw_writer_t write, void *ctx, const struct spec *spec,
+    const char *buf, size_t len)
+{
+	size_t fill = ((size_t)spec->width > len ? spec->width - len : 0);
+
+	if (!spec->left && !pad(write, ctx, ' ', fill))
+		return false;
+
+	if (!write(ctx, buf, len))
+		return false;
+
+	return (!spec->left || pad(write, ctx, ' ', fill));
+}
+
+static bool
+format_int(cfw_writer_t write, void *ctx, const struct spec *spec,
+    uintmax_t value, bool negative)
+{
+	const char *digit_chars = "0123456789abcdef", *sign = "", *prefix = "";
+	char buf[sizeof(uintmax_t) * 3 + 1];
+	size_t i = sizeof(buf), len, zeros = 0, total, fill;
+	unsigned base = 10;
+
+	switch (spec->conv) {
+	case 'X':
+		digit_chars = "0123456789ABCDEF";
+		/* Fall through */
+	case 'x':
+		base = 16;
+
+		if (spec->alt && value != 0)
+			prefix = (spec->conv == 'X' ? "0X" : "0x");
+		break;
+	case 'p':
+		base = 16;
+		prefix = "0x";
+		break;
+	case 'o':
+		base = 8;
+		break;
+	}
+
+	if (spec->conv == 'd' || spec->conv == 'i')
+		sign = (negative ? "-" : spec->plus ? "+" :
+		    spec->space ? " " : "");
+
+	/* A precision of 0 prints nothing for 0 */
+	if (value == 0 && spec->precision == 0)
+		len = 0;
+	else if (base == 10) {
+		len = cfw_format_uint(buf, value);
+		i = 0;
+	} else {
+		do {
+			buf[--i] = digit_chars[value % base];
+			value /= base;
+		} while (value > 0);
+
+		len = sizeof(buf) - i;
+	}
+
+	if (spec->precision >= 0 && (size_t)spec->precision > len)
+		zeros = spec->precision - len;
+
+	if (base == 8 && spec->alt && zeros == 0 && (len == 0 || buf[i] != '0'))
+		zeros = 1;
+
+	total = strlen(sign) + strlen(prefix) + zeros + len;
+
+	if (spec->zero && !spec->left && spec->precision < 0 &&
+	    (size_t)spec->width > total) {
+		zeros += spec->width - total;
+		total = spec->width;
+	}
+
+	fill = ((size_t)spec->width > total ? spec->width - total : 0);
+
+	if (!spec->left && !pad(write, ctx, ' ', fill))
+		return false;
+
+	if (!write(ctx, sign, strlen(sign)) ||
+	    !write(ctx, prefix, strlen(prefix)) ||
+	    !pad(write, ctx, '0', zeros) || !write(ctx, buf + i, len))
+		return false;
+
+	return (!spec->left || pad(write, ctx, ' ', fill));
+}
+
+/* Float conversions with all their flags are left to the libc, but once */
+static bool
+format_float(cfw_writer_t write, void *ctx, const struct spec *spec,
+    long double value, bool is_long)
+{
+	char fmt[16], stack_buf[FLOAT_BUFSIZE], *buf = stack_buf, *p = fmt;
+	int len;
+	bool ret;
+
+	*p++ = '%';
+	if (spec->left)
+		*p++ = '-';
+	if (spec->plus)
+		*p++ = '+';
+	if (spec->space)
+		*p++ = ' ';
+	if (spec->alt)
+		*p++ = '#';
+	if (spec->zero)
+		*p++ = '0';
+	*p++ = '*';
+	*p++ = '.';
+	*p++ = '*';
+	if (is_long)
+		*p++ = 'L';
+	*p++ = spec->conv;
+	*p = '\0';
+
+	if (is_long)
+		len = snprintf(buf, FLOAT_BUFSIZE, fmt, spec->width,
+		    spec->precision, value);
+	else
+		len = snprintf(buf, FLOAT_BUFSIZE, fmt, spec->width,
+		    spec->precision, (double)value);
+
+	if (len < 0)
+		return false;
+
+	if (len >= FLOAT_BUFSIZE) {
+		if ((buf = malloc((size_t)len + 1)) == NULL)
+			return false;
+
+		if (is_long)
+			snprintf(buf, (size_t)len + 1, fmt, spec->width,
+			    spec->precision, value);
+		else
+			snprintf(buf, (size_t)len + 1, fmt, spec->width,
+			    spec->precision, (double)value);
+	}
+
+	ret = write(ctx, buf, len);
+
+	if (buf != stack_buf)
+		free(buf);
+
+	return ret;
+}
+
+struct counter {
+	cfw_writer_t write;
+	void *ctx;
+	size_t len;
+};
+
+static bool
+count_write(void *ptr, const void *buf, size_t len)
+{
+	struct counter *counter = ptr;
+
+	counter->len += len;
+
+	return counter->write(counter->ctx, buf, len);
+}
+
+/* Like printf, a number that does not fit into an int is an error */
+static bool
+parse_number(const char **fmt, int *out)
+{
+	int value = 0, digit;
+
+	for (; **fmt >= '0' && **fmt <= '9'; (*fmt)++) {
+		digit = **fmt - '0';
+
+		if (value > (INT_MAX - digit) / 10)
+			return false;
+
+		value = value * 10 + digit;
+	}
+
+	*out = value;
+
+	return true;
+}
+
+static const char*
+parse_spec(const char *fmt, struct spec *spec, va_list *args)
+{
+	size_t i = 0;
+
+	memset(spec, 0, sizeof(*spec));
+	spec->precision = -1;
+
+	for (;; fmt++) {
+		if (*fmt == '-')
+			spec->left = true;
+		else if (*fmt == '+')
+			spec->plus = true;
+		else if (*fmt == ' ')
+			spec->space = true;
+		else if (*fmt == '#')
+			spec->alt = true;
+		else if (*fmt == '0')
+			spec->zero = true;
+		else
+			break;
+	}
+
+	if (*fmt == '*') {
+		if ((spec->width = va_arg(*args, int)) < 0) {
+			if (spec->width == INT_MIN)
+				return NULL;
+
+			spec->left = true;
+			spec->width = -spec->width;
+		}
+
+		fmt++;
+	} else if (!parse_number(&fmt, &spec->width))
+		return NULL;
+
+	if (*fmt == '.') {
+		if (*++fmt == '*') {
+			/* A negative precision counts as none */
+			if ((spec->precision = va_arg(*args, int)) < 0)
+				spec->precision = -1;
+
+			fmt++;
+		} else if (!parse_number(&fmt, &spec->precision))
+			return NULL;
+	}
+
+	while (i < 2 && strchr("hljztL", *fmt) != NULL &&
+	    (i == 0 || *fmt == spec->length[0]))
+		spec->length[i++] = *fmt++;
+
+	spec->conv = *fmt;
+
+	return (*fmt != '\0' ? fmt + 1 : NULL);
+}
+
+static uintmax_t
+unsigned_arg(const struct spec *spec, va_list *args)
+{
+	switch (spec->length[0]) {
+	case 'h':
+		if (spec->length[1] == 'h')
+			return (unsigned char)va_arg(*args, unsigned);
+		return (unsigned short)va_arg(*args, unsigned);
+	case 'l':
+		if (spec->length[1] == 'l')
+			return va_arg(*args, unsigned long long);
+		return va_arg(*args, unsigned long);
+	case 'j':
+		return va_arg(*args, uintmax_t);
+	case 'z':
+		return va_arg(*args, size_t);
+	case 't':
+		return va_arg(*args, ptrdiff_t);
+	default:
+		return va_arg(*args, unsigned);
+	}
+}
+
+static intmax_t
+signed_arg(const struct spec *spec, va_list *args)
+{
+	switch (spec->length[0]) {
+	case 'h':
+		if (spec->length[1] == 'h')
+			return (signed char)va_arg(*args, int);
+		return (short)va_arg(*args, int);
+	case 'l':
+		if (spec->length[1] == 'l')
+			return va_arg(*args, long long);
+		return va_arg(*args, long);
+	case 'j':
+		return va_arg(*args, intmax_t);
+	case 'z':
+		return va_arg(*args, size_t);
+	case 't':
+		return va_arg(*args, ptrdiff_t);
+	default:
+		return va_arg(*args, int);
+	}
+}
+
+bool
+cfw_vformat(cfw_writer_t write, void *ctx, const char *fmt, va_list args)
+{
+	struct spec spec;
+	const char *pct, *str;
+	va_list ap;
+	bool ret = true;
+
+	va_copy(ap, args);
+
+	while (ret && *fmt != '\0') {
+		/* Literal runs are written in one go */
+		if ((pct = strchr(fmt, '%')) == NULL)
+			pct = fmt + strlen(fmt);
+
+		if (pct > fmt && !write(ctx, fmt, pct - fmt)) {
+			ret = false;
+			break;
+		}
+
+		if (*pct == '\0')
+			break;
+
+		if ((fmt = parse_spec(pct + 1, &spec, &ap)) == NULL) {
+			ret = false;
+			break;
+		}
+
+		switch (spec.conv) {
+		case '%':
+			ret = write(ctx, "%", 1);
+			break;
+		case 'd':
+		case 'i': {
+			intmax_t value = signed_arg(&spec, &ap);
+
+			ret = format_int(write, ctx, &spec,
+			    (value < 0 ? -(uintmax_t)value : (uintmax_t)value),
+			    value < 0);
+			break;
+		}
+		case 'u':
+		case 'x':
+		case 'X':
+		case 'o':
+			ret = format_int(write, ctx, &spec,
+			    unsigned_arg(&spec, &ap), false);
+			break;
+		case 'p':
+			ret = format_int(write, ctx, &spec,
+			    (uintptr_t)va_arg(ap, void*), false);
+			break;
+		case 'c': {
+			char c = (char)va_arg(ap, int);
+
+			ret = pad_width(write, ctx, &spec, &c, 1);
+			break;
+		}
+		case 's':
+			if ((str = va_arg(ap, const char*)) == NULL)
+				str = "(null)";
+
+			ret = pad_width(write, ctx, &spec, str,
+			    (spec.precision >= 0 ? cfw_strnlen(str,
+			    spec.precision) : strlen(str)));
+			break;
+		case 'f':
+		case 'F':
+		case 'e':
+		case 'E':
+		case 'g':
+		case 'G':
+		case 'a':
+		case 'A':
+			if (spec.length[0] == 'L')
+				ret = format_float(write, ctx, &spec,
+				    va_arg(ap, long double), true);
+			else
+				ret = format_float(write, ctx, &spec,
+				    va_arg(ap, double), false);
+			break;
+		case '@': {
+			struct counter counter = { write, ctx, 0 };
+
+			/* Only left alignment can be padded without a buffer */
+			ret = (cfw_describe(va_arg(ap, void*), count_write,
+			    &counter) && (!spec.left ||
+			    (size_t)spec.width <= counter.len ||
+			    pad(write, ctx, ' ', spec.width - counter.len)));
+			break;
+		}
+		default:
+			ret = false;
+		}
+	}
+
+	va_end(ap);
+
+	return ret;
+}
+
+bool
+cfw_format(cfw_writer_t write, void *ctx, const char *fmt, ...)
+{
+	va_list args;
+	bool ret;
+
+	va_start(args, fmt);
+	ret = cfw_vformat(write, ctx, fmt, args);
+	va_end(args);
+
+	return ret;
+}
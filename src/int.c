@@ -26,6 +26,7 @@
 
 #include "object.h"
 #include "int.h"
+#include "number.h"
 
 struct CFWInt {
 	CFWObject obj;
@@ -77,12 +78,22 @@ cfw_int_value(CFWInt *integer)
 	return integer->value;
 }
 
+static bool
+describe(void *ptr, cfw_writer_t write, void *ctx)
+{
+	CFWInt *integer = ptr;
+	char buf[CFW_INT_BUFSIZE];
+
+	return write(ctx, buf, cfw_format_int(buf, integer->value));
+}
+
 static CFWClass class = {
 	.name = "CFWInt",
 	.size = sizeof(CFWInt),
 	.ctor = ctor,
 	.equal = equal,
 	.hash = hash,
-	.copy = copy
+	.copy = copy,
+	.describe = describe
 };
 CFWClass *cfw_int = &class;
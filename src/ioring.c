@@ -0,0 +1,654 @@
+/*
+ * Copyright (c) 2012, Jonathan Schleifer <js@webkeks.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include <unistd.h>
+
+#ifdef __linux__
+# include <sys/mman.h>
+# include <sys/socket.h>
+# include <sys/syscall.h>
+# include <linux/io_uring.h>
+#endif
+
+#include "object.h"
+#include "ioring.h"
+#include "stream.h"
+#include "tcpsocket.h"
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+# define HAVE_IO_URING
+#endif
+
+#define DEFAULT_ENTRIES 256
+#define FIXED_FILES 4096
+#define MAX_RW 0x7ffff000
+
+#ifdef HAVE_IO_URING
+# define FEATURES (IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | \
+    IORING_FEAT_RW_CUR_POS)
+#endif
+
+#ifdef HAVE_IO_URING
+/*
+ * Indexed by descriptor, but only valid for the stream that registered it,
+ * so that a reused descriptor never reaches the old file's slot.
+ */
+struct fixed_file {
+	CFWStream *stream;
+	unsigned slot;
+};
+#endif
+
+/* A ring is meant to be driven by a single thread */
+struct CFWIORing {
+	CFWObject obj;
+	int fd;
+#ifdef HAVE_IO_URING
+	unsigned *sq_head, *sq_tail, sq_mask, sq_entries;
+	unsigned sq_local, sq_pending;
+	unsigned *cq_head, *cq_tail, cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *ring_map, *sqe_map;
+	size_t ring_len, sqe_len, inflight;
+	int *slots;
+	struct fixed_file *fixed;
+	size_t fixed_size;
+	unsigned next_slot;
+	bool bufs_registered;
+#endif
+	cfw_ioring_completion_t *done;
+	size_t done_pos, done_len, done_cap;
+	struct iovec *bufs;
+	unsigned bufs_cnt;
+};
+
+#ifdef HAVE_IO_URING
+static void
+teardown(CFWIORing *ring)
+{
+	if (ring->sqe_map != NULL)
+		munmap(ring->sqe_map, ring->sqe_len);
+	if (ring->ring_map != NULL)
+		munmap(ring->ring_map, ring->ring_len);
+	if (ring->fd != -1)
+		close(ring->fd);
+
+	ring->sqe_map = NULL;
+	ring->ring_map = NULL;
+	ring->fd = -1;
+}
+
+static bool
+setup(CFWIORing *ring, unsigned entries)
+{
+	struct io_uring_params p;
+	size_t cq_len;
+	char *map;
+	unsigned i, *array;
+
+	memset(&p, 0, sizeof(p));
+
+	if ((ring->fd = syscall(__NR_io_uring_setup, entries, &p)) == -1)
+		return false;
+
+	if ((p.features & FEATURES) != FEATURES) {
+		teardown(ring);
+		return false;
+	}
+
+	ring->ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (cq_len > ring->ring_len)
+		ring->ring_len = cq_len;
+	ring->sqe_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	if ((map = mmap(NULL, ring->ring_len, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING)) ==
+	    MAP_FAILED) {
+		teardown(ring);
+		return false;
+	}
+	ring->ring_map = map;
+
+	if ((ring->sqe_map = mmap(NULL, ring->sqe_len, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES)) ==
+	    MAP_FAILED) {
+		ring->sqe_map = NULL;
+		teardown(ring);
+		return false;
+	}
+
+	ring->sq_head = (unsigned*)(map + p.sq_off.head);
+	ring->sq_tail = (unsigned*)(map + p.sq_off.tail);
+	ring->sq_mask = *(unsigned*)(map + p.sq_off.ring_mask);
+	ring->sq_entries = p.sq_entries;
+	ring->sq_local = *ring->sq_tail;
+	ring->cq_head = (unsigned*)(map + p.cq_off.head);
+	ring->cq_tail = (unsigned*)(map + p.cq_off.tail);
+	ring->cq_mask = *(unsigned*)(map + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*)(map + p.cq_off.cqes);
+	ring->sqes = ring->sqe_map;
+
+	/* SQEs are always used in order, so the indirection is fixed */
+	array = (unsigned*)(map + p.sq_off.array);
+	for (i = 0; i < p.sq_entries; i++)
+		array[i] = i;
+
+	return true;
+}
+
+static size_t
+reap(CFWIORing *ring, cfw_ioring_completion_t *out, size_t cnt)
+{
+	unsigned head = *ring->cq_head;
+	unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	size_t n = 0;
+
+	for (; head != tail && n < cnt; head++, n++) {
+		struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+
+		out[n].ctx = (void*)(uintptr_t)cqe->user_data;
+		out[n].res = cqe->res;
+	}
+
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	ring->inflight -= n;
+
+	return n;
+}
+
+static int
+enter(CFWIORing *ring, size_t min, unsigned flags)
+{
+	int ret;
+
+	__atomic_store_n(ring->sq_tail, ring->sq_local, __ATOMIC_RELEASE);
+
+	do {
+		ret = syscall(__NR_io_uring_enter, ring->fd, ring->sq_pending,
+		    (unsigned)min, flags, NULL, 0);
+	} while (ret == -1 && errno == EINTR);
+
+	if (ret == -1)
+		return -1;
+
+	ring->sq_pending -= ret;
+	ring->inflight += ret;
+
+	return ret;
+}
+
+static struct io_uring_sqe*
+get_sqe(CFWIORing *ring)
+{
+	struct io_uring_sqe *sqe;
+
+	/* Make room by handing what is queued to the kernel */
+	if (ring->sq_local - __atomic_load_n(ring->sq_head,
+	    __ATOMIC_ACQUIRE) == ring->sq_entries && enter(ring, 0, 0) <= 0)
+		return NULL;
+
+	sqe = &ring->sqes[ring->sq_local & ring->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+
+	ring->sq_local++;
+	ring->sq_pending++;
+
+	return sqe;
+}
+#endif
+
+static bool
+ctor(void *ptr, va_list args)
+{
+	CFWIORing *ring = ptr;
+	size_t entries = va_arg(args, size_t);
+
+	ring->fd = -1;
+#ifdef HAVE_IO_URING
+	ring->ring_map = NULL;
+	ring->sqe_map = NULL;
+	ring->sq_pending = 0;
+	ring->inflight = 0;
+	ring->slots = NULL;
+	ring->fixed = NULL;
+	ring->fixed_size = 0;
+	ring->next_slot = 0;
+	ring->bufs_registered = false;
+#endif
+	ring->done = NULL;
+	ring->done_pos = 0;
+	ring->done_len = 0;
+	ring->done_cap = 0;
+	ring->bufs = NULL;
+	ring->bufs_cnt = 0;
+
+	if (entries == 0)
+		entries = DEFAULT_ENTRIES;
+	if (entries > 32768)
+		entries = 32768;
+
+#ifdef HAVE_IO_URING
+	/* Without io_uring, operations are performed when they are queued */
+	setup(ring, entries);
+#endif
+
+	return true;
+}
+
+static void
+dtor(void *ptr)
+{
+	CFWIORing *ring = ptr;
+#ifdef HAVE_IO_URING
+	size_t i;
+
+	teardown(ring);
+
+	for (i = 0; i < ring->fixed_size; i++)
+		cfw_unref(ring->fixed[i].stream);
+
+	free(ring->slots);
+	free(ring->fixed);
+#endif
+	free(ring->done);
+	free(ring->bufs);
+}
+
+bool
+cfw_ioring_is_native(CFWIORing *ring)
+{
+	return (ring->fd != -1);
+}
+
+static bool
+complete(CFWIORing *ring, void *ctx, ssize_t res)
+{
+	if (ring->done_pos + ring->done_len == ring->done_cap) {
+		if (ring->done_pos > 0) {
+			memmove(ring->done, ring->done + ring->done_pos,
+			    ring->done_len * sizeof(*ring->done));
+			ring->done_pos = 0;
+		} else {
+			cfw_ioring_completion_t *new;
+			size_t cap = (ring->done_cap < 16 ? 16 :
+			    ring->done_cap * 2);
+
+			if ((new = realloc(ring->done,
+			    cap * sizeof(*new))) == NULL)
+				return false;
+
+			ring->done = new;
+			ring->done_cap = cap;
+		}
+	}
+
+	ring->done[ring->done_pos + ring->done_len].ctx = ctx;
+	ring->done[ring->done_pos + ring->done_len].res = res;
+	ring->done_len++;
+
+	return true;
+}
+
+bool
+cfw_ioring_register_buffers(CFWIORing *ring, const struct iovec *iov,
+    unsigned cnt)
+{
+	if (ring->bufs != NULL || cnt == 0)
+		return false;
+
+	if ((ring->bufs = malloc(cnt * sizeof(*iov))) == NULL)
+		return false;
+
+	memcpy(ring->bufs, iov, cnt * sizeof(*iov));
+	ring->bufs_cnt = cnt;
+
+#ifdef HAVE_IO_URING
+	/* If the buffers can't be pinned, the fixed ops still work */
+	if (ring->fd != -1 && syscall(__NR_io_uring_register, ring->fd,
+	    IORING_REGISTER_BUFFERS, iov, cnt) == 0)
+		ring->bufs_registered = true;
+#endif
+
+	return true;
+}
+
+#ifdef HAVE_IO_URING
+static bool
+release_fixed(CFWIORing *ring, size_t fd)
+{
+	struct io_uring_files_update up;
+	unsigned slot = ring->fixed[fd].slot;
+	int none = -1;
+
+	memset(&up, 0, sizeof(up));
+	up.offset = slot;
+	up.fds = (uintptr_t)&none;
+
+	if (syscall(__NR_io_uring_register, ring->fd,
+	    IORING_REGISTER_FILES_UPDATE, &up, 1) != 1)
+		return false;
+
+	ring->slots[slot] = -1;
+	cfw_unref(ring->fixed[fd].stream);
+	ring->fixed[fd].stream = NULL;
+
+	return true;
+}
+#endif
+
+/*
+ * A registered stream is kept alive by the ring until it is unregistered or
+ * the ring goes away.
+ */
+bool
+cfw_ioring_register_stream(CFWIORing *ring, void *stream)
+{
+#ifdef HAVE_IO_URING
+	struct io_uring_files_update up;
+	unsigned i;
+	int fd;
+
+	if ((fd = cfw_stream_fd(stream)) == -1)
+		return false;
+
+	if (ring->fd == -1)
+		return true;
+
+	if ((size_t)fd < ring->fixed_size && ring->fixed[fd].stream == stream)
+		return true;
+
+	if (ring->slots == NULL) {
+		int *slots;
+
+		if ((slots = malloc(FIXED_FILES * sizeof(int))) == NULL)
+			return false;
+
+		for (i = 0; i < FIXED_FILES; i++)
+			slots[i] = -1;
+
+		if (syscall(__NR_io_uring_register, ring->fd,
+		    IORING_REGISTER_FILES, slots, FIXED_FILES) == -1) {
+			free(slots);
+			return false;
+		}
+
+		ring->slots = slots;
+	}
+
+	if ((size_t)fd >= ring->fixed_size) {
+		size_t size = (ring->fixed_size < 64 ? 64 : ring->fixed_size);
+		struct fixed_file *new;
+
+		while (size <= (size_t)fd)
+			size *= 2;
+
+		if ((new = realloc(ring->fixed, size * sizeof(*new))) == NULL)
+			return false;
+
+		memset(new + ring->fixed_size, 0,
+		    (size - ring->fixed_size) * sizeof(*new));
+		ring->fixed = new;
+		ring->fixed_size = size;
+	}
+
+	/* A stream closed while registered left its slot behind */
+	if (ring->fixed[fd].stream != NULL && !release_fixed(ring, fd))
+		return false;
+
+	for (i = 0; i < FIXED_FILES; i++)
+		if (ring->slots[(ring->next_slot + i) % FIXED_FILES] == -1)
+			break;
+
+	if (i == FIXED_FILES)
+		return false;
+
+	i = (ring->next_slot + i) % FIXED_FILES;
+
+	memset(&up, 0, sizeof(up));
+	up.offset = i;
+	up.fds = (uintptr_t)&fd;
+
+	if (syscall(__NR_io_uring_register, ring->fd,
+	    IORING_REGISTER_FILES_UPDATE, &up, 1) != 1)
+		return false;
+
+	ring->slots[i] = fd;
+	ring->fixed[fd].stream = cfw_ref(stream);
+	ring->fixed[fd].slot = i;
+	ring->next_slot = (i + 1) % FIXED_FILES;
+
+	return true;
+#else
+	return (cfw_stream_fd(stream) != -1);
+#endif
+}
+
+bool
+cfw_ioring_unregister_stream(CFWIORing *ring, void *stream)
+{
+#ifdef HAVE_IO_URING
+	size_t fd;
+
+	if (ring->fd == -1)
+		return (cfw_stream_fd(stream) != -1);
+
+	/* A closed stream no longer has its descriptor */
+	for (fd = 0; fd < ring->fixed_size; fd++)
+		if (ring->fixed[fd].stream == stream)
+			return release_fixed(ring, fd);
+
+	return false;
+#else
+	return (cfw_stream_fd(stream) != -1);
+#endif
+}
+
+static bool
+queue(CFWIORing *ring, CFWStream *stream, bool write, void *buf, size_t len,
+    int buf_index, void *ctx)
+{
+	ssize_t ret;
+#ifdef HAVE_IO_URING
+	int fd;
+#endif
+
+	if (stream == NULL || stream->ops == NULL)
+		return false;
+
+	if (len > MAX_RW)
+		len = MAX_RW;
+
+	/* The kernel must not overtake what the stream has buffered */
+	if (!write && stream->read_len > 0)
+		return complete(ring, ctx, cfw_stream_read(stream, buf, len));
+
+	if (write && stream->write_len > 0 && !cfw_stream_flush(stream))
+		return false;
+
+#ifdef HAVE_IO_URING
+	if (ring->fd != -1 && (fd = cfw_stream_fd(stream)) != -1) {
+		struct io_uring_sqe *sqe;
+
+		if ((sqe = get_sqe(ring)) == NULL)
+			return false;
+
+		/* Like sock_write, writes must not raise SIGPIPE */
+		if (cfw_is(stream, cfw_tcpsocket)) {
+			sqe->opcode = (write ? IORING_OP_SEND :
+			    IORING_OP_RECV);
+			sqe->msg_flags = (write ? MSG_NOSIGNAL : 0);
+		} else {
+			if (buf_index >= 0 && ring->bufs_registered) {
+				sqe->opcode = (write ? IORING_OP_WRITE_FIXED :
+				    IORING_OP_READ_FIXED);
+				sqe->buf_index = buf_index;
+			} else
+				sqe->opcode = (write ? IORING_OP_WRITE :
+				    IORING_OP_READ);
+
+			/* Use and update the file position like read/write */
+			sqe->off = (uint64_t)-1;
+		}
+
+		if ((size_t)fd < ring->fixed_size &&
+		    ring->fixed[fd].stream == stream) {
+			sqe->fd = ring->fixed[fd].slot;
+			sqe->flags = IOSQE_FIXED_FILE;
+		} else
+			sqe->fd = fd;
+
+		sqe->addr = (uintptr_t)buf;
+		sqe->len = len;
+		sqe->user_data = (uintptr_t)ctx;
+
+		return true;
+	}
+#endif
+
+	/* Failures complete with -errno, just like they do from the kernel */
+	if (write) {
+		errno = 0;
+		if (stream->ops->write(stream, buf, len))
+			ret = len;
+		else
+			ret = -(errno != 0 ? errno : EIO);
+
+		return complete(ring, ctx, ret);
+	}
+
+	if ((ret = stream->ops->read(stream, buf, len)) < 0)
+		ret = -errno;
+
+	return complete(ring, ctx, ret);
+}
+
+bool
+cfw_ioring_read(CFWIORing *ring, void *stream, void *buf, size_t len,
+    void *ctx)
+{
+	return queue(ring, stream, false, buf, len, -1, ctx);
+}
+
+bool
+cfw_ioring_write(CFWIORing *ring, void *stream, const void *buf, size_t len,
+    void *ctx)
+{
+	return queue(ring, stream, true, (void*)buf, len, -1, ctx);
+}
+
+bool
+cfw_ioring_read_fixed(CFWIORing *ring, void *stream, unsigned idx, size_t off,
+    size_t len, void *ctx)
+{
+	if (idx >= ring->bufs_cnt || off > ring->bufs[idx].iov_len ||
+	    len > ring->bufs[idx].iov_len - off)
+		return false;
+
+	return queue(ring, stream, false,
+	    (char*)ring->bufs[idx].iov_base + off, len, idx, ctx);
+}
+
+bool
+cfw_ioring_write_fixed(CFWIORing *ring, void *stream, unsigned idx,
+    size_t off, size_t len, void *ctx)
+{
+	if (idx >= ring->bufs_cnt || off > ring->bufs[idx].iov_len ||
+	    len > ring->bufs[idx].iov_len - off)
+		return false;
+
+	return queue(ring, stream, true,
+	    (char*)ring->bufs[idx].iov_base + off, len, idx, ctx);
+}
+
+int
+cfw_ioring_submit(CFWIORing *ring)
+{
+#ifdef HAVE_IO_URING
+	if (ring->fd != -1 && ring->sq_pending > 0)
+		return enter(ring, 0, 0);
+#endif
+
+	return 0;
+}
+
+size_t
+cfw_ioring_wait(CFWIORing *ring, cfw_ioring_completion_t *out, size_t cnt,
+    size_t min)
+{
+	size_t got = 0;
+
+	for (; got < cnt && ring->done_len > 0; got++) {
+		out[got] = ring->done[ring->done_pos++];
+		ring->done_len--;
+	}
+
+	if (ring->done_len == 0)
+		ring->done_pos = 0;
+
+#ifdef HAVE_IO_URING
+	if (ring->fd == -1)
+		return got;
+
+	if (min > cnt)
+		min = cnt;
+
+	for (;;) {
+		size_t want;
+
+		got += reap(ring, out + got, cnt - got);
+
+		if (got >= min || ring->inflight + ring->sq_pending == 0)
+			break;
+
+		/* Never wait for more than can still complete */
+		want = min - got;
+		if (want > ring->inflight + ring->sq_pending)
+			want = ring->inflight + ring->sq_pending;
+
+		if (enter(ring, want, IORING_ENTER_GETEVENTS) == -1)
+			break;
+	}
+#endif
+
+	return got;
+}
+
+static CFWClass class = {
+	.name = "CFWIORing",
+	.size = sizeof(CFWIORing),
+	.ctor = ctor,
+	.dtor = dtor
+};
+CFWClass *cfw_ioring = &class;
@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2012, Jonathan Schleifer <js@webkeks.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __COREFW_IORING_H__
+#define __COREFW_IORING_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "class.h"
+
+typedef struct CFWIORing CFWIORing;
+
+typedef struct cfw_ioring_completion_t {
+	void *ctx;
+	ssize_t res;
+} cfw_ioring_completion_t;
+
+/* cfw_new(cfw_ioring, (size_t)entries), entries must be passed as size_t */
+extern CFWClass *cfw_ioring;
+extern bool cfw_ioring_is_native(CFWIORing*);
+extern bool cfw_ioring_register_buffers(CFWIORing*, const struct iovec*,
+    unsigned);
+extern bool cfw_ioring_register_stream(CFWIORing*, void*);
+extern bool cfw_ioring_unregister_stream(CFWIORing*, void*);
+extern bool cfw_ioring_read(CFWIORing*, void*, void*, size_t, void*);
+extern bool cfw_ioring_write(CFWIORing*, void*, const void*, size_t, void*);
+extern bool cfw_ioring_read_fixed(CFWIORing*, void*, unsigned, size_t, size_t,
+    void*);
+extern bool cfw_ioring_write_fixed(CFWIORing*, void*, unsigned, size_t,
+    size_t, void*);
+extern int cfw_ioring_submit(CFWIORing*);
+extern size_t cfw_ioring_wait(CFWIORing*, cfw_ioring_completion_t*, size_t,
+    size_t);
+
+#endif
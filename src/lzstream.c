@@ -0,0 +1,697 @@
+/*
+ * Copyright (c) 2012, Jonathan Schleifer <js@webkeks.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "stream.h"
+#include "lzstream.h"
+
+/*
+ * The frame is the magic, a version byte and the block size as a 32 bit
+ * little endian number. Each block follows as its stored length, with the
+ * high bit set if it is not compressed, and the xxHash32 of its contents.
+ * A stored length of 0 ends the frame.
+ *
+ * Blocks use the LZ4 block format: a token holding the literal and match
+ * lengths, extra length bytes, the literals, a 16 bit offset and more
+ * extra length bytes for the match.
+ */
+#define MAGIC "CFWZ"
+#define VERSION 1
+#define HEADER_SIZE 9
+#define BLOCK_HEADER_SIZE 8
+#define BLOCK_DEFAULT 65536
+#define BLOCK_MAX (4 * 1024 * 1024)
+#define BLOCK_RAW 0x80000000U
+
+#define HASH_LOG 12
+#define MIN_MATCH 4
+#define LAST_LITERALS 5
+#define MATCH_LIMIT 12
+#define MAX_OFFSET 65535
+
+#define PRIME1 2654435761U
+#define PRIME2 2246822519U
+#define PRIME3 3266489917U
+#define PRIME4 668265263U
+#define PRIME5 374761393U
+
+struct CFWLZStream {
+	CFWStream stream;
+	CFWStream *inner;
+	size_t block_size;
+	uint8_t *block, *out;
+	size_t block_len, plain_pos, plain_len;
+	bool header_done, at_end, finished, closed, writing;
+	uint32_t table[1 << HASH_LOG];
+};
+
+static uint32_t
+load32(const uint8_t *p)
+{
+	return (uint32_t)p[0] | (uint32_t)p[1] << 8 |
+	    (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void
+store32(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static uint32_t
+rotl(uint32_t v, int r)
+{
+	return (v << r) | (v >> (32 - r));
+}
+
+static uint32_t
+xxh32_round(uint32_t acc, uint32_t v)
+{
+	return rotl(acc + v * PRIME2, 13) * PRIME1;
+}
+
+static uint32_t
+xxh32(const uint8_t *p, size_t len)
+{
+	const uint8_t *end = p + len;
+	uint32_t h, v1, v2, v3, v4;
+
+	if (len >= 16) {
+		v1 = PRIME1 + PRIME2;
+		v2 = PRIME2;
+		v3 = 0;
+		v4 = 0U - PRIME1;
+
+		do {
+			v1 = xxh32_round(v1, load32(p));
+			v2 = xxh32_round(v2, load32(p + 4));
+			v3 = xxh32_round(v3, load32(p + 8));
+			v4 = xxh32_round(v4, load32(p + 12));
+			p += 16;
+		} while (end - p >= 16);
+
+		h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+	} else
+		h = PRIME5;
+
+	h += (uint32_t)len;
+
+	for (; end - p >= 4; p += 4)
+		h = rotl(h + load32(p) * PRIME3, 17) * PRIME4;
+	for (; p < end; p++)
+		h = rotl(h + *p * PRIME5, 11) * PRIME1;
+
+	h ^= h >> 15;
+	h *= PRIME2;
+	h ^= h >> 13;
+	h *= PRIME3;
+	h ^= h >> 16;
+
+	return h;
+}
+
+static uint32_t
+hash(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, 4);
+
+	return (v * PRIME1) >> (32 - HASH_LOG);
+}
+
+static uint8_t*
+put_length(uint8_t *op, size_t len)
+{
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = len;
+
+	return op;
+}
+
+static uint8_t*
+put_sequence(uint8_t *op, const uint8_t *lit, size_t lit_len, size_t off,
+    size_t match_len)
+{
+	uint8_t *token = op++;
+
+	if (lit_len >= 15) {
+		*token = 15 << 4;
+		op = put_length(op, lit_len - 15);
+	} else
+		*token = lit_len << 4;
+
+	memcpy(op, lit, lit_len);
+	op += lit_len;
+
+	/* The last sequence only has literals */
+	if (match_len == 0)
+		return op;
+
+	*op++ = off;
+	*op++ = off >> 8;
+
+	match_len -= MIN_MATCH;
+	if (match_len >= 15) {
+		*token |= 15;
+		op = put_length(op, match_len - 15);
+	} else
+		*token |= match_len;
+
+	return op;
+}
+
+/* dst needs room for bound(len) bytes */
+static size_t
+bound(size_t len)
+{
+	return len + len / 255 + 16;
+}
+
+static size_t
+compress_block(uint32_t *table, const uint8_t *src, size_t len, uint8_t *dst)
+{
+	const uint8_t *ip = src, *anchor = src, *end = src + len, *ref;
+	uint8_t *op = dst;
+	size_t match_len;
+	uint32_t h;
+
+	memset(table, 0, sizeof(*table) << HASH_LOG);
+
+	if (len > MATCH_LIMIT) {
+		while (ip < end - MATCH_LIMIT) {
+			h = hash(ip);
+			ref = src + table[h];
+			table[h] = ip - src;
+
+			if (ref >= ip || ip - ref > MAX_OFFSET ||
+			    memcmp(ref, ip, MIN_MATCH)) {
+				/* Skip faster through data that does not match */
+				ip += 1 + ((ip - anchor) >> 6);
+				continue;
+			}
+
+			while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+				ip--;
+				ref--;
+			}
+
+			match_len = MIN_MATCH;
+			while (ip + match_len < end - LAST_LITERALS &&
+			    ip[match_len] == ref[match_len])
+				match_len++;
+
+			op = put_sequence(op, anchor, ip - anchor, ip - ref,
+			    match_len);
+			ip += match_len;
+			anchor = ip;
+		}
+	}
+
+	op = put_sequence(op, anchor, end - anchor, 0, 0);
+
+	return op - dst;
+}
+
+static bool
+get_length(const uint8_t **ip, const uint8_t *end, size_t *len, size_t max)
+{
+	uint8_t c;
+
+	do {
+		if (*ip >= end || *len > max)
+			return false;
+
+		c = *(*ip)++;
+		*len += c;
+	} while (c == 255);
+
+	return true;
+}
+
+static ssize_t
+decompress_block(const uint8_t *src, size_t len, uint8_t *dst, size_t size)
+{
+	const uint8_t *ip = src, *end = src + len;
+	uint8_t *op = dst;
+	size_t lit_len, match_len, off;
+	uint8_t token;
+
+	for (;;) {
+		if (ip >= end)
+			return -1;
+
+		token = *ip++;
+
+		lit_len = token >> 4;
+		if (lit_len == 15 && !get_length(&ip, end, &lit_len, size))
+			return -1;
+
+		if (lit_len > (size_t)(end - ip) ||
+		    lit_len > size - (size_t)(op - dst))
+			return -1;
+
+		memcpy(op, ip, lit_len);
+		ip += lit_len;
+		op += lit_len;
+
+		if (ip == end)
+			break;
+
+		if (end - ip < 2)
+			return -1;
+
+		off = ip[0] | ip[1] << 8;
+		ip += 2;
+
+		if (off == 0 || off > (size_t)(op - dst))
+			return -1;
+
+		match_len = token & 15;
+		if (match_len == 15 &&
+		    !get_length(&ip, end, &match_len, size))
+			return -1;
+		match_len += MIN_MATCH;
+
+		if (match_len > size - (size_t)(op - dst))
+			return -1;
+
+		/* Overlapping matches repeat the last off bytes */
+		if (off >= match_len)
+			memcpy(op, op - off, match_len);
+		else {
+			const uint8_t *ref = op - off;
+			size_t i;
+
+			for (i = 0; i < match_len; i++)
+				op[i] = ref[i];
+		}
+		op += match_len;
+	}
+
+	return op - dst;
+}
+
+static bool
+alloc_buffers(CFWLZStream *lz)
+{
+	if (lz->block != NULL)
+		return true;
+
+	if ((lz->block = malloc(lz->block_size)) == NULL)
+		return false;
+
+	if ((lz->out = malloc(bound(lz->block_size))) == NULL) {
+		free(lz->block);
+		lz->block = NULL;
+		return false;
+	}
+
+	return true;
+}
+
+static bool
+read_full(CFWStream *stream, void *buf, size_t len)
+{
+	char *pos = buf;
+	ssize_t ret;
+
+	while (len > 0) {
+		if ((ret = cfw_stream_read(stream, pos, len)) <= 0)
+			return false;
+
+		pos += ret;
+		len -= ret;
+	}
+
+	return true;
+}
+
+static bool
+read_header(CFWLZStream *lz)
+{
+	uint8_t header[HEADER_SIZE];
+	ssize_t ret;
+
+	if ((ret = cfw_stream_read(lz->inner, header, HEADER_SIZE)) <= 0) {
+		/* Nothing was ever written, which is an empty stream */
+		if (ret == 0 && cfw_stream_at_end(lz->inner)) {
+			lz->at_end = true;
+			return true;
+		}
+
+		return false;
+	}
+
+	if (!read_full(lz->inner, header + ret, HEADER_SIZE - ret))
+		return false;
+
+	if (memcmp(header, MAGIC, 4) || header[4] != VERSION)
+		return false;
+
+	lz->block_size = load32(header + 5);
+	if (lz->block_size == 0 || lz->block_size > BLOCK_MAX)
+		return false;
+
+	lz->header_done = true;
+
+	return alloc_buffers(lz);
+}
+
+static bool
+read_block(CFWLZStream *lz)
+{
+	uint8_t header[BLOCK_HEADER_SIZE];
+	size_t len;
+	ssize_t ret;
+	bool raw;
+
+	if (!read_full(lz->inner, header, 4))
+		return false;
+
+	if ((len = load32(header)) == 0) {
+		lz->at_end = true;
+		return true;
+	}
+
+	if (!read_full(lz->inner, header + 4, 4))
+		return false;
+
+	raw = (len & BLOCK_RAW);
+	len &= ~BLOCK_RAW;
+
+	if (len > (raw ? lz->block_size : bound(lz->block_size)))
+		return false;
+
+	if (raw) {
+		if (!read_full(lz->inner, lz->block, len))
+			return false;
+
+		ret = len;
+	} else {
+		if (!read_full(lz->inner, lz->out, len))
+			return false;
+
+		if ((ret = decompress_block(lz->out, len, lz->block,
+		    lz->block_size)) < 0)
+			return false;
+	}
+
+	if (xxh32(lz->block, ret) != load32(header + 4))
+		return false;
+
+	lz->plain_pos = 0;
+	lz->plain_len = ret;
+
+	return true;
+}
+
+static bool
+write_header(CFWLZStream *lz)
+{
+	uint8_t header[HEADER_SIZE];
+
+	if (lz->header_done)
+		return true;
+
+	memcpy(header, MAGIC, 4);
+	header[4] = VERSION;
+	store32(header + 5, lz->block_size);
+
+	if (!alloc_buffers(lz) ||
+	    !cfw_stream_write(lz->inner, header, HEADER_SIZE))
+		return false;
+
+	lz->header_done = true;
+
+	return true;
+}
+
+static bool
+write_block(CFWLZStream *lz, const uint8_t *buf, size_t len)
+{
+	uint8_t header[BLOCK_HEADER_SIZE];
+	struct iovec iov[2];
+	size_t out_len;
+
+	out_len = compress_block(lz->table, buf, len, lz->out);
+
+	iov[0].iov_base = header;
+	iov[0].iov_len = BLOCK_HEADER_SIZE;
+
+	/* Data that does not compress is stored as is */
+	if (out_len < len) {
+		store32(header, out_len);
+		iov[1].iov_base = lz->out;
+		iov[1].iov_len = out_len;
+	} else {
+		store32(header, len | BLOCK_RAW);
+		iov[1].iov_base = (void*)buf;
+		iov[1].iov_len = len;
+	}
+
+	store32(header + 4, xxh32(buf, len));
+
+	return cfw_stream_writev(lz->inner, iov, 2);
+}
+
+static bool
+write_pending(CFWLZStream *lz)
+{
+	if (lz->block_len == 0)
+		return true;
+
+	if (!write_block(lz, lz->block, lz->block_len))
+		return false;
+
+	lz->block_len = 0;
+
+	return true;
+}
+
+static ssize_t
+lz_read(void *ptr, void *buf, size_t len)
+{
+	CFWLZStream *lz = ptr;
+
+	if (lz->writing)
+		return -1;
+
+	if (!lz->header_done && !lz->at_end && !read_header(lz))
+		return -1;
+
+	while (lz->plain_pos == lz->plain_len) {
+		if (lz->at_end)
+			return 0;
+
+		if (!read_block(lz))
+			return -1;
+	}
+
+	if (len > lz->plain_len - lz->plain_pos)
+		len = lz->plain_len - lz->plain_pos;
+
+	memcpy(buf, lz->block + lz->plain_pos, len);
+	lz->plain_pos += len;
+
+	return len;
+}
+
+static bool
+lz_write(void *ptr, const void *buf, size_t len)
+{
+	CFWLZStream *lz = ptr;
+	const uint8_t *pos = buf;
+	size_t n;
+
+	/* A stream is either read or written, never both */
+	if (lz->finished || (lz->header_done && !lz->writing) || lz->at_end)
+		return false;
+
+	lz->writing = true;
+
+	if (!write_header(lz))
+		return false;
+
+	while (len > 0) {
+		/* Whole blocks are compressed without copying them first */
+		if (lz->block_len == 0 && len >= lz->block_size) {
+			if (!write_block(lz, pos, lz->block_size))
+				return false;
+
+			pos += lz->block_size;
+			len -= lz->block_size;
+			continue;
+		}
+
+		n = lz->block_size - lz->block_len;
+		if (n > len)
+			n = len;
+
+		memcpy(lz->block + lz->block_len, pos, n);
+		lz->block_len += n;
+		pos += n;
+		len -= n;
+
+		if (lz->block_len == lz->block_size && !write_pending(lz))
+			return false;
+	}
+
+	return true;
+}
+
+static bool
+lz_at_end(void *ptr)
+{
+	CFWLZStream *lz = ptr;
+
+	return (lz->at_end && lz->plain_pos == lz->plain_len);
+}
+
+static bool
+lz_flush(void *ptr)
+{
+	CFWLZStream *lz = ptr;
+
+	if (lz->closed)
+		return false;
+
+	/* Nothing was written, so there is nothing to push out */
+	if (!lz->writing)
+		return true;
+
+	if (!write_pending(lz))
+		return false;
+
+	return cfw_stream_flush(lz->inner);
+}
+
+static void
+lz_close(void *ptr)
+{
+	CFWLZStream *lz = ptr;
+
+	if (lz->closed)
+		return;
+
+	if (lz->writing)
+		cfw_lzstream_finish(lz);
+
+	cfw_stream_close(lz->inner);
+	lz->closed = true;
+}
+
+static struct cfw_stream_ops stream_ops = {
+	.read = lz_read,
+	.write = lz_write,
+	.at_end = lz_at_end,
+	.close = lz_close,
+	.flush = lz_flush
+};
+
+static bool
+ctor(void *ptr, va_list args)
+{
+	CFWLZStream *lz = ptr;
+	CFWStream *inner = va_arg(args, CFWStream*);
+	size_t block_size = va_arg(args, size_t);
+
+	cfw_stream->ctor(ptr, args);
+	lz->inner = NULL;
+	lz->block = NULL;
+	lz->out = NULL;
+	lz->block_len = 0;
+	lz->plain_pos = 0;
+	lz->plain_len = 0;
+	lz->header_done = false;
+	lz->at_end = false;
+	lz->finished = false;
+	lz->closed = false;
+	lz->writing = false;
+
+	if (inner == NULL || block_size > BLOCK_MAX)
+		return false;
+
+	lz->inner = cfw_ref(inner);
+	lz->block_size = (block_size > 0 ? block_size : BLOCK_DEFAULT);
+
+	/* Writes are already gathered into blocks */
+	lz->stream.write_size = 0;
+	lz->stream.ops = &stream_ops;
+
+	return true;
+}
+
+static void
+dtor(void *ptr)
+{
+	CFWLZStream *lz = ptr;
+
+	cfw_stream->dtor(ptr);
+	cfw_unref(lz->inner);
+	free(lz->block);
+	free(lz->out);
+}
+
+bool
+cfw_lzstream_finish(CFWLZStream *lz)
+{
+	uint8_t end[4] = { 0 };
+
+	if (lz == NULL || lz->closed || (lz->header_done && !lz->writing) ||
+	    lz->at_end)
+		return false;
+
+	if (lz->finished)
+		return true;
+
+	/* Finishing an unused stream writes an empty frame */
+	lz->writing = true;
+
+	if (!write_header(lz) || !write_pending(lz) ||
+	    !cfw_stream_write(lz->inner, end, 4) ||
+	    !cfw_stream_flush(lz->inner))
+		return false;
+
+	lz->finished = true;
+
+	return true;
+}
+
+static CFWClass class = {
+	.name = "CFWLZStream",
+	.size = sizeof(CFWLZStream),
+	.ctor = ctor,
+	.dtor = dtor
+};
+CFWClass *cfw_lzstream = &class;
@@ -30,6 +30,7 @@
 #include "map.h"
 #include "hash.h"
 #include "string.h"
+#include "refpool.h"
 
 static struct bucket {
 	CFWObject *key, *obj;
@@ -43,6 +44,16 @@ struct CFWMap {
 	size_t items;
 };
 
+struct parallel {
+	CFWMap *map;
+	void (*each)(void*, void*, void*);
+	void* (*map_func)(void*, void*, void*);
+	void* (*reduce)(void*, void*, void*);
+	void *ctx;
+	void **results;
+	uint32_t chunk_size;
+};
+
 static bool
 ctor(void *ptr, va_list args)
 {
@@ -419,6 +430,151 @@ cfw_map_iter_next(cfw_map_iter_t *iter)
 	}
 }
 
+static void
+each_range(void *ptr, size_t start, size_t end)
+{
+	struct parallel *p = ptr;
+	struct bucket **data = p->map->data;
+	size_t i;
+
+	for (i = start; i < end; i++)
+		if (data[i] != NULL && data[i] != &deleted)
+			p->each(data[i]->key, data[i]->obj, p->ctx);
+}
+
+static void
+reduce_chunks(void *ptr, size_t start, size_t end)
+{
+	struct parallel *p = ptr;
+	struct bucket **data = p->map->data;
+	size_t i;
+
+	for (i = start; i < end; i++) {
+		uint32_t j, last;
+		void *acc = NULL;
+
+		j = i * p->chunk_size;
+		last = j + p->chunk_size;
+		if (last > p->map->size)
+			last = p->map->size;
+
+		for (; j < last; j++) {
+			void *obj;
+
+			if (data[j] == NULL || data[j] == &deleted)
+				continue;
+
+			obj = p->map_func(data[j]->key, data[j]->obj, p->ctx);
+			acc = (acc != NULL ? p->reduce(acc, obj, p->ctx) : obj);
+		}
+
+		/* Partial results may come from the worker's refpool */
+		p->results[i] = cfw_ref(acc);
+	}
+}
+
+bool
+cfw_map_parallel_each(CFWMap *map, CFWExecutor *executor,
+    void (*func)(void*, void*, void*), void *ctx)
+{
+	struct parallel p = {
+		.map = map,
+		.each = func,
+		.ctx = ctx
+	};
+
+	if (executor == NULL) {
+		each_range(&p, 0, map->size);
+		return true;
+	}
+
+	return cfw_executor_parallel_for(executor, 0, map->size, 0,
+	    each_range, &p);
+}
+
+void*
+cfw_map_parallel_reduce(CFWMap *map, CFWExecutor *executor,
+    void* (*map_func)(void*, void*, void*),
+    void* (*reduce)(void*, void*, void*), void *ctx)
+{
+	struct parallel p = {
+		.map = map,
+		.map_func = map_func,
+		.reduce = reduce,
+		.ctx = ctx
+	};
+	size_t i, chunks;
+	void *acc;
+
+	if (map->items == 0)
+		return NULL;
+
+	chunks = (executor != NULL ? cfw_executor_threads(executor) * 4 : 1);
+	if (chunks > map->size)
+		chunks = map->size;
+
+	p.chunk_size = (map->size + chunks - 1) / chunks;
+	chunks = (map->size + p.chunk_size - 1) / p.chunk_size;
+
+	if ((p.results = malloc(sizeof(void*) * chunks)) == NULL)
+		return NULL;
+
+	if (executor != NULL) {
+		if (!cfw_executor_parallel_for(executor, 0, chunks, 0,
+		    reduce_chunks, &p)) {
+			free(p.results);
+			return NULL;
+		}
+	} else
+		reduce_chunks(&p, 0, chunks);
+
+	/* Combine the per-range results in bucket order */
+	acc = NULL;
+	for (i = 0; i < chunks; i++)
+		if (p.results[i] != NULL)
+			acc = (acc != NULL ?
+			    reduce(acc, p.results[i], ctx) : p.results[i]);
+
+	cfw_ref(acc);
+
+	for (i = 0; i < chunks; i++)
+		cfw_unref(p.results[i]);
+	free(p.results);
+
+	if (acc == NULL)
+		return NULL;
+
+	if (!cfw_refpool_add(acc)) {
+		cfw_unref(acc);
+		return NULL;
+	}
+
+	return acc;
+}
+
+static bool
+describe(void *ptr, cfw_writer_t write, void *ctx)
+{
+	cfw_map_iter_t iter;
+	bool first = true;
+
+	if (!write(ctx, "{", 1))
+		return false;
+
+	for (cfw_map_iter(ptr, &iter); iter.key != NULL;
+	    cfw_map_iter_next(&iter)) {
+		if ((!first && !write(ctx, ", ", 2)) ||
+		    !cfw_describe(iter.key, write, ctx) ||
+		    !write(ctx, " = ", 3) ||
+		    !cfw_describe(iter.obj, write, ctx))
+			return false;
+
+		first = false;
+	}
+
+	return write(ctx, "}", 1);
+}
+
 static CFWClass class = {
 	.name = "CFWMap",
 	.size = sizeof(CFWMap),
@@ -426,6 +582,7 @@ static CFWClass class = {
 	.dtor = dtor,
 	.equal = equal,
 	.hash = hash,
-	.copy = copy
+	.copy = copy,
+	.describe = describe
 };
 CFWClass *cfw_map = &class;
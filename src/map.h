@@ -28,6 +28,7 @@
 #define __COREFW_MAP_H__
 
 #include "class.h"
+#include "executor.h"
 
 typedef struct CFWMap CFWMap;
 
@@ -46,5 +47,9 @@ extern bool cfw_map_set(CFWMap*, void*, void*);
 extern bool cfw_map_set_c(CFWMap*, const char*, void*);
 extern void cfw_map_iter(CFWMap*, cfw_map_iter_t*);
 extern void cfw_map_iter_next(cfw_map_iter_t*);
+extern bool cfw_map_parallel_each(CFWMap*, CFWExecutor*,
+    void (*)(void*, void*, void*), void*);
+extern void* cfw_map_parallel_reduce(CFWMap*, CFWExecutor*,
+    void* (*)(void*, void*, void*), void* (*)(void*, void*, void*), void*);
 
 #endif
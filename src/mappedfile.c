@@ -0,0 +1,329 @@
+/*
+ * Copyright (c) 2012, Jonathan Schleifer <js@webkeks.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "object.h"
+#include "mappedfile.h"
+#include "search.h"
+#include "stream.h"
+
+#define HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+struct CFWMappedFile {
+	CFWObject obj;
+	char *data;
+	size_t len;
+	void *map;
+	size_t map_len;
+};
+
+/*
+ * The file is mapped over an anonymous reservation that is at least one byte
+ * longer, so the data is always followed by a NUL and can back a CFWString.
+ * The partial last page is copied instead of mapped, as what is appended to
+ * the file would otherwise show up where the NUL should be.
+ */
+static bool
+map_file(CFWMappedFile *mf, int fd, size_t len, int flags)
+{
+	size_t page = sysconf(_SC_PAGESIZE), align = page, full, done;
+	char *base;
+	ssize_t ret;
+
+	if (flags & CFW_MAPPEDFILE_HUGEPAGES)
+		align = HUGEPAGE_SIZE;
+
+	if (len > SIZE_MAX - page - align)
+		return false;
+
+	mf->map_len = (len + page) / page * page + (align - page);
+
+	if ((mf->map = mmap(NULL, mf->map_len, PROT_READ,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+		mf->map = NULL;
+		return false;
+	}
+
+	base = (char*)(((uintptr_t)mf->map + align - 1) &
+	    ~(uintptr_t)(align - 1));
+
+	full = len / page * page;
+
+	if (full > 0 && mmap(base, full, PROT_READ, MAP_PRIVATE | MAP_FIXED,
+	    fd, 0) == MAP_FAILED)
+		return false;
+
+	if (full < len) {
+		if (mprotect(base + full, page, PROT_READ | PROT_WRITE) == -1)
+			return false;
+
+		for (done = full; done < len; done += ret) {
+			if ((ret = pread(fd, base + done, len - done,
+			    done)) == -1 && errno == EINTR)
+				ret = 0;
+			else if (ret <= 0)
+				return false;
+		}
+
+		if (mprotect(base + full, page, PROT_READ) == -1)
+			return false;
+	}
+
+#ifdef MADV_HUGEPAGE
+	if (flags & CFW_MAPPEDFILE_HUGEPAGES)
+		madvise(base, len, MADV_HUGEPAGE);
+#endif
+
+	mf->data = base;
+	mf->len = len;
+
+	return true;
+}
+
+/* Pipes and other files that cannot be mapped are read in full instead */
+static bool
+read_file(CFWMappedFile *mf, int fd)
+{
+	size_t len = 0, cap = CFW_STREAM_BUFSIZE;
+	char *buf, *new;
+	ssize_t ret;
+
+	if ((buf = malloc(cap)) == NULL)
+		return false;
+
+	for (;;) {
+		if (cap - len == 1) {
+			if (cap > SIZE_MAX / 2 ||
+			    (new = realloc(buf, cap * 2)) == NULL) {
+				free(buf);
+				return false;
+			}
+
+			buf = new;
+			cap *= 2;
+		}
+
+		if ((ret = read(fd, buf + len, cap - len - 1)) == -1) {
+			if (errno == EINTR)
+				continue;
+
+			free(buf);
+			return false;
+		}
+
+		if (ret == 0)
+			break;
+
+		len += ret;
+	}
+
+	buf[len] = '\0';
+	mf->data = buf;
+	mf->len = len;
+
+	return true;
+}
+
+static bool
+ctor(void *ptr, va_list args)
+{
+	CFWMappedFile *mf = ptr;
+	const char *path = va_arg(args, const char*);
+	int flags = va_arg(args, int);
+	struct stat st;
+	int fd;
+	bool ret;
+
+	mf->data = NULL;
+	mf->len = 0;
+	mf->map = NULL;
+	mf->map_len = 0;
+
+	if (path == NULL)
+		return false;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+		return false;
+
+	/* Checking the descriptor can't race with the path being replaced */
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+	    (uintmax_t)st.st_size < SIZE_MAX) {
+		if (map_file(mf, fd, st.st_size, flags)) {
+			close(fd);
+
+			/* The hints are only hints, failing them is harmless */
+			cfw_mappedfile_advise(mf, flags);
+
+			return true;
+		}
+
+		if (mf->map != NULL) {
+			munmap(mf->map, mf->map_len);
+			mf->map = NULL;
+		}
+	}
+
+	ret = read_file(mf, fd);
+	close(fd);
+
+	return ret;
+}
+
+static void
+dtor(void *ptr)
+{
+	CFWMappedFile *mf = ptr;
+
+	if (mf->map != NULL)
+		munmap(mf->map, mf->map_len);
+	else
+		free(mf->data);
+}
+
+const char*
+cfw_mappedfile_data(CFWMappedFile *mf)
+{
+	return mf->data;
+}
+
+size_t
+cfw_mappedfile_length(CFWMappedFile *mf)
+{
+	return mf->len;
+}
+
+bool
+cfw_mappedfile_is_mapped(CFWMappedFile *mf)
+{
+	return (mf->map != NULL);
+}
+
+bool
+cfw_mappedfile_advise(CFWMappedFile *mf, int flags)
+{
+	bool ret = true;
+
+	if (mf->map == NULL)
+		return true;
+
+	if (flags & CFW_MAPPEDFILE_SEQUENTIAL)
+		ret &= !posix_madvise(mf->data, mf->len,
+		    POSIX_MADV_SEQUENTIAL);
+	if (flags & CFW_MAPPEDFILE_RANDOM)
+		ret &= !posix_madvise(mf->data, mf->len, POSIX_MADV_RANDOM);
+	if (flags & CFW_MAPPEDFILE_WILLNEED)
+		ret &= !posix_madvise(mf->data, mf->len, POSIX_MADV_WILLNEED);
+
+	return ret;
+}
+
+CFWString*
+cfw_mappedfile_string(CFWMappedFile *mf)
+{
+	CFWString *str;
+
+	if ((str = cfw_create(cfw_string, (void*)NULL)) == NULL)
+		return NULL;
+
+	if (!cfw_string_set_borrowed(str, mf, mf->data, mf->len))
+		return NULL;
+
+	return str;
+}
+
+CFWStringView*
+cfw_mappedfile_view(CFWMappedFile *mf, cfw_range_t range)
+{
+	CFWString *str;
+
+	if ((str = cfw_mappedfile_string(mf)) == NULL)
+		return NULL;
+
+	return cfw_create(cfw_stringview, str, range);
+}
+
+void
+cfw_mappedfile_line_iter(CFWMappedFile *mf, cfw_mappedfile_line_iter_t *iter,
+    const char *delim)
+{
+	iter->line = NULL;
+	iter->len = 0;
+	iter->_pos = mf->data;
+	iter->_end = mf->data + mf->len;
+	iter->_crlf = (delim == NULL || *delim == '\0');
+	iter->_delim = (iter->_crlf ? "\n" : delim);
+	iter->_delim_len = strlen(iter->_delim);
+}
+
+bool
+cfw_mappedfile_line_iter_next(cfw_mappedfile_line_iter_t *iter)
+{
+	size_t len, rest = iter->_end - iter->_pos;
+
+	if (rest == 0) {
+		iter->line = NULL;
+		iter->len = 0;
+
+		return false;
+	}
+
+	if (iter->_delim_len == 1) {
+		const char *pos = memchr(iter->_pos, *iter->_delim, rest);
+
+		len = (pos != NULL ? (size_t)(pos - iter->_pos) : rest);
+	} else if ((len = cfw_memmem(iter->_pos, rest, iter->_delim,
+	    iter->_delim_len)) == SIZE_MAX)
+		len = rest;
+
+	iter->line = iter->_pos;
+	iter->_pos += (len < rest ? len + iter->_delim_len : len);
+
+	if (iter->_crlf && len > 0 && iter->line[len - 1] == '\r')
+		len--;
+	iter->len = len;
+
+	return true;
+}
+
+static CFWClass class = {
+	.name = "CFWMappedFile",
+	.size = sizeof(CFWMappedFile),
+	.ctor = ctor,
+	.dtor = dtor
+};
+CFWClass *cfw_mappedfile = &class;
@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2012, Jonathan Schleifer <js@webkeks.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __COREFW_MAPPEDFILE_H__
+#define __COREFW_MAPPEDFILE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "class.h"
+#include "range.h"
+#include "string.h"
+#include "stringview.h"
+
+enum {
+	CFW_MAPPEDFILE_SEQUENTIAL = 1,
+	CFW_MAPPEDFILE_RANDOM = 2,
+	CFW_MAPPEDFILE_WILLNEED = 4,
+	CFW_MAPPEDFILE_HUGEPAGES = 8
+};
+
+typedef struct CFWMappedFile CFWMappedFile;
+
+typedef struct cfw_mappedfile_line_iter_t {
+	const char *line;
+	size_t len;
+	/* private */
+	const char *_pos, *_end, *_delim;
+	size_t _delim_len;
+	bool _crlf;
+} cfw_mappedfile_line_iter_t;
+
+/*
+ * Regular files are mapped, so one must not be truncated while it is:
+ * Accessing the data that is gone raises SIGBUS. Appending is harmless.
+ */
+extern CFWClass *cfw_mappedfile;
+extern const char* cfw_mappedfile_data(CFWMappedFile*);
+extern size_t cfw_mappedfile_length(CFWMappedFile*);
+extern bool cfw_mappedfile_is_mapped(CFWMappedFile*);
+extern bool cfw_mappedfile_advise(CFWMappedFile*, int);
+extern CFWString* cfw_mappedfile_string(CFWMappedFile*);
+extern CFWStringView* cfw_mappedfile_view(CFWMappedFile*, cfw_range_t);
+extern void cfw_mappedfile_line_iter(CFWMappedFile*,
+    cfw_mappedfile_line_iter_t*, const char*);
+extern bool cfw_mappedfile_line_iter_next(cfw_mappedfile_line_iter_t*);
+
+#endif
@@ -0,0 +1,312 @@
+/*
+ * Copyright (c) 2012, Jonathan Schleifer <js@webkeks.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "object.h"
+#include "matcher.h"
+
+#define NONE UINT32_MAX
+
+/*
+ * Aho-Corasick automaton compiled into a full DFA. Bytes that occur in no
+ * pattern share one class, which keeps the transition table small.
+ */
+struct CFWMatcher {
+	CFWObject obj;
+	uint16_t classes[256];
+	size_t classes_cnt;
+	uint32_t *delta;
+	uint32_t *out;
+	uint32_t states_cnt;
+	size_t *lengths;
+	size_t patterns_cnt;
+	bool start[256];
+	int start_byte;
+};
+
+static bool
+build(CFWMatcher *matcher, CFWArray *patterns)
+{
+	uint32_t *queue, *fail, *delta;
+	size_t i, j, k, total;
+	uint32_t head, tail;
+	bool seen[256];
+	int starts;
+
+	matcher->patterns_cnt = cfw_array_size(patterns);
+
+	if ((matcher->lengths = malloc((matcher->patterns_cnt + 1) *
+	    sizeof(size_t))) == NULL)
+		return false;
+
+	memset(seen, 0, sizeof(seen));
+	total = 1;
+	for (i = 0; i < matcher->patterns_cnt; i++) {
+		CFWString *pattern = cfw_array_get(patterns, i);
+		const unsigned char *bytes;
+
+		bytes = (const unsigned char*)cfw_string_c(pattern);
+		matcher->lengths[i] = cfw_string_length(pattern);
+
+		if (matcher->lengths[i] > UINT32_MAX - total)
+			return false;
+		total += matcher->lengths[i];
+
+		for (j = 0; j < matcher->lengths[i]; j++)
+			seen[bytes[j]] = true;
+	}
+
+	k = 1;
+	for (i = 0; i < 256; i++)
+		matcher->classes[i] = (seen[i] ? k++ : 0);
+	matcher->classes_cnt = k;
+
+	if (total > SIZE_MAX / sizeof(uint32_t) / k)
+		return false;
+
+	if ((matcher->delta = malloc(total * k * sizeof(uint32_t))) == NULL)
+		return false;
+	if ((matcher->out = calloc(total, sizeof(uint32_t))) == NULL)
+		return false;
+
+	for (i = 0; i < total * k; i++)
+		matcher->delta[i] = NONE;
+
+	/* Build the trie */
+	matcher->states_cnt = 1;
+	for (i = 0; i < matcher->patterns_cnt; i++) {
+		const unsigned char *bytes;
+		uint32_t state = 0;
+
+		bytes = (const unsigned char*)cfw_string_c(
+		    cfw_array_get(patterns, i));
+
+		if (matcher->lengths[i] == 0)
+			continue;
+
+		for (j = 0; j < matcher->lengths[i]; j++) {
+			uint32_t *next;
+
+			next = &matcher->delta[state * k +
+			    matcher->classes[bytes[j]]];
+
+			if (*next == NONE)
+				*next = matcher->states_cnt++;
+
+			state = *next;
+		}
+
+		if (matcher->out[state] == 0)
+			matcher->out[state] = i + 1;
+	}
+
+	if ((queue = malloc(matcher->states_cnt * sizeof(uint32_t))) == NULL)
+		return false;
+	if ((fail = malloc(matcher->states_cnt * sizeof(uint32_t))) == NULL) {
+		free(queue);
+		return false;
+	}
+
+	/*
+	 * Breadth-first, so the row of a state's failure state is complete by
+	 * the time it is needed to fill in the missing transitions.
+	 */
+	delta = matcher->delta;
+	fail[0] = 0;
+	queue[0] = 0;
+	head = 0;
+	tail = 1;
+	while (head < tail) {
+		uint32_t state = queue[head++];
+
+		for (i = 0; i < k; i++) {
+			uint32_t next = delta[state * k + i];
+			uint32_t fallback;
+
+			fallback = (state == 0 ? 0 : delta[fail[state] * k + i]);
+
+			if (next == NONE) {
+				delta[state * k + i] = fallback;
+				continue;
+			}
+
+			fail[next] = fallback;
+
+			/* Report the longest pattern that ends here */
+			if (matcher->out[next] == 0)
+				matcher->out[next] = matcher->out[fallback];
+
+			queue[tail++] = next;
+		}
+	}
+
+	free(queue);
+	free(fail);
+
+	starts = 0;
+	matcher->start_byte = -1;
+	for (i = 0; i < 256; i++) {
+		matcher->start[i] = (delta[matcher->classes[i]] != 0);
+
+		if (matcher->start[i]) {
+			matcher->start_byte = i;
+			starts++;
+		}
+	}
+	if (starts != 1)
+		matcher->start_byte = -1;
+
+	return true;
+}
+
+static bool
+ctor(void *ptr, va_list args)
+{
+	CFWMatcher *matcher = ptr;
+	CFWArray *patterns = va_arg(args, CFWArray*);
+
+	matcher->delta = NULL;
+	matcher->out = NULL;
+	matcher->lengths = NULL;
+	matcher->states_cnt = 0;
+	matcher->patterns_cnt = 0;
+
+	if (patterns == NULL)
+		return false;
+
+	return build(matcher, patterns);
+}
+
+static void
+dtor(void *ptr)
+{
+	CFWMatcher *matcher = ptr;
+
+	free(matcher->delta);
+	free(matcher->out);
+	free(matcher->lengths);
+}
+
+size_t
+cfw_matcher_patterns(CFWMatcher *matcher)
+{
+	return matcher->patterns_cnt;
+}
+
+void
+cfw_matcher_scan(CFWMatcher *matcher, cfw_matcher_scan_t *scan)
+{
+	scan->_matcher = matcher;
+	scan->_state = 0;
+	scan->_pos = 0;
+}
+
+bool
+cfw_matcher_feed(cfw_matcher_scan_t *scan, const void *buf, size_t len,
+    size_t *consumed, cfw_matcher_match_t *match)
+{
+	CFWMatcher *matcher = scan->_matcher;
+	const unsigned char *bytes = buf, *pos = bytes, *end = bytes + len;
+	const uint32_t *delta = matcher->delta;
+	const uint16_t *classes = matcher->classes;
+	size_t k = matcher->classes_cnt;
+	uint32_t state = scan->_state;
+
+	while (pos < end) {
+		uint32_t out;
+
+		/* Skip over bytes that cannot start a match */
+		if (state == 0) {
+			if (matcher->start_byte >= 0) {
+				pos = memchr(pos, matcher->start_byte,
+				    end - pos);
+
+				if (pos == NULL) {
+					pos = end;
+					break;
+				}
+			} else
+				while (pos < end && !matcher->start[*pos])
+					pos++;
+
+			if (pos == end)
+				break;
+		}
+
+		state = delta[state * k + classes[*pos++]];
+
+		if ((out = matcher->out[state]) != 0) {
+			size_t done = pos - bytes;
+
+			match->pattern = out - 1;
+			match->length = matcher->lengths[out - 1];
+			match->offset = scan->_pos + done - match->length;
+
+			scan->_state = state;
+			scan->_pos += done;
+			*consumed = done;
+
+			return true;
+		}
+	}
+
+	scan->_state = state;
+	scan->_pos += len;
+	*consumed = len;
+
+	return false;
+}
+
+bool
+cfw_matcher_find(CFWMatcher *matcher, const void *buf, size_t len,
+    cfw_matcher_match_t *match)
+{
+	cfw_matcher_scan_t scan;
+	size_t consumed;
+
+	cfw_matcher_scan(matcher, &scan);
+
+	return cfw_matcher_feed(&scan, buf, len, &consumed, match);
+}
+
+bool
+cfw_matcher_find_string(CFWMatcher *matcher, CFWString *str,
+    cfw_matcher_match_t *match)
+{
+	return cfw_matcher_find(matcher, cfw_string_c(str),
+	    cfw_string_length(str), match);
+}
+
+static CFWClass class = {
+	.name = "CFWMatcher",
+	.size = sizeof(CFWMatcher),
+	.ctor = ctor,
+	.dtor = dtor
+};
+CFWClass *cfw_matcher = &class;
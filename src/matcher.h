@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2012, Jonathan Schleifer <js@webkeks.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __COREFW_MATCHER_H__
+#define __COREFW_MATCHER_H__
+
+#include "class.h"
+#include "string.h"
+#include "array.h"
+
+typedef struct CFWMatcher CFWMatcher;
+
+typedef struct cfw_matcher_match_t {
+	size_t pattern;
+	size_t offset, length;
+} cfw_matcher_match_t;
+
+typedef struct cfw_matcher_scan_t {
+	/* private */
+	CFWMatcher *_matcher;
+	uint32_t _state;
+	size_t _pos;
+} cfw_matcher_scan_t;
+
+extern CFWClass *cfw_matcher;
+extern size_t cfw_matcher_patterns(CFWMatcher*);
+extern bool cfw_matcher_find(CFWMatcher*, const void*, size_t,
+    cfw_matcher_match_t*);
+extern bool cfw_matcher_find_string(CFWMatcher*, CFWString*,
+    cfw_matcher_match_t*);
+extern void cfw_matcher_scan(CFWMatcher*, cfw_matcher_scan_t*);
+extern bool cfw_matcher_feed(cfw_matcher_scan_t*, const void*, size_t,
+    size_t*, cfw_matcher_match_t*);
+
+#endif
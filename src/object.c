@@ -25,6 +25,7 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 
 #include "object.h"
@@ -97,7 +98,7 @@ cfw_ref(void *ptr)
 	if (obj == NULL)
 		return NULL;
 
-	obj->ref_cnt++;
+	__atomic_add_fetch(&obj->ref_cnt, 1, __ATOMIC_RELAXED);
 
 	return obj;
 }
@@ -110,7 +111,7 @@ cfw_unref(void *ptr)
 	if (obj == NULL)
 		return;
 
-	if (--obj->ref_cnt == 0)
+	if (__atomic_sub_fetch(&obj->ref_cnt, 1, __ATOMIC_ACQ_REL) == 0)
 		cfw_free(obj);
 }
 
@@ -125,7 +126,11 @@ cfw_free(void *ptr)
 	if (obj->cls->dtor != NULL)
 		obj->cls->dtor(obj);
 
-	free(obj);
+	/* Objects that were not allocated one by one release themselves */
+	if (obj->cls->dealloc != NULL)
+		obj->cls->dealloc(obj);
+	else
+		free(obj);
 }
 
 CFWClass*
@@ -195,6 +200,34 @@ cfw_copy(void *ptr)
 	return NULL;
 }
 
+bool
+cfw_describe(void *ptr, cfw_writer_t write, void *ctx)
+{
+	CFWObject *obj = ptr;
+	uintptr_t addr = (uintptr_t)ptr;
+	char buf[sizeof(uintptr_t) * 2];
+	size_t i = sizeof(buf);
+	const char *name;
+
+	if (obj == NULL)
+		return write(ctx, "(null)", 6);
+
+	if (obj->cls->describe != NULL)
+		return obj->cls->describe(obj, write, ctx);
+
+	/* Classes that can't describe themselves are shown as <name 0xaddr> */
+	do {
+		buf[--i] = "0123456789abcdef"[addr & 0xF];
+		addr >>= 4;
+	} while (addr > 0);
+
+	name = cfw_class_name(obj->cls);
+
+	return (write(ctx, "<", 1) && write(ctx, name, strlen(name)) &&
+	    write(ctx, " 0x", 3) && write(ctx, buf + i, sizeof(buf) - i) &&
+	    write(ctx, ">", 1));
+}
+
 static CFWClass class = {
 	.name = "CFWObject",
 	.size = sizeof(CFWObject),
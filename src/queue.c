@@ -0,0 +1,355 @@
+/*
+ * Copyright (c) 2012, Jonathan Schleifer <js@webkeks.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+
+#include "object.h"
+#include "queue.h"
+#include "futex.h"
+
+#define CACHE_LINE 64
+
+/*
+ * Bounded MPMC ring as described by Dmitry Vyukov: Every cell carries a
+ * sequence number that tells producers and consumers whether it is their
+ * turn, so the only contended writes are the CAS on head and tail.
+ */
+struct cell {
+	size_t seq;
+	CFWObject *obj;
+};
+
+struct CFWQueue {
+	CFWObject obj;
+	struct cell *cells;
+	size_t mask;
+	char pad0[CACHE_LINE];
+	size_t head;
+	char pad1[CACHE_LINE];
+	size_t tail;
+	char pad2[CACHE_LINE];
+	uint32_t pushed, popped;
+	uint32_t push_waiters, pop_waiters;
+	bool closed;
+};
+
+static bool
+ctor(void *ptr, va_list args)
+{
+	CFWQueue *queue = ptr;
+	size_t capacity = va_arg(args, size_t);
+	size_t i, size;
+
+	queue->cells = NULL;
+	queue->head = 0;
+	queue->tail = 0;
+	queue->pushed = 0;
+	queue->popped = 0;
+	queue->push_waiters = 0;
+	queue->pop_waiters = 0;
+	queue->closed = false;
+
+	for (size = 2; size < capacity; size <<= 1)
+		if (size > SIZE_MAX / 2 / sizeof(struct cell))
+			return false;
+
+	if ((queue->cells = malloc(size * sizeof(struct cell))) == NULL)
+		return false;
+
+	for (i = 0; i < size; i++) {
+		queue->cells[i].seq = i;
+		queue->cells[i].obj = NULL;
+	}
+	queue->mask = size - 1;
+
+	return true;
+}
+
+static void
+dtor(void *ptr)
+{
+	CFWQueue *queue = ptr;
+	void *obj;
+
+	if (queue->cells == NULL)
+		return;
+
+	while ((obj = cfw_queue_try_pop(queue)) != NULL)
+		cfw_unref(obj);
+
+	free(queue->cells);
+}
+
+static void
+notify(CFWQueue *queue, uint32_t *seq, uint32_t *waiters, size_t cnt)
+{
+	__atomic_add_fetch(seq, 1, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(waiters, __ATOMIC_SEQ_CST) > 0)
+		cfw_futex_wake(seq, (cnt > INT_MAX ? INT_MAX : (int)cnt));
+}
+
+/*
+ * Claims up to max consecutive cells that are ready for the side that
+ * advances pos. ready is 0 for producers and 1 for consumers, as a cell at
+ * position p is free when its sequence is p and full when it is p + 1.
+ */
+static size_t
+claim(CFWQueue *queue, size_t *pos_ptr, size_t ready, size_t max,
+    size_t *start)
+{
+	size_t pos, i;
+
+	pos = __atomic_load_n(pos_ptr, __ATOMIC_RELAXED);
+
+	for (;;) {
+		struct cell *cell;
+		intptr_t diff;
+
+		cell = &queue->cells[pos & queue->mask];
+		diff = (intptr_t)(__atomic_load_n(&cell->seq,
+		    __ATOMIC_ACQUIRE) - (pos + ready));
+
+		if (diff < 0)
+			return 0;
+
+		if (diff > 0) {
+			pos = __atomic_load_n(pos_ptr, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		for (i = 1; i < max && i <= queue->mask; i++) {
+			cell = &queue->cells[(pos + i) & queue->mask];
+
+			if (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) !=
+			    pos + i + ready)
+				break;
+		}
+
+		if (__atomic_compare_exchange_n(pos_ptr, &pos, pos + i, true,
+		    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			*start = pos;
+			return i;
+		}
+	}
+}
+
+size_t
+cfw_queue_capacity(CFWQueue *queue)
+{
+	return queue->mask + 1;
+}
+
+size_t
+cfw_queue_size(CFWQueue *queue)
+{
+	size_t head, tail;
+
+	tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+	head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+
+	return (head > tail ? head - tail : 0);
+}
+
+size_t
+cfw_queue_try_push_many(CFWQueue *queue, void **objs, size_t cnt)
+{
+	size_t i, pos, claimed;
+
+	if (cnt == 0 || __atomic_load_n(&queue->closed, __ATOMIC_ACQUIRE))
+		return 0;
+
+	for (i = 0; i < cnt; i++)
+		if (objs[i] == NULL)
+			break;
+
+	if ((claimed = claim(queue, &queue->head, 0, i, &pos)) == 0)
+		return 0;
+
+	for (i = 0; i < claimed; i++) {
+		struct cell *cell = &queue->cells[(pos + i) & queue->mask];
+
+		cell->obj = cfw_ref(objs[i]);
+		__atomic_store_n(&cell->seq, pos + i + 1, __ATOMIC_RELEASE);
+	}
+
+	notify(queue, &queue->pushed, &queue->pop_waiters, claimed);
+
+	return claimed;
+}
+
+bool
+cfw_queue_try_push(CFWQueue *queue, void *obj)
+{
+	return (cfw_queue_try_push_many(queue, &obj, 1) == 1);
+}
+
+size_t
+cfw_queue_push_many(CFWQueue *queue, void **objs, size_t cnt)
+{
+	size_t done = 0;
+
+	while (done < cnt) {
+		uint32_t seq;
+		size_t ret;
+
+		if (__atomic_load_n(&queue->closed, __ATOMIC_ACQUIRE))
+			break;
+
+		if (objs[done] == NULL)
+			break;
+
+		if ((ret = cfw_queue_try_push_many(queue, objs + done,
+		    cnt - done)) > 0) {
+			done += ret;
+			continue;
+		}
+
+		seq = __atomic_load_n(&queue->popped, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&queue->push_waiters, 1, __ATOMIC_SEQ_CST);
+
+		if ((ret = cfw_queue_try_push_many(queue, objs + done,
+		    cnt - done)) > 0)
+			done += ret;
+		else if (!__atomic_load_n(&queue->closed, __ATOMIC_ACQUIRE))
+			cfw_futex_wait(&queue->popped, seq);
+
+		__atomic_sub_fetch(&queue->push_waiters, 1, __ATOMIC_SEQ_CST);
+	}
+
+	return done;
+}
+
+bool
+cfw_queue_push(CFWQueue *queue, void *obj)
+{
+	return (cfw_queue_push_many(queue, &obj, 1) == 1);
+}
+
+size_t
+cfw_queue_try_pop_many(CFWQueue *queue, void **objs, size_t max)
+{
+	size_t i, pos, claimed;
+
+	if (max == 0 || (claimed = claim(queue, &queue->tail, 1, max,
+	    &pos)) == 0)
+		return 0;
+
+	for (i = 0; i < claimed; i++) {
+		struct cell *cell = &queue->cells[(pos + i) & queue->mask];
+
+		objs[i] = cell->obj;
+		cell->obj = NULL;
+		__atomic_store_n(&cell->seq, pos + i + queue->mask + 1,
+		    __ATOMIC_RELEASE);
+	}
+
+	notify(queue, &queue->popped, &queue->push_waiters, claimed);
+
+	return claimed;
+}
+
+void*
+cfw_queue_try_pop(CFWQueue *queue)
+{
+	void *obj;
+
+	if (cfw_queue_try_pop_many(queue, &obj, 1) == 0)
+		return NULL;
+
+	return obj;
+}
+
+size_t
+cfw_queue_pop_many(CFWQueue *queue, void **objs, size_t max)
+{
+	size_t ret = 0;
+
+	if (max == 0)
+		return 0;
+
+	while (ret == 0) {
+		uint32_t seq;
+
+		if ((ret = cfw_queue_try_pop_many(queue, objs, max)) > 0)
+			break;
+
+		if (__atomic_load_n(&queue->closed, __ATOMIC_ACQUIRE)) {
+			/* A push might have raced with close */
+			ret = cfw_queue_try_pop_many(queue, objs, max);
+			break;
+		}
+
+		seq = __atomic_load_n(&queue->pushed, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&queue->pop_waiters, 1, __ATOMIC_SEQ_CST);
+
+		if ((ret = cfw_queue_try_pop_many(queue, objs, max)) == 0 &&
+		    !__atomic_load_n(&queue->closed, __ATOMIC_ACQUIRE))
+			cfw_futex_wait(&queue->pushed, seq);
+
+		__atomic_sub_fetch(&queue->pop_waiters, 1, __ATOMIC_SEQ_CST);
+	}
+
+	return ret;
+}
+
+void*
+cfw_queue_pop(CFWQueue *queue)
+{
+	void *obj;
+
+	if (cfw_queue_pop_many(queue, &obj, 1) == 0)
+		return NULL;
+
+	return obj;
+}
+
+void
+cfw_queue_close(CFWQueue *queue)
+{
+	__atomic_store_n(&queue->closed, true, __ATOMIC_RELEASE);
+
+	__atomic_add_fetch(&queue->pushed, 1, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&queue->popped, 1, __ATOMIC_SEQ_CST);
+	cfw_futex_wake(&queue->pushed, INT_MAX);
+	cfw_futex_wake(&queue->popped, INT_MAX);
+}
+
+bool
+cfw_queue_is_closed(CFWQueue *queue)
+{
+	return __atomic_load_n(&queue->closed, __ATOMIC_ACQUIRE);
+}
+
+static CFWClass class = {
+	.name = "CFWQueue",
+	.size = sizeof(CFWQueue),
+	.ctor = ctor,
+	.dtor = dtor
+};
+CFWClass *cfw_queue = &class;
@@ -38,7 +38,7 @@ struct CFWRefPool {
 	CFWRefPool *prev, *next;
 };
 
-static CFWRefPool *top;
+static __thread CFWRefPool *top;
 
 static bool
 ctor(void *ptr, va_list args)
@@ -0,0 +1,1638 @@
+/*
+ * Copyright (c) 2012, Jonathan Schleifer <js@webkeks.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "object.h"
+#include "regex.h"
+#include "search.h"
+#include "stream.h"
+#include "stringview.h"
+
+#define MAX_DEPTH 1000
+#define MAX_REPEAT 1000
+#define MAX_INSTS 100000
+#define MAX_PREFIX 64
+#define CACHE_SIZE (4 * 1024 * 1024)
+#define CHUNK_SIZE 4096
+
+/* Forward programs start with an unanchored .*? loop of this length */
+#define LOOP_LEN 3
+
+#define UNKNOWN -1
+#define DEAD 0
+
+enum {
+	OP_BYTE,
+	OP_SPLIT,
+	OP_JMP,
+	OP_MATCH
+};
+
+enum {
+	NODE_SET,
+	NODE_CAT,
+	NODE_ALT,
+	NODE_REPEAT
+};
+
+enum {
+	DFA_FIRST,
+	DFA_LONGEST,
+	DFA_ANCHORED,
+	DFA_REVERSE,
+	DFA_CNT
+};
+
+struct node {
+	int type;
+	int32_t a, next;
+	int min, max;
+	bool greedy;
+};
+
+struct inst {
+	int op;
+	int32_t x, y;
+};
+
+struct prog {
+	struct inst *insts;
+	size_t cnt, cap;
+};
+
+struct state {
+	int32_t *next, *pcs;
+	uint32_t pcs_cnt, hash;
+	bool match;
+};
+
+/*
+ * A lazily built DFA: each state is the ordered list of NFA threads alive
+ * at that point, and transitions are filled in on first use. In leftmost-first
+ * mode, threads of lower priority than a match are dropped, which makes the
+ * DFA die right after the end of the match a backtracker would report.
+ */
+struct dfa {
+	CFWRegex *regex;
+	struct prog *prog;
+	int32_t start_pc, start;
+	bool first;
+	struct state *states;
+	size_t states_cnt, states_cap;
+	int32_t *table;
+	size_t table_size, mem;
+	int32_t *stack, *list;
+	uint32_t *seen, gen, flushes;
+};
+
+struct CFWRegex {
+	CFWObject obj;
+	struct node *nodes;
+	size_t nodes_cnt, nodes_cap;
+	uint8_t (*sets)[32];
+	size_t sets_cnt, sets_cap;
+	struct prog forward, reverse;
+	uint8_t classes[256], reps[256];
+	size_t classes_cnt;
+	struct dfa *dfas[DFA_CNT];
+	bool anchor_start, anchor_end, literal;
+	unsigned char prefix[MAX_PREFIX];
+	size_t prefix_len;
+};
+
+struct parser {
+	CFWRegex *regex;
+	const unsigned char *pos, *end;
+	int depth;
+};
+
+static int32_t parse_alt(struct parser*);
+
+static inline bool
+in_set(const uint8_t *set, unsigned char c)
+{
+	return set[c >> 3] & (1 << (c & 7));
+}
+
+static inline void
+set_range(uint8_t *set, unsigned char lo, unsigned char hi)
+{
+	unsigned i;
+
+	for (i = lo; i <= hi; i++)
+		set[i >> 3] |= 1 << (i & 7);
+}
+
+static int32_t
+new_node(CFWRegex *regex, int type)
+{
+	struct node *node;
+
+	if (regex->nodes_cnt == regex->nodes_cap) {
+		size_t cap = (regex->nodes_cap < 16 ? 16 : regex->nodes_cap * 2);
+
+		if ((node = realloc(regex->nodes, cap * sizeof(*node))) == NULL)
+			return -1;
+
+		regex->nodes = node;
+		regex->nodes_cap = cap;
+	}
+
+	node = &regex->nodes[regex->nodes_cnt];
+	node->type = type;
+	node->a = -1;
+	node->next = -1;
+	node->min = node->max = 0;
+	node->greedy = true;
+
+	return regex->nodes_cnt++;
+}
+
+static int32_t
+new_set(CFWRegex *regex)
+{
+	if (regex->sets_cnt == regex->sets_cap) {
+		size_t cap = (regex->sets_cap < 16 ? 16 : regex->sets_cap * 2);
+		uint8_t (*sets)[32];
+
+		if ((sets = realloc(regex->sets, cap * sizeof(*sets))) == NULL)
+			return -1;
+
+		regex->sets = sets;
+		regex->sets_cap = cap;
+	}
+
+	memset(regex->sets[regex->sets_cnt], 0, 32);
+
+	return regex->sets_cnt++;
+}
+
+static int32_t
+set_node(CFWRegex *regex, int32_t set)
+{
+	int32_t node;
+
+	if (set < 0 || (node = new_node(regex, NODE_SET)) < 0)
+		return -1;
+
+	regex->nodes[node].a = set;
+
+	return node;
+}
+
+static int
+hex(unsigned char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+
+	return -1;
+}
+
+/*
+ * Parses the escape after a backslash. Returns the byte for a literal, adds
+ * shorthand classes like \d to the set and returns 256, or returns -1.
+ */
+static int
+parse_escape(struct parser *p, uint8_t *set)
+{
+	uint8_t class[32] = { 0 };
+	unsigned char c;
+	bool negate = false;
+	int hi, lo, i;
+
+	if (p->pos == p->end)
+		return -1;
+
+	switch ((c = *p->pos++)) {
+	case 'n':
+		return '\n';
+	case 't':
+		return '\t';
+	case 'r':
+		return '\r';
+	case 'f':
+		return '\f';
+	case 'v':
+		return '\v';
+	case '0':
+		return '\0';
+	case 'x':
+		if (p->end - p->pos < 2 || (hi = hex(p->pos[0])) < 0 ||
+		    (lo = hex(p->pos[1])) < 0)
+			return -1;
+
+		p->pos += 2;
+		return (hi << 4) | lo;
+	case 'D':
+		negate = true;
+		/* FALLTHROUGH */
+	case 'd':
+		set_range(class, '0', '9');
+		break;
+	case 'W':
+		negate = true;
+		/* FALLTHROUGH */
+	case 'w':
+		set_range(class, '0', '9');
+		set_range(class, 'A', 'Z');
+		set_range(class, 'a', 'z');
+		set_range(class, '_', '_');
+		break;
+	case 'S':
+		negate = true;
+		/* FALLTHROUGH */
+	case 's':
+		set_range(class, '\t', '\r');
+		set_range(class, ' ', ' ');
+		break;
+	default:
+		if ((c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') ||
+		    (c >= 'a' && c <= 'z'))
+			return -1;
+
+		return c;
+	}
+
+	for (i = 0; i < 32; i++)
+		set[i] |= (negate ? ~class[i] : class[i]);
+
+	return 256;
+}
+
+static int32_t
+parse_class(struct parser *p)
+{
+	CFWRegex *regex = p->regex;
+	uint8_t set[32] = { 0 };
+	bool negate = false, first = true;
+	int32_t index;
+	int lo, hi, i;
+
+	if (p->pos < p->end && *p->pos == '^') {
+		negate = true;
+		p->pos++;
+	}
+
+	while (p->pos < p->end && (*p->pos != ']' || first)) {
+		first = false;
+
+		if (*p->pos == '\\') {
+			p->pos++;
+			if ((lo = parse_escape(p, set)) < 0)
+				return -1;
+			if (lo == 256)
+				continue;
+		} else
+			lo = *p->pos++;
+
+		if (p->end - p->pos < 2 || p->pos[0] != '-' || p->pos[1] == ']') {
+			set_range(set, lo, lo);
+			continue;
+		}
+
+		p->pos++;
+		if (*p->pos == '\\') {
+			p->pos++;
+			if ((hi = parse_escape(p, set)) < 0 || hi == 256)
+				return -1;
+		} else
+			hi = *p->pos++;
+
+		if (hi < lo)
+			return -1;
+
+		set_range(set, lo, hi);
+	}
+
+	if (p->pos == p->end)
+		return -1;
+	p->pos++;
+
+	if ((index = new_set(regex)) < 0)
+		return -1;
+
+	for (i = 0; i < 32; i++)
+		regex->sets[index][i] = (negate ? ~set[i] : set[i]);
+
+	return set_node(regex, index);
+}
+
+static int32_t
+parse_atom(struct parser *p)
+{
+	CFWRegex *regex = p->regex;
+	int32_t node, set;
+	int c;
+
+	switch ((c = *p->pos++)) {
+	case '(':
+		if (p->pos < p->end && *p->pos == '?') {
+			if (p->end - p->pos < 2 || p->pos[1] != ':')
+				return -1;
+
+			p->pos += 2;
+		}
+
+		if ((node = parse_alt(p)) < 0)
+			return -1;
+
+		if (p->pos == p->end || *p->pos != ')')
+			return -1;
+		p->pos++;
+
+		return node;
+	case '[':
+		return parse_class(p);
+	case '*':
+	case '+':
+	case '?':
+	case '^':
+	case '$':
+		return -1;
+	}
+
+	if ((set = new_set(regex)) < 0)
+		return -1;
+
+	if (c == '.') {
+		memset(regex->sets[set], 0xFF, 32);
+		regex->sets[set]['\n' >> 3] &= ~(1 << ('\n' & 7));
+	} else {
+		if (c == '\\' && (c = parse_escape(p, regex->sets[set])) < 0)
+			return -1;
+
+		if (c < 256)
+			set_range(regex->sets[set], c, c);
+	}
+
+	return set_node(regex, set);
+}
+
+/* Returns 1 for a valid {m,n}, 0 if the brace is a literal and -1 on error */
+static int
+parse_braces(struct parser *p, int *min, int *max)
+{
+	const unsigned char *pos = p->pos + 1;
+	long n[2] = { -1, -1 };
+	int i = 0;
+	bool comma = false;
+
+	for (; pos < p->end && *pos != '}'; pos++) {
+		if (*pos == ',' && !comma) {
+			comma = true;
+			i = 1;
+		} else if (*pos >= '0' && *pos <= '9') {
+			n[i] = (n[i] < 0 ? 0 : n[i]) * 10 + (*pos - '0');
+
+			if (n[i] > MAX_REPEAT)
+				return -1;
+		} else
+			return 0;
+	}
+
+	if (pos == p->end || (n[0] < 0 && n[1] < 0))
+		return 0;
+
+	*min = (n[0] < 0 ? 0 : n[0]);
+	*max = (comma ? n[1] : n[0]);
+
+	if (*max >= 0 && *max < *min)
+		return -1;
+
+	p->pos = pos + 1;
+
+	return 1;
+}
+
+static int
+parse_quantifier(struct parser *p, int *min, int *max)
+{
+	if (p->pos == p->end)
+		return 0;
+
+	switch (*p->pos) {
+	case '*':
+		*min = 0;
+		*max = -1;
+		break;
+	case '+':
+		*min = 1;
+		*max = -1;
+		break;
+	case '?':
+		*min = 0;
+		*max = 1;
+		break;
+	case '{':
+		return parse_braces(p, min, max);
+	default:
+		return 0;
+	}
+
+	p->pos++;
+
+	return 1;
+}
+
+static int32_t
+parse_repeat(struct parser *p)
+{
+	int32_t atom, node;
+	int min, max, ret;
+
+	if ((atom = parse_atom(p)) < 0)
+		return -1;
+
+	if ((ret = parse_quantifier(p, &min, &max)) <= 0)
+		return (ret < 0 ? -1 : atom);
+
+	if ((node = new_node(p->regex, NODE_REPEAT)) < 0)
+		return -1;
+
+	p->regex->nodes[node].a = atom;
+	p->regex->nodes[node].min = min;
+	p->regex->nodes[node].max = max;
+
+	if (p->pos < p->end && *p->pos == '?') {
+		p->regex->nodes[node].greedy = false;
+		p->pos++;
+	}
+
+	/* Stacked quantifiers like a** are rejected */
+	if (parse_quantifier(p, &min, &max) != 0)
+		return -1;
+
+	return node;
+}
+
+static int32_t
+parse_cat(struct parser *p)
+{
+	int32_t node, child, last = -1;
+
+	if ((node = new_node(p->regex, NODE_CAT)) < 0)
+		return -1;
+
+	while (p->pos < p->end && *p->pos != '|' && *p->pos != ')') {
+		if ((child = parse_repeat(p)) < 0)
+			return -1;
+
+		if (last < 0)
+			p->regex->nodes[node].a = child;
+		else
+			p->regex->nodes[last].next = child;
+
+		last = child;
+	}
+
+	return node;
+}
+
+static int32_t
+parse_alt(struct parser *p)
+{
+	int32_t node, child, last;
+
+	if (++p->depth > MAX_DEPTH || (last = parse_cat(p)) < 0)
+		return -1;
+
+	if (p->pos == p->end || *p->pos != '|') {
+		p->depth--;
+		return last;
+	}
+
+	if ((node = new_node(p->regex, NODE_ALT)) < 0)
+		return -1;
+	p->regex->nodes[node].a = last;
+
+	while (p->pos < p->end && *p->pos == '|') {
+		p->pos++;
+
+		if ((child = parse_cat(p)) < 0)
+			return -1;
+
+		p->regex->nodes[last].next = child;
+		last = child;
+	}
+
+	p->depth--;
+
+	return node;
+}
+
+static int32_t
+emit(struct prog *prog, int op, int32_t x, int32_t y)
+{
+	if (prog->cnt == prog->cap) {
+		size_t cap = (prog->cap < 64 ? 64 : prog->cap * 2);
+		struct inst *insts;
+
+		if (prog->cap >= MAX_INSTS)
+			return -1;
+
+		if ((insts = realloc(prog->insts, cap * sizeof(*insts))) == NULL)
+			return -1;
+
+		prog->insts = insts;
+		prog->cap = cap;
+	}
+
+	prog->insts[prog->cnt].op = op;
+	prog->insts[prog->cnt].x = x;
+	prog->insts[prog->cnt].y = y;
+
+	return prog->cnt++;
+}
+
+static void
+set_split(struct prog *prog, int32_t split, int32_t body, int32_t skip,
+    bool greedy)
+{
+	prog->insts[split].x = (greedy ? body : skip);
+	prog->insts[split].y = (greedy ? skip : body);
+}
+
+static bool compile(CFWRegex*, struct prog*, int32_t, bool);
+
+static bool
+compile_cat(CFWRegex *regex, struct prog *prog, int32_t first, bool reverse)
+{
+	int32_t child, *children;
+	size_t i, cnt = 0;
+
+	if (!reverse) {
+		for (child = first; child >= 0; child = regex->nodes[child].next)
+			if (!compile(regex, prog, child, false))
+				return false;
+
+		return true;
+	}
+
+	for (child = first; child >= 0; child = regex->nodes[child].next)
+		cnt++;
+
+	if (cnt == 0)
+		return true;
+
+	if ((children = malloc(cnt * sizeof(int32_t))) == NULL)
+		return false;
+
+	for (i = 0, child = first; child >= 0; child = regex->nodes[child].next)
+		children[i++] = child;
+
+	for (i = cnt; i > 0; i--) {
+		if (!compile(regex, prog, children[i - 1], true)) {
+			free(children);
+			return false;
+		}
+	}
+
+	free(children);
+
+	return true;
+}
+
+static bool
+compile_alt(CFWRegex *regex, struct prog *prog, int32_t first, bool reverse)
+{
+	int32_t child, split, jmp, jmps = -1, next;
+
+	for (child = first; regex->nodes[child].next >= 0;
+	    child = regex->nodes[child].next) {
+		if ((split = emit(prog, OP_SPLIT, 0, 0)) < 0 ||
+		    !compile(regex, prog, child, reverse) ||
+		    (jmp = emit(prog, OP_JMP, jmps, 0)) < 0)
+			return false;
+
+		prog->insts[split].x = split + 1;
+		prog->insts[split].y = prog->cnt;
+		jmps = jmp;
+	}
+
+	if (!compile(regex, prog, child, reverse))
+		return false;
+
+	/* The pending jumps are chained through their targets */
+	for (; jmps >= 0; jmps = next) {
+		next = prog->insts[jmps].x;
+		prog->insts[jmps].x = prog->cnt;
+	}
+
+	return true;
+}
+
+static bool
+compile_repeat(CFWRegex *regex, struct prog *prog, struct node *node,
+    bool reverse)
+{
+	int32_t split, splits = -1, next, body;
+	int i;
+
+	if (node->max < 0 && node->min > 0) {
+		for (i = 0; i < node->min - 1; i++)
+			if (!compile(regex, prog, node->a, reverse))
+				return false;
+
+		body = prog->cnt;
+		if (!compile(regex, prog, node->a, reverse) ||
+		    (split = emit(prog, OP_SPLIT, 0, 0)) < 0)
+			return false;
+
+		set_split(prog, split, body, split + 1, node->greedy);
+
+		return true;
+	}
+
+	for (i = 0; i < node->min; i++)
+		if (!compile(regex, prog, node->a, reverse))
+			return false;
+
+	if (node->max < 0) {
+		if ((split = emit(prog, OP_SPLIT, 0, 0)) < 0 ||
+		    !compile(regex, prog, node->a, reverse) ||
+		    emit(prog, OP_JMP, split, 0) < 0)
+			return false;
+
+		set_split(prog, split, split + 1, prog->cnt, node->greedy);
+
+		return true;
+	}
+
+	/* Nested optionals: skipping one skips all the following ones */
+	for (i = node->min; i < node->max; i++) {
+		if ((split = emit(prog, OP_SPLIT, splits, 0)) < 0 ||
+		    !compile(regex, prog, node->a, reverse))
+			return false;
+
+		splits = split;
+	}
+
+	for (; splits >= 0; splits = next) {
+		next = prog->insts[splits].x;
+		set_split(prog, splits, splits + 1, prog->cnt, node->greedy);
+	}
+
+	return true;
+}
+
+static bool
+compile(CFWRegex *regex, struct prog *prog, int32_t index, bool reverse)
+{
+	struct node *node = &regex->nodes[index];
+
+	switch (node->type) {
+	case NODE_SET:
+		return (emit(prog, OP_BYTE, node->a, 0) >= 0);
+	case NODE_CAT:
+		return compile_cat(regex, prog, node->a, reverse);
+	case NODE_ALT:
+		return compile_alt(regex, prog, node->a, reverse);
+	case NODE_REPEAT:
+		return compile_repeat(regex, prog, node, reverse);
+	}
+
+	return false;
+}
+
+/* Appends the literal bytes the pattern starts with, true if it is all literal */
+static bool
+literal_prefix(CFWRegex *regex, int32_t index)
+{
+	struct node *node = &regex->nodes[index];
+	const uint8_t *set;
+	int32_t child;
+	int i, c = -1;
+
+	switch (node->type) {
+	case NODE_SET:
+		set = regex->sets[node->a];
+
+		for (i = 0; i < 256; i++) {
+			if (in_set(set, i)) {
+				if (c >= 0)
+					return false;
+
+				c = i;
+			}
+		}
+
+		if (c < 0 || regex->prefix_len == MAX_PREFIX)
+			return false;
+
+		regex->prefix[regex->prefix_len++] = c;
+
+		return true;
+	case NODE_CAT:
+		for (child = node->a; child >= 0;
+		    child = regex->nodes[child].next)
+			if (!literal_prefix(regex, child))
+				return false;
+
+		return true;
+	}
+
+	return false;
+}
+
+/* Bytes that no set tells apart share a class, which keeps states small */
+static void
+byte_classes(CFWRegex *regex)
+{
+	uint8_t classes[256];
+	int16_t map[512];
+	size_t i, cnt = 1;
+	int j;
+
+	memset(regex->classes, 0, 256);
+
+	for (i = 0; i < regex->sets_cnt; i++) {
+		size_t new_cnt = 0;
+
+		for (j = 0; j < 512; j++)
+			map[j] = -1;
+
+		for (j = 0; j < 256; j++) {
+			int key = regex->classes[j] * 2 +
+			    in_set(regex->sets[i], j);
+
+			if (map[key] < 0)
+				map[key] = new_cnt++;
+
+			classes[j] = map[key];
+		}
+
+		memcpy(regex->classes, classes, 256);
+		cnt = new_cnt;
+	}
+
+	for (j = 255; j >= 0; j--)
+		regex->reps[regex->classes[j]] = j;
+
+	regex->classes_cnt = cnt;
+}
+
+static bool
+build(CFWRegex *regex, int32_t root)
+{
+	struct prog *prog = &regex->forward;
+	int32_t any;
+
+	if ((any = new_set(regex)) < 0)
+		return false;
+	memset(regex->sets[any], 0xFF, 32);
+
+	if (emit(prog, OP_SPLIT, LOOP_LEN, 1) < 0 ||
+	    emit(prog, OP_BYTE, any, 0) < 0 || emit(prog, OP_JMP, 0, 0) < 0 ||
+	    !compile(regex, prog, root, false) ||
+	    emit(prog, OP_MATCH, 0, 0) < 0)
+		return false;
+
+	prog = &regex->reverse;
+	if (!compile(regex, prog, root, true) ||
+	    emit(prog, OP_MATCH, 0, 0) < 0)
+		return false;
+
+	regex->literal = (literal_prefix(regex, root) &&
+	    !regex->anchor_start && !regex->anchor_end);
+
+	byte_classes(regex);
+
+	return true;
+}
+
+static void
+free_dfa(struct dfa *dfa)
+{
+	size_t i;
+
+	if (dfa == NULL)
+		return;
+
+	for (i = 0; i < dfa->states_cnt; i++)
+		free(dfa->states[i].next);
+
+	free(dfa->states);
+	free(dfa->table);
+	free(dfa->stack);
+	free(dfa->list);
+	free(dfa->seen);
+	free(dfa);
+}
+
+static bool
+ctor(void *ptr, va_list args)
+{
+	CFWRegex *regex = ptr;
+	const char *pattern = va_arg(args, const char*);
+	struct parser p;
+	size_t i, len;
+	int32_t root;
+	bool ret;
+
+	regex->nodes = NULL;
+	regex->nodes_cnt = regex->nodes_cap = 0;
+	regex->sets = NULL;
+	regex->sets_cnt = regex->sets_cap = 0;
+	memset(&regex->forward, 0, sizeof(regex->forward));
+	memset(&regex->reverse, 0, sizeof(regex->reverse));
+	for (i = 0; i < DFA_CNT; i++)
+		regex->dfas[i] = NULL;
+	regex->anchor_start = regex->anchor_end = regex->literal = false;
+	regex->prefix_len = 0;
+
+	if (pattern == NULL)
+		return false;
+
+	p.regex = regex;
+	p.pos = (const unsigned char*)pattern;
+	p.end = p.pos + strlen(pattern);
+	p.depth = 0;
+
+	/* Anchors are only supported at the very start and end */
+	if (p.pos < p.end && *p.pos == '^') {
+		regex->anchor_start = true;
+		p.pos++;
+	}
+
+	if ((len = p.end - p.pos) > 0 && p.pos[len - 1] == '$') {
+		for (i = 0; i + 1 < len && p.pos[len - 2 - i] == '\\'; i++);
+
+		if (i % 2 == 0) {
+			regex->anchor_end = true;
+			p.end--;
+		}
+	}
+
+	if ((root = parse_alt(&p)) < 0 || p.pos != p.end)
+		return false;
+
+	/* ^a|b would need per-alternative anchors */
+	if ((regex->anchor_start || regex->anchor_end) &&
+	    regex->nodes[root].type == NODE_ALT)
+		return false;
+
+	ret = build(regex, root);
+
+	free(regex->nodes);
+	regex->nodes = NULL;
+
+	return ret;
+}
+
+static void
+dtor(void *ptr)
+{
+	CFWRegex *regex = ptr;
+	size_t i;
+
+	for (i = 0; i < DFA_CNT; i++)
+		free_dfa(regex->dfas[i]);
+
+	free(regex->nodes);
+	free(regex->sets);
+	free(regex->forward.insts);
+	free(regex->reverse.insts);
+}
+
+static struct dfa*
+get_dfa(CFWRegex *regex, int kind)
+{
+	struct dfa *dfa;
+	size_t cnt;
+
+	if (regex->dfas[kind] != NULL)
+		return regex->dfas[kind];
+
+	if ((dfa = calloc(1, sizeof(*dfa))) == NULL)
+		return NULL;
+
+	dfa->regex = regex;
+	dfa->prog = (kind == DFA_REVERSE ? &regex->reverse : &regex->forward);
+	dfa->first = (kind == DFA_FIRST);
+	dfa->start = UNKNOWN;
+
+	if (kind == DFA_REVERSE)
+		dfa->start_pc = 0;
+	else if (kind == DFA_ANCHORED || regex->anchor_start)
+		dfa->start_pc = LOOP_LEN;
+	else
+		dfa->start_pc = 0;
+
+	cnt = dfa->prog->cnt;
+	dfa->table_size = 64;
+
+	if ((dfa->stack = malloc((2 * cnt + 1) * sizeof(int32_t))) == NULL ||
+	    (dfa->list = malloc(cnt * sizeof(int32_t))) == NULL ||
+	    (dfa->seen = calloc(cnt, sizeof(uint32_t))) == NULL ||
+	    (dfa->table = malloc(dfa->table_size * sizeof(int32_t))) == NULL ||
+	    (dfa->states = malloc(16 * sizeof(struct state))) == NULL ||
+	    (dfa->states[0].next = calloc(regex->classes_cnt,
+	    sizeof(int32_t))) == NULL) {
+		free_dfa(dfa);
+		return NULL;
+	}
+
+	memset(dfa->table, 0xFF, dfa->table_size * sizeof(int32_t));
+	dfa->states_cap = 16;
+	dfa->states_cnt = 1;
+	dfa->states[DEAD].pcs = NULL;
+	dfa->states[DEAD].pcs_cnt = 0;
+	dfa->states[DEAD].match = false;
+
+	return (regex->dfas[kind] = dfa);
+}
+
+static void
+flush(struct dfa *dfa)
+{
+	size_t i;
+
+	for (i = 1; i < dfa->states_cnt; i++)
+		free(dfa->states[i].next);
+
+	dfa->states_cnt = 1;
+	dfa->mem = 0;
+	dfa->start = UNKNOWN;
+	dfa->flushes++;
+	memset(dfa->table, 0xFF, dfa->table_size * sizeof(int32_t));
+}
+
+static bool
+grow_table(struct dfa *dfa)
+{
+	size_t i, j, size = dfa->table_size * 2;
+	int32_t *table;
+
+	if ((table = malloc(size * sizeof(int32_t))) == NULL)
+		return false;
+
+	memset(table, 0xFF, size * sizeof(int32_t));
+
+	for (i = 1; i < dfa->states_cnt; i++) {
+		for (j = dfa->states[i].hash & (size - 1); table[j] >= 0;
+		    j = (j + 1) & (size - 1));
+
+		table[j] = i;
+	}
+
+	free(dfa->table);
+	dfa->table = table;
+	dfa->table_size = size;
+
+	return true;
+}
+
+static int
+compare_pcs(const void *a, const void *b)
+{
+	return *(const int32_t*)a - *(const int32_t*)b;
+}
+
+static int32_t
+add_state(struct dfa *dfa, int32_t *list, uint32_t cnt)
+{
+	CFWRegex *regex = dfa->regex;
+	struct state *state;
+	size_t i, size;
+	uint32_t hash = 2166136261u;
+
+	if (cnt == 0)
+		return DEAD;
+
+	/* Only the order of leftmost-first states matters */
+	if (!dfa->first)
+		qsort(list, cnt, sizeof(int32_t), compare_pcs);
+
+	for (i = 0; i < cnt; i++)
+		hash = (hash ^ (uint32_t)list[i]) * 16777619u;
+
+	for (i = hash & (dfa->table_size - 1); dfa->table[i] >= 0;
+	    i = (i + 1) & (dfa->table_size - 1)) {
+		state = &dfa->states[dfa->table[i]];
+
+		if (state->hash == hash && state->pcs_cnt == cnt &&
+		    !memcmp(state->pcs, list, cnt * sizeof(int32_t)))
+			return dfa->table[i];
+	}
+
+	/* Scans keep their threads, so they can rebuild their state after it */
+	if (dfa->mem > CACHE_SIZE)
+		flush(dfa);
+
+	if (dfa->states_cnt == dfa->states_cap) {
+		size_t cap = dfa->states_cap * 2;
+
+		if (cap > INT32_MAX || (state = realloc(dfa->states,
+		    cap * sizeof(*state))) == NULL)
+			return UNKNOWN;
+
+		dfa->states = state;
+		dfa->states_cap = cap;
+	}
+
+	if (dfa->states_cnt * 2 >= dfa->table_size && !grow_table(dfa))
+		return UNKNOWN;
+
+	size = (regex->classes_cnt + cnt) * sizeof(int32_t);
+	state = &dfa->states[dfa->states_cnt];
+
+	if ((state->next = malloc(size)) == NULL)
+		return UNKNOWN;
+
+	memset(state->next, 0xFF, regex->classes_cnt * sizeof(int32_t));
+	state->pcs = state->next + regex->classes_cnt;
+	memcpy(state->pcs, list, cnt * sizeof(int32_t));
+	state->pcs_cnt = cnt;
+	state->hash = hash;
+	state->match = false;
+
+	for (i = 0; i < cnt; i++)
+		if (dfa->prog->insts[list[i]].op == OP_MATCH)
+			state->match = true;
+
+	for (i = hash & (dfa->table_size - 1); dfa->table[i] >= 0;
+	    i = (i + 1) & (dfa->table_size - 1));
+	dfa->table[i] = dfa->states_cnt;
+
+	dfa->mem += sizeof(struct state) + size;
+
+	return dfa->states_cnt++;
+}
+
+static void
+next_gen(struct dfa *dfa)
+{
+	if (++dfa->gen == 0) {
+		memset(dfa->seen, 0, dfa->prog->cnt * sizeof(uint32_t));
+		dfa->gen = 1;
+	}
+}
+
+/*
+ * Appends the threads reachable from pc in priority order. Returns true if a
+ * match cut off all threads of lower priority.
+ */
+static bool
+add_closure(struct dfa *dfa, int32_t pc, uint32_t *cnt)
+{
+	const struct inst *insts = dfa->prog->insts;
+	int32_t *stack = dfa->stack;
+	size_t sp = 0;
+
+	stack[sp++] = pc;
+
+	while (sp > 0) {
+		pc = stack[--sp];
+
+		if (dfa->seen[pc] == dfa->gen)
+			continue;
+		dfa->seen[pc] = dfa->gen;
+
+		switch (insts[pc].op) {
+		case OP_JMP:
+			stack[sp++] = insts[pc].x;
+			break;
+		case OP_SPLIT:
+			stack[sp++] = insts[pc].y;
+			stack[sp++] = insts[pc].x;
+			break;
+		case OP_BYTE:
+			dfa->list[(*cnt)++] = pc;
+			break;
+		case OP_MATCH:
+			dfa->list[(*cnt)++] = pc;
+
+			if (dfa->first)
+				return true;
+
+			break;
+		}
+	}
+
+	return false;
+}
+
+static int32_t
+start_state(struct dfa *dfa)
+{
+	uint32_t cnt = 0;
+	int32_t state;
+
+	if (dfa->start != UNKNOWN)
+		return dfa->start;
+
+	next_gen(dfa);
+	add_closure(dfa, dfa->start_pc, &cnt);
+
+	if ((state = add_state(dfa, dfa->list, cnt)) < 0)
+		return UNKNOWN;
+
+	return (dfa->start = state);
+}
+
+static int32_t
+step(struct dfa *dfa, int32_t from, uint8_t class)
+{
+	const struct inst *insts = dfa->prog->insts;
+	const struct state *state = &dfa->states[from];
+	unsigned char c = dfa->regex->reps[class];
+	uint32_t i, cnt = 0, flushes = dfa->flushes;
+	int32_t to;
+
+	next_gen(dfa);
+
+	for (i = 0; i < state->pcs_cnt; i++) {
+		const struct inst *inst = &insts[state->pcs[i]];
+
+		if (inst->op == OP_BYTE && in_set(dfa->regex->sets[inst->x], c) &&
+		    add_closure(dfa, state->pcs[i] + 1, &cnt))
+			break;
+	}
+
+	if ((to = add_state(dfa, dfa->list, cnt)) >= 0 &&
+	    dfa->flushes == flushes)
+		dfa->states[from].next[class] = to;
+
+	return to;
+}
+
+static inline int32_t
+next_state(struct dfa *dfa, int32_t state, unsigned char c)
+{
+	uint8_t class = dfa->regex->classes[c];
+	int32_t next = dfa->states[state].next[class];
+
+	if (next == UNKNOWN)
+		next = step(dfa, state, class);
+
+	return next;
+}
+
+/* Finds the end of the leftmost-first match, or of the earliest one */
+static bool
+forward(CFWRegex *regex, const unsigned char *buf, size_t len, size_t pos,
+    bool earliest, size_t *end)
+{
+	struct dfa *dfa;
+	int32_t state;
+	bool skip;
+
+	*end = SIZE_MAX;
+
+	if ((dfa = get_dfa(regex, DFA_FIRST)) == NULL ||
+	    (state = start_state(dfa)) < 0)
+		return false;
+
+	if (dfa->states[state].match) {
+		*end = pos;
+
+		if (earliest)
+			return true;
+	}
+
+	skip = (regex->prefix_len > 0 && !regex->anchor_start);
+
+	while (pos < len) {
+		/* Back at the start, jump to where the prefix occurs next */
+		if (skip && state == dfa->start) {
+			size_t off = cfw_memmem(buf + pos, len - pos,
+			    regex->prefix, regex->prefix_len);
+
+			if (off == SIZE_MAX)
+				return true;
+
+			pos += off;
+		}
+
+		if ((state = next_state(dfa, state, buf[pos++])) < 0)
+			return false;
+
+		if (state == DEAD)
+			break;
+
+		if (dfa->states[state].match) {
+			*end = pos;
+
+			if (earliest)
+				break;
+		}
+	}
+
+	return true;
+}
+
+/* Finds the lowest start of a match ending at end, scanning backwards */
+static bool
+reverse(CFWRegex *regex, const unsigned char *buf, size_t start, size_t end,
+    bool earliest, size_t *found)
+{
+	struct dfa *dfa;
+	int32_t state;
+
+	*found = SIZE_MAX;
+
+	if ((dfa = get_dfa(regex, DFA_REVERSE)) == NULL ||
+	    (state = start_state(dfa)) < 0)
+		return false;
+
+	if (dfa->states[state].match) {
+		*found = end;
+
+		if (earliest)
+			return true;
+	}
+
+	while (end > start) {
+		if ((state = next_state(dfa, state, buf[--end])) < 0)
+			return false;
+
+		if (state == DEAD)
+			break;
+
+		if (dfa->states[state].match) {
+			*found = end;
+
+			if (earliest)
+				break;
+		}
+	}
+
+	return true;
+}
+
+static bool
+whole(CFWRegex *regex, const unsigned char *buf, size_t len)
+{
+	struct dfa *dfa;
+	int32_t state;
+	size_t i;
+
+	if ((dfa = get_dfa(regex, DFA_ANCHORED)) == NULL ||
+	    (state = start_state(dfa)) < 0)
+		return false;
+
+	for (i = 0; i < len; i++)
+		if ((state = next_state(dfa, state, buf[i])) <= DEAD)
+			return false;
+
+	return dfa->states[state].match;
+}
+
+static bool
+find(CFWRegex *regex, const unsigned char *buf, size_t len, size_t pos,
+    cfw_range_t *range)
+{
+	size_t start, end;
+
+	if (regex->literal) {
+		if ((start = cfw_memmem(buf + pos, len - pos, regex->prefix,
+		    regex->prefix_len)) == SIZE_MAX)
+			return false;
+
+		range->start = pos + start;
+		range->length = regex->prefix_len;
+
+		return true;
+	}
+
+	if (regex->anchor_start && pos > 0)
+		return false;
+
+	if (regex->anchor_end) {
+		end = len;
+
+		if (regex->anchor_start) {
+			if (!whole(regex, buf, len))
+				return false;
+
+			start = 0;
+		} else if (!reverse(regex, buf, pos, len, false, &start) ||
+		    start == SIZE_MAX)
+			return false;
+	} else {
+		if (!forward(regex, buf, len, pos, false, &end) ||
+		    end == SIZE_MAX)
+			return false;
+
+		if (regex->anchor_start)
+			start = 0;
+		else if (!reverse(regex, buf, pos, end, false, &start) ||
+		    start == SIZE_MAX)
+			return false;
+	}
+
+	range->start = start;
+	range->length = end - start;
+
+	return true;
+}
+
+bool
+cfw_regex_match(CFWRegex *regex, const void *buf, size_t len)
+{
+	if (regex->literal)
+		return (len == regex->prefix_len &&
+		    !memcmp(buf, regex->prefix, len));
+
+	return whole(regex, buf, len);
+}
+
+bool
+cfw_regex_match_string(CFWRegex *regex, CFWString *str)
+{
+	return cfw_regex_match(regex, cfw_string_c(str),
+	    cfw_string_length(str));
+}
+
+bool
+cfw_regex_search(CFWRegex *regex, const void *buf, size_t len)
+{
+	size_t found;
+
+	if (regex->literal)
+		return (cfw_memmem(buf, len, regex->prefix,
+		    regex->prefix_len) != SIZE_MAX);
+
+	if (regex->anchor_end) {
+		if (regex->anchor_start)
+			return whole(regex, buf, len);
+
+		return (reverse(regex, buf, 0, len, true, &found) &&
+		    found != SIZE_MAX);
+	}
+
+	return (forward(regex, buf, len, 0, true, &found) &&
+	    found != SIZE_MAX);
+}
+
+bool
+cfw_regex_search_string(CFWRegex *regex, CFWString *str)
+{
+	return cfw_regex_search(regex, cfw_string_c(str),
+	    cfw_string_length(str));
+}
+
+bool
+cfw_regex_find(CFWRegex *regex, const void *buf, size_t len,
+    cfw_range_t *range)
+{
+	return find(regex, buf, len, 0, range);
+}
+
+bool
+cfw_regex_find_string(CFWRegex *regex, CFWString *str, cfw_range_t *range)
+{
+	return find(regex, (const unsigned char*)cfw_string_c(str),
+	    cfw_string_length(str), 0, range);
+}
+
+CFWArray*
+cfw_regex_find_all(CFWRegex *regex, CFWString *str)
+{
+	const unsigned char *buf = (const unsigned char*)cfw_string_c(str);
+	size_t pos = 0, len = cfw_string_length(str);
+	CFWArray *array;
+	cfw_range_t range;
+
+	if ((array = cfw_create(cfw_array, (void*)NULL)) == NULL)
+		return NULL;
+
+	while (pos <= len && find(regex, buf, len, pos, &range)) {
+		CFWStringView *view;
+
+		if ((view = cfw_new(cfw_stringview, str, range)) == NULL)
+			return NULL;
+
+		if (!cfw_array_push(array, view)) {
+			cfw_unref(view);
+			return NULL;
+		}
+
+		cfw_unref(view);
+
+		pos = range.start + range.length + (range.length == 0);
+	}
+
+	return array;
+}
+
+void
+cfw_regex_scan(CFWRegex *regex, cfw_regex_scan_t *scan)
+{
+	scan->_regex = regex;
+	scan->_state = UNKNOWN;
+	scan->_pcs = NULL;
+	scan->_pcs_cnt = 0;
+	scan->_flushes = 0;
+	scan->_pos = 0;
+	scan->_end = SIZE_MAX;
+	scan->_matched = false;
+	scan->_finished = false;
+}
+
+/* A state number is only valid until the cache is flushed */
+static int32_t
+resume(struct dfa *dfa, cfw_regex_scan_t *scan)
+{
+	if (scan->_state == UNKNOWN)
+		return start_state(dfa);
+
+	if (scan->_flushes != dfa->flushes)
+		return add_state(dfa, scan->_pcs, scan->_pcs_cnt);
+
+	return scan->_state;
+}
+
+/* Keeps the threads of the state, which is all that is needed to rebuild it */
+static bool
+suspend(struct dfa *dfa, cfw_regex_scan_t *scan, int32_t state)
+{
+	const struct state *st = &dfa->states[state];
+
+	if (scan->_pcs == NULL && st->pcs_cnt > 0 &&
+	    (scan->_pcs = malloc(dfa->prog->cnt * sizeof(int32_t))) == NULL)
+		return false;
+
+	if (st->pcs_cnt > 0)
+		memcpy(scan->_pcs, st->pcs, st->pcs_cnt * sizeof(int32_t));
+
+	scan->_pcs_cnt = st->pcs_cnt;
+	scan->_flushes = dfa->flushes;
+	scan->_state = state;
+
+	return true;
+}
+
+bool
+cfw_regex_feed(cfw_regex_scan_t *scan, const void *buf, size_t len,
+    size_t *end)
+{
+	CFWRegex *regex = scan->_regex;
+	const unsigned char *bytes = buf;
+	struct dfa *dfa;
+	int32_t state;
+	size_t pos = 0;
+	bool skip;
+
+	if (scan->_matched) {
+		*end = scan->_end;
+		return true;
+	}
+
+	if (scan->_finished || (dfa = get_dfa(regex,
+	    (regex->anchor_end ? DFA_LONGEST : DFA_FIRST))) == NULL)
+		return false;
+
+	if (scan->_state == UNKNOWN) {
+		if ((state = start_state(dfa)) < 0)
+			return false;
+
+		if (!regex->anchor_end && dfa->states[state].match) {
+			scan->_state = state;
+			scan->_matched = true;
+			*end = scan->_end = 0;
+
+			return true;
+		}
+	} else if ((state = resume(dfa, scan)) < 0)
+		return false;
+
+	skip = (regex->prefix_len > 0 && !regex->anchor_start);
+
+	while (pos < len && state != DEAD) {
+		/* A prefix may straddle chunks, so keep the tail for the DFA */
+		if (skip && state == dfa->start) {
+			size_t off = cfw_memmem(bytes + pos, len - pos,
+			    regex->prefix, regex->prefix_len);
+
+			if (off == SIZE_MAX)
+				off = (len - pos > regex->prefix_len - 1 ?
+				    len - pos - (regex->prefix_len - 1) : 0);
+
+			if ((pos += off) == len)
+				break;
+		}
+
+		if ((state = next_state(dfa, state, bytes[pos++])) < 0)
+			return false;
+
+		if (!regex->anchor_end && dfa->states[state].match) {
+			scan->_state = state;
+			scan->_matched = true;
+			*end = scan->_end = scan->_pos + pos;
+			scan->_pos += len;
+
+			return true;
+		}
+	}
+
+	scan->_pos += len;
+
+	/* Without a copy of its threads, the scan can't go on */
+	if (!suspend(dfa, scan, state))
+		scan->_finished = true;
+
+	return false;
+}
+
+bool
+cfw_regex_finish(cfw_regex_scan_t *scan, size_t *end)
+{
+	CFWRegex *regex = scan->_regex;
+	struct dfa *dfa;
+
+	if (scan->_finished) {
+		*end = scan->_end;
+		return scan->_matched;
+	}
+
+	scan->_finished = true;
+
+	/* Nothing was fed, so the empty input decides */
+	if (!regex->anchor_end && !scan->_matched &&
+	    scan->_state == UNKNOWN &&
+	    (dfa = get_dfa(regex, DFA_FIRST)) != NULL) {
+		int32_t state = start_state(dfa);
+
+		if (state >= 0 && dfa->states[state].match) {
+			scan->_matched = true;
+			scan->_end = 0;
+		}
+	}
+
+	if (regex->anchor_end && !scan->_matched &&
+	    (dfa = get_dfa(regex, DFA_LONGEST)) != NULL) {
+		int32_t state = resume(dfa, scan);
+
+		if (state >= 0 && dfa->states[state].match) {
+			scan->_matched = true;
+			scan->_end = scan->_pos;
+		}
+	}
+
+	free(scan->_pcs);
+	scan->_pcs = NULL;
+
+	*end = scan->_end;
+
+	return scan->_matched;
+}
+
+bool
+cfw_regex_search_stream(CFWRegex *regex, void *stream)
+{
+	char buf[CHUNK_SIZE];
+	cfw_regex_scan_t scan;
+	size_t end;
+	ssize_t len;
+
+	cfw_regex_scan(regex, &scan);
+
+	while (!cfw_stream_at_end(stream)) {
+		if ((len = cfw_stream_read(stream, buf, sizeof(buf))) <= 0)
+			break;
+
+		if (cfw_regex_feed(&scan, buf, len, &end))
+			break;
+	}
+
+	return cfw_regex_finish(&scan, &end);
+}
+
+static CFWClass class = {
+	.name = "CFWRegex",
+	.size = sizeof(CFWRegex),
+	.ctor = ctor,
+	.dtor = dtor
+};
+CFWClass *cfw_regex = &class;
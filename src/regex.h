@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2012, Jonathan Schleifer <js@webkeks.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __COREFW_REGEX_H__
+#define __COREFW_REGEX_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "class.h"
+#include "range.h"
+#include "string.h"
+#include "array.h"
+
+typedef struct CFWRegex CFWRegex;
+
+typedef struct cfw_regex_scan_t {
+	/* private */
+	CFWRegex *_regex;
+	int32_t _state, *_pcs;
+	uint32_t _pcs_cnt, _flushes;
+	size_t _pos, _end;
+	bool _matched, _finished;
+} cfw_regex_scan_t;
+
+/*
+ * Matching fills a cache inside the regex, so a CFWRegex must not be used by
+ * two threads at once. A scan holds memory until cfw_regex_finish.
+ */
+extern CFWClass *cfw_regex;
+extern bool cfw_regex_match(CFWRegex*, const void*, size_t);
+extern bool cfw_regex_match_string(CFWRegex*, CFWString*);
+extern bool cfw_regex_search(CFWRegex*, const void*, size_t);
+extern bool cfw_regex_search_string(CFWRegex*, CFWString*);
+extern bool cfw_regex_find(CFWRegex*, const void*, size_t, cfw_range_t*);
+extern bool cfw_regex_find_string(CFWRegex*, CFWString*, cfw_range_t*);
+extern CFWArray* cfw_regex_find_all(CFWRegex*, CFWString*);
+extern void cfw_regex_scan(CFWRegex*, cfw_regex_scan_t*);
+extern bool cfw_regex_feed(cfw_regex_scan_t*, const void*, size_t, size_t*);
+extern bool cfw_regex_finish(cfw_regex_scan_t*, size_t*);
+extern bool cfw_regex_search_stream(CFWRegex*, void*);
+
+#endif
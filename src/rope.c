@@ -0,0 +1,641 @@
+/*
+ * Copyright (c) 2012, Jonathan Schleifer <js@webkeks.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "object.h"
+#include "rope.h"
+#include "hash.h"
+
+#define CHUNK_SIZE 2048
+
+/*
+ * Nodes are immutable and reference counted, so edits copy only the path
+ * from the root to the edit and copies of a rope share everything else.
+ * The tree is kept AVL-balanced; only leaves carry data.
+ */
+struct node {
+	uint32_t refs;
+	unsigned height;
+	size_t len;
+	struct node *left, *right;
+	char data[];
+};
+
+struct CFWRope {
+	CFWObject obj;
+	struct node *root;
+};
+
+static struct node*
+retain(struct node *node)
+{
+	if (node != NULL)
+		__atomic_add_fetch(&node->refs, 1, __ATOMIC_RELAXED);
+
+	return node;
+}
+
+static void
+release(struct node *node)
+{
+	while (node != NULL) {
+		struct node *right;
+
+		if (__atomic_sub_fetch(&node->refs, 1, __ATOMIC_ACQ_REL) > 0)
+			return;
+
+		release(node->left);
+		right = node->right;
+		free(node);
+
+		node = right;
+	}
+}
+
+static unsigned
+height(struct node *node)
+{
+	return (node != NULL ? node->height : 0);
+}
+
+static struct node*
+new_leaf(const void *data1, size_t len1, const void *data2, size_t len2)
+{
+	struct node *node;
+
+	if ((node = malloc(sizeof(*node) + len1 + len2)) == NULL)
+		return NULL;
+
+	node->refs = 1;
+	node->height = 0;
+	node->len = len1 + len2;
+	node->left = node->right = NULL;
+	memcpy(node->data, data1, len1);
+	if (len2 > 0)
+		memcpy(node->data + len1, data2, len2);
+
+	return node;
+}
+
+/* All tree builders consume the references passed to them */
+static struct node*
+new_concat(struct node *left, struct node *right)
+{
+	struct node *node;
+
+	if (left == NULL || right == NULL ||
+	    (node = malloc(sizeof(*node))) == NULL) {
+		release(left);
+		release(right);
+		return NULL;
+	}
+
+	node->refs = 1;
+	node->height = (left->height > right->height ?
+	    left->height : right->height) + 1;
+	node->len = left->len + right->len;
+	node->left = left;
+	node->right = right;
+
+	return node;
+}
+
+/* Builds a node from two subtrees whose heights differ by at most 2 */
+static struct node*
+balance(struct node *left, struct node *right)
+{
+	struct node *a, *b, *c;
+
+	if (left == NULL || right == NULL) {
+		release(left);
+		release(right);
+		return NULL;
+	}
+
+	if (left->height > right->height + 1) {
+		a = retain(left->left);
+
+		if (height(left->left) >= height(left->right)) {
+			b = retain(left->right);
+			release(left);
+			return new_concat(a, new_concat(b, right));
+		}
+
+		b = retain(left->right->left);
+		c = retain(left->right->right);
+		release(left);
+		return new_concat(new_concat(a, b), new_concat(c, right));
+	}
+
+	if (right->height > left->height + 1) {
+		c = retain(right->right);
+
+		if (height(right->right) >= height(right->left)) {
+			b = retain(right->left);
+			release(right);
+			return new_concat(new_concat(left, b), c);
+		}
+
+		a = retain(right->left->left);
+		b = retain(right->left->right);
+		release(right);
+		return new_concat(new_concat(left, a), new_concat(b, c));
+	}
+
+	return new_concat(left, right);
+}
+
+static struct node*
+join(struct node *left, struct node *right)
+{
+	struct node *a, *b;
+
+	if (left == NULL)
+		return right;
+	if (right == NULL)
+		return left;
+
+	/* Keep small edits from fragmenting the rope into tiny leaves */
+	if (left->height == 0 && right->height == 0 &&
+	    left->len + right->len <= CHUNK_SIZE) {
+		a = new_leaf(left->data, left->len, right->data, right->len);
+		release(left);
+		release(right);
+		return a;
+	}
+
+	if (left->height > right->height + 1) {
+		a = retain(left->left);
+		b = retain(left->right);
+		release(left);
+
+		if ((b = join(b, right)) == NULL) {
+			release(a);
+			return NULL;
+		}
+
+		return balance(a, b);
+	}
+
+	if (right->height > left->height + 1) {
+		a = retain(right->left);
+		b = retain(right->right);
+		release(right);
+
+		if ((a = join(left, a)) == NULL) {
+			release(b);
+			return NULL;
+		}
+
+		return balance(a, b);
+	}
+
+	return new_concat(left, right);
+}
+
+static bool
+split(struct node *node, size_t pos, struct node **left, struct node **right)
+{
+	struct node *a, *b, *tmp;
+
+	*left = *right = NULL;
+
+	if (node == NULL)
+		return true;
+
+	if (pos == 0) {
+		*right = node;
+		return true;
+	}
+
+	if (pos >= node->len) {
+		*left = node;
+		return true;
+	}
+
+	if (node->height == 0) {
+		*left = new_leaf(node->data, pos, NULL, 0);
+		*right = new_leaf(node->data + pos, node->len - pos, NULL, 0);
+		release(node);
+
+		if (*left == NULL || *right == NULL) {
+			release(*left);
+			release(*right);
+			*left = *right = NULL;
+			return false;
+		}
+
+		return true;
+	}
+
+	a = retain(node->left);
+	b = retain(node->right);
+	release(node);
+
+	if (pos < a->len) {
+		if (!split(a, pos, left, &tmp)) {
+			release(b);
+			return false;
+		}
+
+		if ((*right = join(tmp, b)) == NULL) {
+			release(*left);
+			*left = NULL;
+			return false;
+		}
+	} else {
+		if (!split(b, pos - a->len, &tmp, right)) {
+			release(a);
+			return false;
+		}
+
+		if ((*left = join(a, tmp)) == NULL) {
+			release(*right);
+			*right = NULL;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static struct node*
+build(const char *data, size_t len)
+{
+	size_t chunks, half;
+
+	if (len <= CHUNK_SIZE)
+		return new_leaf(data, len, NULL, 0);
+
+	chunks = (len + CHUNK_SIZE - 1) / CHUNK_SIZE;
+	half = (chunks / 2) * CHUNK_SIZE;
+
+	return new_concat(build(data, half), build(data + half, len - half));
+}
+
+static bool
+ctor(void *ptr, va_list args)
+{
+	CFWRope *rope = ptr;
+	const char *cstr = va_arg(args, const char*);
+
+	rope->root = NULL;
+
+	if (cstr != NULL && *cstr != '\0')
+		if ((rope->root = build(cstr, strlen(cstr))) == NULL)
+			return false;
+
+	return true;
+}
+
+static void
+dtor(void *ptr)
+{
+	CFWRope *rope = ptr;
+
+	release(rope->root);
+}
+
+static bool
+equal(void *ptr1, void *ptr2)
+{
+	CFWObject *obj2 = ptr2;
+	CFWRope *rope1, *rope2;
+	cfw_rope_iter_t iter1, iter2;
+	size_t pos1, pos2;
+
+	if (obj2->cls != cfw_rope)
+		return false;
+
+	rope1 = ptr1;
+	rope2 = ptr2;
+
+	if (cfw_rope_length(rope1) != cfw_rope_length(rope2))
+		return false;
+
+	if (rope1->root == rope2->root)
+		return true;
+
+	cfw_rope_iter(rope1, &iter1);
+	cfw_rope_iter(rope2, &iter2);
+	pos1 = pos2 = 0;
+
+	/* The chunk boundaries of the two ropes need not line up */
+	while (iter1.chunk != NULL && iter2.chunk != NULL) {
+		size_t len1 = iter1.len - pos1, len2 = iter2.len - pos2;
+		size_t len = (len1 < len2 ? len1 : len2);
+
+		if (memcmp(iter1.chunk + pos1, iter2.chunk + pos2, len))
+			return false;
+
+		pos1 += len;
+		pos2 += len;
+
+		if (pos1 == iter1.len) {
+			cfw_rope_iter_next(&iter1);
+			pos1 = 0;
+		}
+
+		if (pos2 == iter2.len) {
+			cfw_rope_iter_next(&iter2);
+			pos2 = 0;
+		}
+	}
+
+	return true;
+}
+
+static uint32_t
+hash(void *ptr)
+{
+	cfw_rope_iter_t iter;
+	size_t i;
+	uint32_t hash;
+
+	CFW_HASH_INIT(hash);
+
+	for (cfw_rope_iter(ptr, &iter); iter.chunk != NULL;
+	    cfw_rope_iter_next(&iter))
+		for (i = 0; i < iter.len; i++)
+			CFW_HASH_ADD(hash, iter.chunk[i]);
+
+	CFW_HASH_FINALIZE(hash);
+
+	return hash;
+}
+
+static void*
+copy(void *ptr)
+{
+	CFWRope *rope = ptr;
+	CFWRope *new;
+
+	if ((new = cfw_new(cfw_rope, (void*)NULL)) == NULL)
+		return NULL;
+
+	new->root = retain(rope->root);
+
+	return new;
+}
+
+size_t
+cfw_rope_length(CFWRope *rope)
+{
+	return (rope->root != NULL ? rope->root->len : 0);
+}
+
+bool
+cfw_rope_insert(CFWRope *rope, size_t pos, const void *buf, size_t len)
+{
+	struct node *left, *right, *mid;
+
+	if (pos > cfw_rope_length(rope))
+		return false;
+
+	if (len == 0)
+		return true;
+
+	if ((mid = build(buf, len)) == NULL)
+		return false;
+
+	if (!split(retain(rope->root), pos, &left, &right)) {
+		release(mid);
+		return false;
+	}
+
+	if ((left = join(left, mid)) == NULL) {
+		release(right);
+		return false;
+	}
+
+	if ((left = join(left, right)) == NULL)
+		return false;
+
+	release(rope->root);
+	rope->root = left;
+
+	return true;
+}
+
+bool
+cfw_rope_insert_c(CFWRope *rope, size_t pos, const char *cstr)
+{
+	return cfw_rope_insert(rope, pos, cstr, strlen(cstr));
+}
+
+bool
+cfw_rope_insert_string(CFWRope *rope, size_t pos, CFWString *str)
+{
+	return cfw_rope_insert(rope, pos, cfw_string_c(str),
+	    cfw_string_length(str));
+}
+
+bool
+cfw_rope_append(CFWRope *rope, const void *buf, size_t len)
+{
+	return cfw_rope_insert(rope, cfw_rope_length(rope), buf, len);
+}
+
+bool
+cfw_rope_append_rope(CFWRope *rope, CFWRope *other)
+{
+	struct node *root;
+
+	if (other->root == NULL)
+		return true;
+
+	if ((root = join(retain(rope->root), retain(other->root))) == NULL)
+		return false;
+
+	release(rope->root);
+	rope->root = root;
+
+	return true;
+}
+
+bool
+cfw_rope_delete(CFWRope *rope, cfw_range_t range)
+{
+	struct node *left, *mid, *right;
+	size_t len = cfw_rope_length(rope);
+
+	if (range.start > len)
+		return false;
+
+	if (range.length == SIZE_MAX)
+		range.length = len - range.start;
+
+	if (range.length > len - range.start)
+		return false;
+
+	if (range.length == 0)
+		return true;
+
+	if (!split(retain(rope->root), range.start, &left, &right))
+		return false;
+
+	if (!split(right, range.length, &mid, &right)) {
+		release(left);
+		return false;
+	}
+
+	release(mid);
+
+	/* Deleting everything leaves nothing to join */
+	if ((left != NULL || right != NULL) &&
+	    (left = join(left, right)) == NULL)
+		return false;
+
+	release(rope->root);
+	rope->root = left;
+
+	return true;
+}
+
+CFWRope*
+cfw_rope_subrope(CFWRope *rope, cfw_range_t range)
+{
+	struct node *left, *mid, *right;
+	CFWRope *new;
+	size_t len = cfw_rope_length(rope);
+
+	if (range.start > len)
+		return NULL;
+
+	if (range.length == SIZE_MAX)
+		range.length = len - range.start;
+
+	if (range.length > len - range.start)
+		return NULL;
+
+	if ((new = cfw_create(cfw_rope, (void*)NULL)) == NULL)
+		return NULL;
+
+	if (!split(retain(rope->root), range.start, &left, &right))
+		return NULL;
+
+	release(left);
+
+	if (!split(right, range.length, &mid, &right))
+		return NULL;
+
+	release(right);
+	new->root = mid;
+
+	return new;
+}
+
+static void
+push_left(cfw_rope_iter_t *iter, struct node *node)
+{
+	while (node != NULL && node->height > 0) {
+		iter->_stack[iter->_depth++] = node->right;
+		node = node->left;
+	}
+
+	iter->chunk = (node != NULL ? node->data : NULL);
+	iter->len = (node != NULL ? node->len : 0);
+}
+
+void
+cfw_rope_iter(CFWRope *rope, cfw_rope_iter_t *iter)
+{
+	iter->_depth = 0;
+	push_left(iter, rope->root);
+}
+
+void
+cfw_rope_iter_next(cfw_rope_iter_t *iter)
+{
+	if (iter->_depth == 0) {
+		iter->chunk = NULL;
+		iter->len = 0;
+		return;
+	}
+
+	push_left(iter, iter->_stack[--iter->_depth]);
+}
+
+CFWString*
+cfw_rope_string(CFWRope *rope)
+{
+	CFWString *str;
+	cfw_rope_iter_t iter;
+
+	if ((str = cfw_create(cfw_string, (void*)NULL)) == NULL)
+		return NULL;
+
+	if (!cfw_string_reserve(str, cfw_rope_length(rope)))
+		return NULL;
+
+	for (cfw_rope_iter(rope, &iter); iter.chunk != NULL;
+	    cfw_rope_iter_next(&iter))
+		if (!cfw_string_append_buf(str, iter.chunk, iter.len))
+			return NULL;
+
+	return str;
+}
+
+bool
+cfw_rope_write(CFWRope *rope, void *stream)
+{
+	cfw_rope_iter_t iter;
+
+	for (cfw_rope_iter(rope, &iter); iter.chunk != NULL;
+	    cfw_rope_iter_next(&iter))
+		if (!cfw_stream_write(stream, iter.chunk, iter.len))
+			return false;
+
+	return true;
+}
+
+static bool
+describe(void *ptr, cfw_writer_t write, void *ctx)
+{
+	cfw_rope_iter_t iter;
+
+	for (cfw_rope_iter(ptr, &iter); iter.chunk != NULL;
+	    cfw_rope_iter_next(&iter))
+		if (!write(ctx, iter.chunk, iter.len))
+			return false;
+
+	return true;
+}
+
+static CFWClass class = {
+	.name = "CFWRope",
+	.size = sizeof(CFWRope),
+	.ctor = ctor,
+	.dtor = dtor,
+	.equal = equal,
+	.hash = hash,
+	.copy = copy,
+	.describe = describe
+};
+CFWClass *cfw_rope = &class;
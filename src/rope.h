@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2012, Jonathan Schleifer <js@webkeks.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __COREFW_ROPE_H__
+#define __COREFW_ROPE_H__
+
+#include "class.h"
+#include "range.h"
+#include "string.h"
+#include "stream.h"
+
+#define CFW_ROPE_MAX_DEPTH 96
+
+typedef struct CFWRope CFWRope;
+
+typedef struct cfw_rope_iter_t {
+	const char *chunk;
+	size_t len;
+	/* private */
+	void *_stack[CFW_ROPE_MAX_DEPTH];
+	unsigned _depth;
+} cfw_rope_iter_t;
+
+extern CFWClass *cfw_rope;
+extern size_t cfw_rope_length(CFWRope*);
+extern bool cfw_rope_insert(CFWRope*, size_t, const void*, size_t);
+extern bool cfw_rope_insert_c(CFWRope*, size_t, const char*);
+extern bool cfw_rope_insert_string(CFWRope*, size_t, CFWString*);
+extern bool cfw_rope_append(CFWRope*, const void*, size_t);
+extern bool cfw_rope_append_rope(CFWRope*, CFWRope*);
+extern bool cfw_rope_delete(CFWRope*, cfw_range_t);
+extern CFWRope* cfw_rope_subrope(CFWRope*, cfw_range_t);
+extern void cfw_rope_iter(CFWRope*, cfw_rope_iter_t*);
+extern void cfw_rope_iter_next(cfw_rope_iter_t*);
+extern CFWString* cfw_rope_string(CFWRope*);
+extern bool cfw_rope_write(CFWRope*, void*);
+
+#endif
@@ -0,0 +1,837 @@
+/*
+ * Copyright (c) 2012, Jonathan Schleifer <js@webkeks.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef __linux__
+# include <sys/epoll.h>
+#endif
+
+#include "object.h"
+#include "runloop.h"
+#include "stream.h"
+
+#define EVENT_BATCH 256
+#define DEFAULT_READ_MAX (16 * CFW_STREAM_BUFSIZE)
+#define DEFAULT_WRITE_MAX (1024 * 1024)
+#define IDLE_RELEASE_MS 1000
+
+struct watcher {
+	CFWRunLoop *loop;
+	CFWStream *stream;
+	int fd, events;
+	cfw_runloop_callback_t cb;
+	void *ctx;
+	char *out;
+	size_t out_pos, out_len, out_cap;
+	bool readable, writable, error, eof, unread;
+	bool queued, paused, removed, idle;
+	uint64_t idle_since;
+	struct watcher *next, *next_paused, *prev_idle, *next_idle;
+};
+
+struct CFWRunLoop {
+	CFWObject obj;
+	int fd;
+	struct watcher **watchers;
+	size_t watchers_size, cnt;
+	struct watcher *ready, *paused, *garbage, *idle_head, *idle_tail;
+	size_t read_max, write_max;
+	uint64_t now;
+	bool stop;
+};
+
+static bool
+ctor(void *ptr, va_list args)
+{
+	CFWRunLoop *loop = ptr;
+
+	loop->fd = -1;
+	loop->watchers = NULL;
+	loop->watchers_size = 0;
+	loop->cnt = 0;
+	loop->ready = NULL;
+	loop->paused = NULL;
+	loop->garbage = NULL;
+	loop->idle_head = NULL;
+	loop->idle_tail = NULL;
+	loop->now = 0;
+	loop->read_max = DEFAULT_READ_MAX;
+	loop->write_max = DEFAULT_WRITE_MAX;
+	loop->stop = false;
+
+#ifdef __linux__
+	if ((loop->fd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+		return false;
+
+	return true;
+#else
+	return false;
+#endif
+}
+
+/* The stream writes for itself again once it is no longer watched */
+static void
+detach(struct watcher *w)
+{
+	if (w->stream->queue_ctx == w) {
+		w->stream->queue_write = NULL;
+		w->stream->queue_ctx = NULL;
+	}
+}
+
+static void
+free_watcher(struct watcher *w)
+{
+	cfw_unref(w->stream);
+	free(w->out);
+	free(w);
+}
+
+static void
+dtor(void *ptr)
+{
+	CFWRunLoop *loop = ptr;
+	struct watcher *w, *next;
+	size_t i;
+
+	/* Removed watchers linger on the lists until they are freed */
+	for (w = loop->ready; w != NULL; w = next) {
+		next = w->next;
+		w->queued = false;
+
+		if (w->removed && !w->paused)
+			free_watcher(w);
+	}
+
+	for (w = loop->paused; w != NULL; w = next) {
+		next = w->next_paused;
+
+		if (w->removed)
+			free_watcher(w);
+	}
+
+	for (w = loop->garbage; w != NULL; w = next) {
+		next = w->next;
+		free_watcher(w);
+	}
+
+	for (i = 0; i < loop->watchers_size; i++) {
+		if (loop->watchers[i] != NULL) {
+			detach(loop->watchers[i]);
+			free_watcher(loop->watchers[i]);
+		}
+	}
+
+	free(loop->watchers);
+
+	if (loop->fd != -1)
+		close(loop->fd);
+}
+
+static void
+enqueue(CFWRunLoop *loop, struct watcher *w)
+{
+	if (w->queued)
+		return;
+
+	w->queued = true;
+	w->next = loop->ready;
+	loop->ready = w;
+}
+
+static void
+idle_unlink(CFWRunLoop *loop, struct watcher *w)
+{
+	if (!w->idle)
+		return;
+
+	if (w->prev_idle != NULL)
+		w->prev_idle->next_idle = w->next_idle;
+	else
+		loop->idle_head = w->next_idle;
+
+	if (w->next_idle != NULL)
+		w->next_idle->prev_idle = w->prev_idle;
+	else
+		loop->idle_tail = w->prev_idle;
+
+	w->idle = false;
+}
+
+static bool queue_write(void*, const void*, size_t);
+
+static struct watcher*
+lookup(CFWRunLoop *loop, CFWStream *stream)
+{
+	int fd = cfw_stream_fd(stream);
+	struct watcher *w;
+
+	/* A closed stream can only be found through its write hook */
+	if (fd < 0 && stream->queue_write == queue_write) {
+		w = stream->queue_ctx;
+
+		return (w->loop == loop ? w : NULL);
+	}
+
+	if (fd < 0 || (size_t)fd >= loop->watchers_size ||
+	    loop->watchers[fd] == NULL || loop->watchers[fd]->stream != stream)
+		return NULL;
+
+	return loop->watchers[fd];
+}
+
+static bool take_stream_writes(struct watcher*);
+
+bool
+cfw_runloop_add(CFWRunLoop *loop, void *ptr, int events,
+    cfw_runloop_callback_t cb, void *ctx)
+{
+#ifdef __linux__
+	CFWStream *stream = ptr;
+	struct epoll_event ev;
+	struct watcher *w;
+	int fd, flags;
+
+	if ((fd = cfw_stream_fd(stream)) == -1)
+		return false;
+
+	/* Closing a watched stream left its watcher behind */
+	if ((size_t)fd < loop->watchers_size && loop->watchers[fd] != NULL &&
+	    cfw_stream_fd(loop->watchers[fd]->stream) != fd)
+		cfw_runloop_remove(loop, loop->watchers[fd]->stream);
+
+	if ((size_t)fd < loop->watchers_size && loop->watchers[fd] != NULL)
+		return false;
+
+	if ((size_t)fd >= loop->watchers_size) {
+		size_t size = (loop->watchers_size < 64 ? 64 :
+		    loop->watchers_size);
+		struct watcher **new;
+
+		while (size <= (size_t)fd)
+			size *= 2;
+
+		if ((new = realloc(loop->watchers, size * sizeof(*new))) ==
+		    NULL)
+			return false;
+
+		memset(new + loop->watchers_size, 0,
+		    (size - loop->watchers_size) * sizeof(*new));
+		loop->watchers = new;
+		loop->watchers_size = size;
+	}
+
+	if ((flags = fcntl(fd, F_GETFL)) == -1 ||
+	    fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+		return false;
+
+	if ((w = malloc(sizeof(*w))) == NULL)
+		return false;
+
+	w->loop = loop;
+	w->stream = stream;
+	w->fd = fd;
+	w->events = events;
+	w->cb = cb;
+	w->ctx = ctx;
+	w->out = NULL;
+	w->out_pos = 0;
+	w->out_len = 0;
+	w->out_cap = 0;
+	w->readable = false;
+	w->writable = false;
+	w->error = false;
+	w->eof = false;
+	w->queued = false;
+	w->paused = false;
+	w->removed = false;
+	w->idle = false;
+
+	/*
+	 * Registered once for everything, so that changing the interest never
+	 * needs a syscall.
+	 */
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = w;
+
+	if (epoll_ctl(loop->fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+		free(w);
+		return false;
+	}
+
+	/* Later writes are queued, so what came before has to go first */
+	if (!take_stream_writes(w)) {
+		epoll_ctl(loop->fd, EPOLL_CTL_DEL, fd, NULL);
+		free(w->out);
+		free(w);
+		return false;
+	}
+
+	cfw_ref(stream);
+	stream->queue_write = queue_write;
+	stream->queue_ctx = w;
+	loop->watchers[fd] = w;
+	loop->cnt++;
+
+	/* epoll can't know about what the stream already buffered */
+	if ((w->unread = (stream->read_len > 0)))
+		enqueue(loop, w);
+
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool
+cfw_runloop_modify(CFWRunLoop *loop, void *stream, int events)
+{
+	struct watcher *w;
+
+	if ((w = lookup(loop, stream)) == NULL)
+		return false;
+
+	w->events = events;
+
+	if ((w->readable && events & CFW_RUNLOOP_READ) ||
+	    (w->writable && events & CFW_RUNLOOP_WRITE))
+		enqueue(loop, w);
+
+	return true;
+}
+
+bool
+cfw_runloop_remove(CFWRunLoop *loop, void *stream)
+{
+	struct watcher *w;
+
+	if ((w = lookup(loop, stream)) == NULL)
+		return false;
+
+#ifdef __linux__
+	/* Fails if the stream was closed already, which removed it anyway */
+	epoll_ctl(loop->fd, EPOLL_CTL_DEL, w->fd, NULL);
+#endif
+
+	loop->watchers[w->fd] = NULL;
+	loop->cnt--;
+	detach(w);
+	idle_unlink(loop, w);
+
+	/* Events for it may still be pending in this iteration */
+	w->removed = true;
+	if (!w->queued && !w->paused) {
+		w->next = loop->garbage;
+		loop->garbage = w;
+	}
+
+	return true;
+}
+
+static ssize_t
+send_some(struct watcher *w, const void *buf, size_t len)
+{
+	struct iovec iov;
+
+	if (w->stream->ops->writev == NULL)
+		return write(w->fd, buf, len);
+
+	iov.iov_base = (void*)buf;
+	iov.iov_len = len;
+
+	return w->stream->ops->writev(w->stream, &iov, 1);
+}
+
+static bool
+append_out(struct watcher *w, const void *buf, size_t len)
+{
+	if (w->out_pos + w->out_len + len > w->out_cap) {
+		if (w->out_pos > 0) {
+			memmove(w->out, w->out + w->out_pos, w->out_len);
+			w->out_pos = 0;
+		}
+
+		if (w->out_len + len > w->out_cap) {
+			size_t cap = (w->out_cap < CFW_STREAM_BUFSIZE ?
+			    CFW_STREAM_BUFSIZE : w->out_cap);
+			char *new;
+
+			while (cap < w->out_len + len)
+				cap *= 2;
+
+			if ((new = realloc(w->out, cap)) == NULL)
+				return false;
+
+			w->out = new;
+			w->out_cap = cap;
+		}
+	}
+
+	memcpy(w->out + w->out_pos + w->out_len, buf, len);
+	w->out_len += len;
+
+	return true;
+}
+
+static bool
+flush_out(struct watcher *w)
+{
+	while (w->out_len > 0) {
+		ssize_t ret = send_some(w, w->out + w->out_pos, w->out_len);
+
+		if (ret > 0) {
+			w->out_pos += ret;
+			w->out_len -= ret;
+			continue;
+		}
+
+		if (ret == -1 && errno == EINTR)
+			continue;
+
+		if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			w->writable = false;
+		else
+			w->error = true;
+
+		return false;
+	}
+
+	/* Kept for the next write, release_idle() frees it once idle */
+	w->out_pos = 0;
+
+	return true;
+}
+
+/*
+ * Whatever was written to the stream itself goes out through the queue, as
+ * flushing it directly would fail on a non-blocking descriptor.
+ */
+static bool
+take_stream_writes(struct watcher *w)
+{
+	CFWStream *stream = w->stream;
+
+	if (stream->write_len == 0)
+		return true;
+
+	if (!append_out(w, stream->write_buf, stream->write_len))
+		return false;
+
+	stream->write_len = 0;
+
+	return true;
+}
+
+/*
+ * Writes to a watched stream never block and are never partial. They are
+ * queued and sent like cfw_runloop_write does, but without backpressure.
+ */
+static bool
+queue_write(void *ctx, const void *buf, size_t len)
+{
+	struct watcher *w = ctx;
+
+	if (!append_out(w, buf, len))
+		return false;
+
+	if (w->writable)
+		enqueue(w->loop, w);
+
+	return true;
+}
+
+bool
+cfw_runloop_write(CFWRunLoop *loop, void *stream, const void *buf,
+    size_t len)
+{
+	struct watcher *w;
+	const char *pos = buf;
+
+	if ((w = lookup(loop, stream)) == NULL)
+		return false;
+
+	/* Backpressure: the caller has to wait for CFW_RUNLOOP_WRITE */
+	if (w->out_len > 0 && w->out_len + len > loop->write_max)
+		return false;
+
+	while (w->out_len == 0 && w->writable && len > 0) {
+		ssize_t ret = send_some(w, pos, len);
+
+		if (ret > 0) {
+			pos += ret;
+			len -= ret;
+			continue;
+		}
+
+		if (ret == -1 && errno == EINTR)
+			continue;
+
+		if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			w->writable = false;
+		else {
+			w->error = true;
+			enqueue(loop, w);
+
+			return false;
+		}
+	}
+
+	if (len > 0 && !append_out(w, pos, len))
+		return false;
+
+	if (w->out_len > 0 && w->writable)
+		enqueue(loop, w);
+
+	return true;
+}
+
+size_t
+cfw_runloop_pending(CFWRunLoop *loop, void *stream)
+{
+	struct watcher *w;
+
+	if ((w = lookup(loop, stream)) == NULL)
+		return 0;
+
+	return w->out_len;
+}
+
+void
+cfw_runloop_set_limits(CFWRunLoop *loop, size_t read_max, size_t write_max)
+{
+	loop->read_max = (read_max > 0 ? read_max : DEFAULT_READ_MAX);
+	loop->write_max = (write_max > 0 ? write_max : DEFAULT_WRITE_MAX);
+}
+
+size_t
+cfw_runloop_count(CFWRunLoop *loop)
+{
+	return loop->cnt;
+}
+
+/*
+ * With edge-triggered events, a descriptor has to be read until EAGAIN.
+ * Stopping at the limit instead leaves it readable for a later round.
+ */
+static size_t
+drain_in(CFWRunLoop *loop, struct watcher *w)
+{
+	size_t got = 0;
+	ssize_t ret;
+
+	while (w->stream->read_len < loop->read_max) {
+		if ((ret = cfw_stream_fill(w->stream)) > 0) {
+			got += ret;
+			continue;
+		}
+
+		if (ret == -1 && errno == EINTR)
+			continue;
+
+		w->readable = false;
+
+		if (ret == 0)
+			w->eof = true;
+		else if (errno != EAGAIN && errno != EWOULDBLOCK)
+			w->error = true;
+
+		break;
+	}
+
+	return got;
+}
+
+/* Appending with the current time keeps the list sorted by age */
+static void
+idle_append(CFWRunLoop *loop, struct watcher *w)
+{
+	idle_unlink(loop, w);
+
+	w->idle = true;
+	w->idle_since = loop->now;
+	w->prev_idle = loop->idle_tail;
+	w->next_idle = NULL;
+
+	if (loop->idle_tail != NULL)
+		loop->idle_tail->next_idle = w;
+	else
+		loop->idle_head = w;
+	loop->idle_tail = w;
+}
+
+/*
+ * Read and write buffers are kept while a stream is busy and only released
+ * once it has been idle for a while, so that idle connections cost no buffer.
+ */
+static void
+release_idle(CFWRunLoop *loop)
+{
+	struct watcher *w;
+
+	while ((w = loop->idle_head) != NULL &&
+	    loop->now - w->idle_since >= IDLE_RELEASE_MS) {
+		CFWStream *stream = w->stream;
+
+		idle_unlink(loop, w);
+
+		if (stream->read_len == 0) {
+			free(stream->read_buf);
+			stream->read_buf = NULL;
+			stream->read_pos = 0;
+		}
+
+		if (w->out_len == 0) {
+			free(w->out);
+			w->out = NULL;
+			w->out_pos = 0;
+			w->out_cap = 0;
+		}
+	}
+}
+
+static uint64_t
+now_ms(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		return 0;
+
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void
+pause_watcher(CFWRunLoop *loop, struct watcher *w)
+{
+	if (w->paused)
+		return;
+
+	w->paused = true;
+	w->next_paused = loop->paused;
+	loop->paused = w;
+}
+
+static void
+resume_paused(CFWRunLoop *loop)
+{
+	struct watcher *w, **pp = &loop->paused;
+
+	while ((w = *pp) != NULL) {
+		if (!w->removed && w->stream->read_len >= loop->read_max &&
+		    w->events & CFW_RUNLOOP_READ) {
+			pp = &w->next_paused;
+			continue;
+		}
+
+		*pp = w->next_paused;
+		w->paused = false;
+
+		if (!w->removed)
+			enqueue(loop, w);
+		else if (!w->queued)
+			free_watcher(w);
+	}
+}
+
+static void
+dispatch(CFWRunLoop *loop, struct watcher *w)
+{
+	CFWStream *stream = w->stream;
+	bool was_eof = w->eof;
+	size_t got = 0, buffered;
+	int events = 0;
+
+	idle_unlink(loop, w);
+
+	if (w->out_len > 0 && w->writable)
+		flush_out(w);
+
+	if (w->readable && w->events & CFW_RUNLOOP_READ)
+		got = drain_in(loop, w);
+
+	if (w->events & CFW_RUNLOOP_READ &&
+	    (got > 0 || w->eof != was_eof || w->unread)) {
+		events |= CFW_RUNLOOP_READ;
+		w->unread = false;
+	}
+
+	if (w->events & CFW_RUNLOOP_WRITE && w->writable && w->out_len == 0)
+		events |= CFW_RUNLOOP_WRITE;
+
+	if (w->error) {
+		events |= CFW_RUNLOOP_ERROR;
+		w->error = false;
+	}
+
+	buffered = stream->read_len;
+
+	if (events != 0)
+		w->cb(loop, stream, events, w->ctx);
+
+	if (w->removed)
+		return;
+
+	/* Leftovers are offered again, but only while they are consumed */
+	if (stream->read_len > 0 && stream->read_len < buffered) {
+		w->unread = true;
+		enqueue(loop, w);
+	}
+
+	if (w->out_len > 0 && w->writable)
+		flush_out(w);
+
+	if ((stream->read_len == 0 && stream->read_buf != NULL) ||
+	    (w->out_len == 0 && w->out != NULL))
+		idle_append(loop, w);
+
+	if (w->readable && w->events & CFW_RUNLOOP_READ) {
+		if (stream->read_len < loop->read_max)
+			enqueue(loop, w);
+		else
+			pause_watcher(loop, w);
+	}
+
+	if ((w->writable && w->events & CFW_RUNLOOP_WRITE &&
+	    w->out_len == 0) || w->error)
+		enqueue(loop, w);
+}
+
+int
+cfw_runloop_run_once(CFWRunLoop *loop, int timeout)
+{
+#ifdef __linux__
+	struct epoll_event events[EVENT_BATCH];
+	struct watcher *w, *list, *next;
+	int i, n, cnt = 0;
+
+	resume_paused(loop);
+
+	if (loop->ready != NULL)
+		timeout = 0;
+	else if (loop->idle_head != NULL) {
+		/* Wake up in time to release the oldest idle buffer */
+		uint64_t left = loop->idle_head->idle_since + IDLE_RELEASE_MS;
+
+		loop->now = now_ms();
+		left = (left > loop->now ? left - loop->now : 0);
+
+		if (timeout < 0 || left < (uint64_t)timeout)
+			timeout = (int)left;
+	}
+
+	do {
+		n = epoll_wait(loop->fd, events, EVENT_BATCH, timeout);
+	} while (n == -1 && errno == EINTR);
+
+	if (n == -1)
+		return -1;
+
+	loop->now = now_ms();
+
+	for (i = 0; i < n; i++) {
+		uint32_t ev = events[i].events;
+
+		w = events[i].data.ptr;
+
+		if (ev & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+			w->readable = true;
+		if (ev & EPOLLOUT)
+			w->writable = true;
+		if (ev & EPOLLERR)
+			w->error = true;
+
+		enqueue(loop, w);
+	}
+
+	/* What is queued while dispatching waits for the next round */
+	list = loop->ready;
+	loop->ready = NULL;
+
+	for (w = list; w != NULL; w = next) {
+		next = w->next;
+		w->queued = false;
+
+		if (w->removed) {
+			if (!w->paused)
+				free_watcher(w);
+
+			continue;
+		}
+
+		dispatch(loop, w);
+		cnt++;
+	}
+
+	for (w = loop->garbage; w != NULL; w = next) {
+		next = w->next;
+		free_watcher(w);
+	}
+	loop->garbage = NULL;
+
+	release_idle(loop);
+
+	return cnt;
+#else
+	return -1;
+#endif
+}
+
+bool
+cfw_runloop_run(CFWRunLoop *loop)
+{
+	loop->stop = false;
+
+	while (!loop->stop && loop->cnt > 0)
+		if (cfw_runloop_run_once(loop, -1) == -1)
+			return false;
+
+	return true;
+}
+
+void
+cfw_runloop_stop(CFWRunLoop *loop)
+{
+	loop->stop = true;
+}
+
+static CFWClass class = {
+	.name = "CFWRunLoop",
+	.size = sizeof(CFWRunLoop),
+	.ctor = ctor,
+	.dtor = dtor
+};
+CFWClass *cfw_runloop = &class;
@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2012, Jonathan Schleifer <js@webkeks.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __COREFW_RUNLOOP_H__
+#define __COREFW_RUNLOOP_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "class.h"
+
+enum {
+	CFW_RUNLOOP_READ = 1,
+	CFW_RUNLOOP_WRITE = 2,
+	CFW_RUNLOOP_ERROR = 4
+};
+
+typedef struct CFWRunLoop CFWRunLoop;
+typedef void (*cfw_runloop_callback_t)(CFWRunLoop*, void*, int, void*);
+
+extern CFWClass *cfw_runloop;
+extern bool cfw_runloop_add(CFWRunLoop*, void*, int, cfw_runloop_callback_t,
+    void*);
+extern bool cfw_runloop_modify(CFWRunLoop*, void*, int);
+extern bool cfw_runloop_remove(CFWRunLoop*, void*);
+extern bool cfw_runloop_write(CFWRunLoop*, void*, const void*, size_t);
+extern size_t cfw_runloop_pending(CFWRunLoop*, void*);
+extern void cfw_runloop_set_limits(CFWRunLoop*, size_t, size_t);
+extern size_t cfw_runloop_count(CFWRunLoop*);
+extern int cfw_runloop_run_once(CFWRunLoop*, int);
+extern bool cfw_runloop_run(CFWRunLoop*);
+extern void cfw_runloop_stop(CFWRunLoop*);
+
+#endif
@@ -0,0 +1,297 @@
+/*
+ * Copyright (c) 2012, Jonathan Schleifer <js@webkeks.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__) && defined(__GNUC__)
+# include <immintrin.h>
+# define HAVE_X86
+#endif
+
+#include "search.h"
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+/*
+ * Needles up to this length are found by filtering on their first and last
+ * byte with SIMD, longer ones use Two-Way to stay linear.
+ */
+#define SHORT_NEEDLE 32
+
+static size_t
+find_scalar(const char *hay, size_t hay_len, const char *needle,
+    size_t needle_len)
+{
+	const char *pos = hay, *end = hay + hay_len - needle_len + 1;
+
+	while (pos < end) {
+		if ((pos = memchr(pos, needle[0], end - pos)) == NULL)
+			return SIZE_MAX;
+
+		if (!memcmp(pos + 1, needle + 1, needle_len - 1))
+			return pos - hay;
+
+		pos++;
+	}
+
+	return SIZE_MAX;
+}
+
+#ifdef HAVE_X86
+static size_t
+find_sse2(const char *hay, size_t hay_len, const char *needle,
+    size_t needle_len)
+{
+	const __m128i first = _mm_set1_epi8(needle[0]);
+	const __m128i last = _mm_set1_epi8(needle[needle_len - 1]);
+	size_t i, ret;
+
+	for (i = 0; i + needle_len + 15 <= hay_len; i += 16) {
+		__m128i a, b;
+		unsigned mask;
+
+		a = _mm_loadu_si128((const __m128i*)(hay + i));
+		b = _mm_loadu_si128((const __m128i*)(hay + i + needle_len - 1));
+		mask = _mm_movemask_epi8(_mm_and_si128(
+		    _mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+
+		while (mask != 0) {
+			unsigned bit = __builtin_ctz(mask);
+
+			if (!memcmp(hay + i + bit + 1, needle + 1,
+			    needle_len - 2))
+				return i + bit;
+
+			mask &= mask - 1;
+		}
+	}
+
+	if ((ret = find_scalar(hay + i, hay_len - i, needle, needle_len)) ==
+	    SIZE_MAX)
+		return SIZE_MAX;
+
+	return i + ret;
+}
+
+__attribute__((__target__("avx2")))
+static size_t
+find_avx2(const char *hay, size_t hay_len, const char *needle,
+    size_t needle_len)
+{
+	const __m256i first = _mm256_set1_epi8(needle[0]);
+	const __m256i last = _mm256_set1_epi8(needle[needle_len - 1]);
+	size_t i, ret;
+
+	for (i = 0; i + needle_len + 31 <= hay_len; i += 32) {
+		__m256i a, b;
+		uint32_t mask;
+
+		a = _mm256_loadu_si256((const __m256i*)(hay + i));
+		b = _mm256_loadu_si256(
+		    (const __m256i*)(hay + i + needle_len - 1));
+		mask = _mm256_movemask_epi8(_mm256_and_si256(
+		    _mm256_cmpeq_epi8(a, first),
+		    _mm256_cmpeq_epi8(b, last)));
+
+		while (mask != 0) {
+			unsigned bit = __builtin_ctz(mask);
+
+			if (!memcmp(hay + i + bit + 1, needle + 1,
+			    needle_len - 2))
+				return i + bit;
+
+			mask &= mask - 1;
+		}
+	}
+
+	if ((ret = find_scalar(hay + i, hay_len - i, needle, needle_len)) ==
+	    SIZE_MAX)
+		return SIZE_MAX;
+
+	return i + ret;
+}
+
+static size_t find_dispatch(const char*, size_t, const char*, size_t);
+static size_t (*find_short)(const char*, size_t, const char*, size_t) =
+    find_dispatch;
+
+static size_t
+find_dispatch(const char *hay, size_t hay_len, const char *needle,
+    size_t needle_len)
+{
+	size_t (*func)(const char*, size_t, const char*, size_t);
+
+	__builtin_cpu_init();
+	func = (__builtin_cpu_supports("avx2") ? find_avx2 : find_sse2);
+	__atomic_store_n(&find_short, func, __ATOMIC_RELAXED);
+
+	return func(hay, hay_len, needle, needle_len);
+}
+#endif
+
+/* Crochemore-Perrin Two-Way, linear time and constant space */
+static size_t
+find_twoway(const unsigned char *hay, size_t hay_len,
+    const unsigned char *needle, size_t needle_len)
+{
+	const unsigned char *h = hay, *end = hay + hay_len;
+	size_t i, ip, jp, k, p, ms, p0, mem, mem0;
+	size_t shift[256];
+	uint8_t byteset[32] = { 0 };
+
+	for (i = 0; i < needle_len; i++) {
+		byteset[needle[i] >> 3] |= 1 << (needle[i] & 7);
+		shift[needle[i]] = i + 1;
+	}
+
+	/* Maximal suffix */
+	ip = SIZE_MAX;
+	jp = 0;
+	k = p = 1;
+	while (jp + k < needle_len) {
+		if (needle[ip + k] == needle[jp + k]) {
+			if (k == p) {
+				jp += p;
+				k = 1;
+			} else
+				k++;
+		} else if (needle[ip + k] > needle[jp + k]) {
+			jp += k;
+			k = 1;
+			p = jp - ip;
+		} else {
+			ip = jp++;
+			k = p = 1;
+		}
+	}
+	ms = ip;
+	p0 = p;
+
+	/* Maximal suffix for the opposite order */
+	ip = SIZE_MAX;
+	jp = 0;
+	k = p = 1;
+	while (jp + k < needle_len) {
+		if (needle[ip + k] == needle[jp + k]) {
+			if (k == p) {
+				jp += p;
+				k = 1;
+			} else
+				k++;
+		} else if (needle[ip + k] < needle[jp + k]) {
+			jp += k;
+			k = 1;
+			p = jp - ip;
+		} else {
+			ip = jp++;
+			k = p = 1;
+		}
+	}
+	if (ip + 1 > ms + 1)
+		ms = ip;
+	else
+		p = p0;
+
+	/* Periodic needle? */
+	if (memcmp(needle, needle + p, ms + 1)) {
+		mem0 = 0;
+		p = MAX(ms, needle_len - ms - 1) + 1;
+	} else
+		mem0 = needle_len - p;
+	mem = 0;
+
+	for (;;) {
+		unsigned char c;
+
+		if ((size_t)(end - h) < needle_len)
+			return SIZE_MAX;
+
+		/* Check the last byte first and skip ahead on a mismatch */
+		c = h[needle_len - 1];
+		if (byteset[c >> 3] & (1 << (c & 7))) {
+			if ((k = needle_len - shift[c]) != 0) {
+				if (k < mem)
+					k = mem;
+
+				h += k;
+				mem = 0;
+				continue;
+			}
+		} else {
+			h += needle_len;
+			mem = 0;
+			continue;
+		}
+
+		/* Right half */
+		for (k = MAX(ms + 1, mem); k < needle_len && needle[k] == h[k];
+		    k++);
+		if (k < needle_len) {
+			h += k - ms;
+			mem = 0;
+			continue;
+		}
+
+		/* Left half */
+		for (k = ms + 1; k > mem && needle[k - 1] == h[k - 1]; k--);
+		if (k <= mem)
+			return h - hay;
+
+		h += p;
+		mem = mem0;
+	}
+}
+
+size_t
+cfw_memmem(const void *hay, size_t hay_len, const void *needle,
+    size_t needle_len)
+{
+	const char *pos;
+
+	if (needle_len == 0)
+		return 0;
+
+	if (needle_len > hay_len)
+		return SIZE_MAX;
+
+	if (needle_len == 1) {
+		if ((pos = memchr(hay, *(const char*)needle, hay_len)) == NULL)
+			return SIZE_MAX;
+
+		return pos - (const char*)hay;
+	}
+
+	if (needle_len > SHORT_NEEDLE)
+		return find_twoway(hay, hay_len, needle, needle_len);
+
+#ifdef HAVE_X86
+	return __atomic_load_n(&find_short, __ATOMIC_RELAXED)(hay, hay_len,
+	    needle, needle_len);
+#else
+	return find_scalar(hay, hay_len, needle, needle_len);
+#endif
+}
@@ -24,12 +24,37 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 
-#include "stream.h"
+#ifdef __linux__
+# include <fcntl.h>
+# include <signal.h>
+# include <time.h>
+# include <sys/sendfile.h>
+# include <sys/stat.h>
+#endif
 
-#define BUFFER_SIZE 4096
+#include "stream.h"
+#include "format.h"
+#include "search.h"
+
+#define LINE_SIZE 256
+#define IOV_BATCH 64
+#define COPY_SIZE 0x40000000
+#define SPLICE_SIZE 65536
+
+#ifdef __linux__
+enum {
+	COPY_FILE_RANGE,
+	COPY_SENDFILE,
+	COPY_SPLICE,
+	COPY_PIPE
+};
+#endif
 
 static bool
 ctor(void *ptr, va_list args)
@@ -37,8 +62,17 @@ ctor(void *ptr, va_list args)
 	CFWStream *stream = ptr;
 
 	stream->ops = NULL;
-	stream->cache = NULL;
-	stream->cache_len = 0;
+	stream->read_buf = NULL;
+	stream->read_size = 0;
+	stream->read_limit = 0;
+	stream->read_pos = 0;
+	stream->read_len = 0;
+	stream->write_buf = NULL;
+	stream->write_size = CFW_STREAM_BUFSIZE;
+	stream->write_len = 0;
+	stream->line_buffered = false;
+	stream->queue_write = NULL;
+	stream->queue_ctx = NULL;
 
 	return true;
 }
@@ -46,7 +80,147 @@ ctor(void *ptr, va_list args)
 static void
 dtor(void *ptr)
 {
-	cfw_stream_close(ptr);
+	CFWStream *stream = ptr;
+
+	cfw_stream_close(stream);
+	free(stream->read_buf);
+	free(stream->write_buf);
+}
+
+/*
+ * Only hands the write buffer to the stream, unlike cfw_stream_flush, which
+ * also flushes filters.
+ */
+static bool
+write_pending(CFWStream *stream)
+{
+	bool ret;
+
+	if (stream->write_len == 0)
+		return true;
+
+	/* What failed to be written is dropped, like stdio does */
+	ret = stream->ops->write(stream, stream->write_buf, stream->write_len);
+	stream->write_len = 0;
+
+	return ret;
+}
+
+bool
+cfw_stream_set_read_buffer_size(void *ptr, size_t size)
+{
+	CFWStream *stream = ptr;
+	char *buf;
+
+	if (stream == NULL || size == 0 || size < stream->read_len)
+		return false;
+
+	if ((buf = malloc(size)) == NULL)
+		return false;
+
+	if (stream->read_len > 0)
+		memcpy(buf, stream->read_buf + stream->read_pos,
+		    stream->read_len);
+
+	free(stream->read_buf);
+	stream->read_buf = buf;
+	stream->read_size = size;
+	stream->read_pos = 0;
+
+	return true;
+}
+
+size_t
+cfw_stream_read_buffer_size(void *ptr)
+{
+	CFWStream *stream = ptr;
+
+	return (stream->read_size > 0 ? stream->read_size : CFW_STREAM_BUFSIZE);
+}
+
+void
+cfw_stream_set_read_buffer_limit(void *ptr, size_t limit)
+{
+	CFWStream *stream = ptr;
+
+	stream->read_limit = limit;
+}
+
+size_t
+cfw_stream_read_buffer_limit(void *ptr)
+{
+	CFWStream *stream = ptr;
+
+	return (stream->read_limit > 0 ? stream->read_limit :
+	    CFW_STREAM_BUFLIMIT);
+}
+
+/*
+ * Reads more data behind what is buffered. The data is slid to the front
+ * first, and the buffer only grows when it is already full. It never grows
+ * past the limit, so that a peer can't make a line use unbounded memory.
+ */
+static ssize_t
+fill(CFWStream *stream)
+{
+	size_t limit = cfw_stream_read_buffer_limit(stream), size;
+	ssize_t ret;
+
+	if (!write_pending(stream))
+		return -1;
+
+	if (stream->read_buf == NULL &&
+	    !cfw_stream_set_read_buffer_size(stream,
+	    cfw_stream_read_buffer_size(stream)))
+		return -1;
+
+	if (stream->read_pos > 0) {
+		memmove(stream->read_buf, stream->read_buf + stream->read_pos,
+		    stream->read_len);
+		stream->read_pos = 0;
+	}
+
+	if (stream->read_len == stream->read_size) {
+		if (stream->read_size >= limit) {
+			errno = EMSGSIZE;
+			return -1;
+		}
+
+		size = (stream->read_size <= limit / 2 ?
+		    stream->read_size * 2 : limit);
+
+		if (!cfw_stream_set_read_buffer_size(stream, size))
+			return -1;
+	}
+
+	if ((ret = stream->ops->read(stream, stream->read_buf +
+	    stream->read_len, stream->read_size - stream->read_len)) < 0)
+		return -1;
+
+	stream->read_len += ret;
+
+	return ret;
+}
+
+ssize_t
+cfw_stream_fill(void *ptr)
+{
+	CFWStream *stream = ptr;
+
+	if (stream == NULL || stream->ops == NULL)
+		return -1;
+
+	return fill(stream);
+}
+
+static void
+consume(CFWStream *stream, size_t len)
+{
+	stream->read_pos += len;
+	stream->read_len -= len;
+
+	if (stream->read_len == 0)
+		stream->read_pos = 0;
 }
 
 ssize_t
@@ -58,203 +232,655 @@ cfw_stream_read(void *ptr, void *buf, size_t len)
 	if (stream == NULL || stream->ops == NULL)
 		return -1;
 
-	if (stream->cache == NULL) {
+	/* Nothing buffered, so there is no need to copy twice */
+	if (stream->read_len == 0) {
+		if (!write_pending(stream))
+			return -1;
+
 		if ((ret = stream->ops->read(stream, buf, len)) < -1)
 			ret = -1;
 
 		return ret;
 	}
 
-	if (len >= stream->cache_len) {
-		ret = stream->cache_len;
+	if (len > stream->read_len)
+		len = stream->read_len;
 
-		memcpy(buf, stream->cache, stream->cache_len);
+	memcpy(buf, stream->read_buf + stream->read_pos, len);
+	consume(stream, len);
 
-		free(stream->cache);
-		stream->cache = NULL;
-		stream->cache_len = 0;
+	return len;
+}
 
-		return ret;
-	} else {
-		char *tmp;
+static CFWString*
+make_line(CFWStream *stream, size_t len, size_t skip)
+{
+	const char *data = stream->read_buf + stream->read_pos;
+	CFWString *line;
 
-		if ((tmp = malloc(stream->cache_len - len)) == NULL)
-			return -1;
-		memcpy(tmp, stream->cache + len, stream->cache_len - len);
-		memcpy(buf, stream->cache, len);
+	if ((line = cfw_create(cfw_string, (void*)NULL)) == NULL)
+		return NULL;
 
-		free(stream->cache);
-		stream->cache = tmp;
-		stream->cache_len -= len;
+	if (!cfw_string_append_buf(line, data,
+	    (len > 0 && data[len - 1] == '\r' ? len - 1 : len)))
+		return NULL;
 
-		return len;
-	}
+	consume(stream, len + skip);
+
+	return line;
 }
 
 CFWString*
 cfw_stream_read_line(void *ptr)
 {
 	CFWStream *stream = ptr;
-	CFWString *ret;
-	char *buf, *ret_str, *new_cache;
-	ssize_t buf_len;
-	size_t i, ret_len;
-
-	/* Look if there is a line or \0 in our cache */
-	if (stream->cache != NULL) {
-		for (i = 0; i < stream->cache_len; i++) {
-			if (stream->cache[i] == '\n' ||
-			    stream->cache[i] == '\0') {
-				ret_len = i;
-				if (i > 0 && stream->cache[i - 1] == '\r')
-					ret_len--;
-
-				ret_str = cfw_strndup(stream->cache, ret_len);
-				if (ret_str == NULL)
-					return NULL;
-
-				ret = cfw_create(cfw_string, (void*)NULL);
-				if (ret == NULL) {
-					free(ret_str);
-					return NULL;
-				}
-				cfw_string_set_nocopy(ret, ret_str, ret_len);
-
-				if (stream->cache_len > i + 1) {
-					if ((new_cache = malloc(
-					    stream->cache_len - i - 1)) == NULL)
-						return NULL;
-					memcpy(new_cache, stream->cache + i + 1,
-					    stream->cache_len - i - 1);
-				} else
-					new_cache = cfw_strdup("");
-
-				free(stream->cache);
-				stream->cache = new_cache;
-				stream->cache_len -= i + 1;
-
-				return ret;
-			}
+	size_t i = 0;
+
+	if (stream == NULL || stream->ops == NULL)
+		return NULL;
+
+	for (;;) {
+		/* Only the newly read part needs to be scanned */
+		if (i < stream->read_len) {
+			const char *data = stream->read_buf + stream->read_pos;
+			const char *nl, *nul;
+			size_t end;
+
+			nl = memchr(data + i, '\n', stream->read_len - i);
+			end = (nl != NULL ? (size_t)(nl - data) : stream->read_len);
+
+			if ((nul = memchr(data + i, '\0', end - i)) != NULL)
+				return make_line(stream, nul - data, 1);
+			if (nl != NULL)
+				return make_line(stream, end, 1);
+
+			i = stream->read_len;
 		}
+
+		if (stream->ops->at_end(stream)) {
+			if (stream->read_len == 0)
+				return NULL;
+
+			return make_line(stream, stream->read_len, 0);
+		}
+
+		if (fill(stream) < 0)
+			return NULL;
 	}
+}
 
-	/* Read and see if we get a newline or \0 */
+/*
+ * Reads until the delimiter is buffered. The line is then at the start of the
+ * buffered data, followed by skip bytes of delimiter.
+ */
+static bool
+find_line(CFWStream *stream, const char *delim, size_t delim_len,
+    size_t *len, size_t *skip)
+{
+	size_t i = 0, off;
 
-	if ((buf = malloc(BUFFER_SIZE)) == NULL)
-		return NULL;
+	if (stream == NULL || stream->ops == NULL)
+		return false;
 
 	for (;;) {
+		if (stream->read_len >= i + delim_len) {
+			const char *data = stream->read_buf + stream->read_pos;
+
+			if (delim_len == 1) {
+				const char *pos = memchr(data + i, *delim,
+				    stream->read_len - i);
+
+				off = (pos != NULL ? (size_t)(pos - data) :
+				    SIZE_MAX);
+			} else if ((off = cfw_memmem(data + i,
+			    stream->read_len - i, delim, delim_len)) != SIZE_MAX)
+				off += i;
+
+			if (off != SIZE_MAX) {
+				*len = off;
+				*skip = delim_len;
+
+				return true;
+			}
+
+			/* A delimiter may straddle what is read next */
+			i = stream->read_len - (delim_len - 1);
+		}
+
 		if (stream->ops->at_end(stream)) {
-			free(buf);
+			if (stream->read_len == 0)
+				return false;
 
-			if (stream->cache == NULL)
-				return NULL;
+			*len = stream->read_len;
+			*skip = 0;
 
-			ret_len = stream->cache_len;
+			return true;
+		}
 
-			if (ret_len > 0 && stream->cache[ret_len - 1] == '\r')
-				ret_len--;
+		if (fill(stream) < 0)
+			return false;
+	}
+}
 
-			ret_str = cfw_strndup(stream->cache, ret_len);
-			if (ret_str == NULL)
-				return NULL;
+void
+cfw_stream_line_iter(void *ptr, cfw_stream_line_iter_t *iter,
+    const char *delim)
+{
+	iter->line = NULL;
+	iter->len = 0;
+	iter->_stream = ptr;
+	iter->_crlf = (delim == NULL || *delim == '\0');
+	iter->_delim = (iter->_crlf ? "\n" : delim);
+	iter->_delim_len = strlen(iter->_delim);
+}
 
-			ret = cfw_create(cfw_string, (void*)NULL);
-			if (ret == NULL) {
-				free(ret_str);
-				return NULL;
-			}
-			cfw_string_set_nocopy(ret, ret_str, ret_len);
+bool
+cfw_stream_line_iter_next(cfw_stream_line_iter_t *iter)
+{
+	CFWStream *stream = iter->_stream;
+	size_t len, skip;
+
+	if (!find_line(stream, iter->_delim, iter->_delim_len, &len, &skip)) {
+		iter->line = NULL;
+		iter->len = 0;
+
+		return false;
+	}
+
+	/* Consuming only moves the position, the bytes stay in place */
+	iter->line = stream->read_buf + stream->read_pos;
+	consume(stream, len + skip);
+
+	if (iter->_crlf && len > 0 && iter->line[len - 1] == '\r')
+		len--;
+	iter->len = len;
+
+	return true;
+}
+
+bool
+cfw_stream_read_line_into(void *ptr, CFWString *str, const char *delim)
+{
+	CFWStream *stream = ptr;
+	const char *data;
+	size_t len, skip;
+	bool crlf = (delim == NULL || *delim == '\0');
+
+	if (crlf)
+		delim = "\n";
+
+	if (!find_line(stream, delim, strlen(delim), &len, &skip))
+		return false;
+
+	data = stream->read_buf + stream->read_pos;
+
+	if (!cfw_string_set_buf(str, data,
+	    (crlf && len > 0 && data[len - 1] == '\r' ? len - 1 : len)))
+		return false;
+
+	consume(stream, len + skip);
+
+	return true;
+}
+
+bool
+cfw_stream_set_write_buffer_size(void *ptr, size_t size)
+{
+	CFWStream *stream = ptr;
+
+	if (stream == NULL || stream->ops == NULL || !write_pending(stream))
+		return false;
+
+	free(stream->write_buf);
+	stream->write_buf = NULL;
+	stream->write_size = size;
+
+	return true;
+}
+
+size_t
+cfw_stream_write_buffer_size(void *ptr)
+{
+	CFWStream *stream = ptr;
+
+	return stream->write_size;
+}
+
+void
+cfw_stream_set_line_buffered(void *ptr, bool line_buffered)
+{
+	CFWStream *stream = ptr;
+
+	stream->line_buffered = line_buffered;
+}
+
+bool
+cfw_stream_flush(void *ptr)
+{
+	CFWStream *stream = ptr;
+
+	if (stream == NULL || stream->ops == NULL || !write_pending(stream))
+		return false;
+
+	/* Lets filters push out what they are holding back, too */
+	if (stream->ops->flush != NULL)
+		return stream->ops->flush(stream);
+
+	return true;
+}
+
+bool
+cfw_stream_write(void *ptr, const void *buf, size_t len)
+{
+	CFWStream *stream = ptr;
+
+	if (stream == NULL || stream->ops == NULL)
+		return false;
 
-			free(stream->cache);
-			stream->cache = NULL;
-			stream->cache_len = 0;
+	/* A partial write would be lost on a non-blocking descriptor */
+	if (stream->queue_write != NULL)
+		return stream->queue_write(stream->queue_ctx, buf, len);
 
-			return ret;
+	if (stream->write_size == 0)
+		return stream->ops->write(stream, buf, len);
+
+	if (len > stream->write_size - stream->write_len) {
+		if (!write_pending(stream))
+			return false;
+
+		/* Too large to be worth copying */
+		if (len >= stream->write_size)
+			return stream->ops->write(stream, buf, len);
+	}
+
+	if (stream->write_buf == NULL &&
+	    (stream->write_buf = malloc(stream->write_size)) == NULL)
+		return false;
+
+	memcpy(stream->write_buf + stream->write_len, buf, len);
+	stream->write_len += len;
+
+	if (stream->line_buffered && memchr(buf, '\n', len) != NULL)
+		return cfw_stream_flush(stream);
+
+	return true;
+}
+
+/*
+ * Hands the pending buffer and the vectors to ops->writev, continuing after
+ * partial writes, so that everything goes out in as few calls as possible.
+ */
+static bool
+write_vec(CFWStream *stream, const struct iovec *iov, int cnt)
+{
+	struct iovec vec[IOV_BATCH];
+	size_t off = 0, pending = 0;
+	ssize_t ret;
+	int i = 0, j, n;
+
+	for (;;) {
+		while (i < cnt && iov[i].iov_len == off) {
+			i++;
+			off = 0;
 		}
 
-		buf_len = stream->ops->read(stream, buf, BUFFER_SIZE);
-		if (buf_len == -1) {
-			free(buf);
-			return NULL;
+		if (stream->write_len == 0 && i == cnt)
+			return true;
+
+		n = 0;
+
+		if (stream->write_len > 0) {
+			vec[n].iov_base = stream->write_buf + pending;
+			vec[n++].iov_len = stream->write_len - pending;
 		}
 
-		/* Look if there's a newline or \0 */
-		for (i = 0; i < buf_len; i++) {
-			if (buf[i] == '\n' || buf[i] == '\0') {
-				ret_len = stream->cache_len + i;
-
-				if ((ret_str = malloc(ret_len + 1)) == NULL) {
-					/*
-					 * FIXME: We lost the current buffer.
-					 *	  Mark the stream as broken?
-					 */
-					free(buf);
-					return NULL;
-				}
-				memcpy(ret_str, stream->cache,
-				    stream->cache_len);
-				memcpy(ret_str + stream->cache_len, buf, i);
-				if (ret_len > 0 && ret_str[ret_len - 1] == '\r')
-					ret_len--;
-				ret_str[ret_len] = '\0';
-
-				ret = cfw_create(cfw_string, (void*)NULL);
-				if (ret == NULL) {
-					free(buf);
-					free(ret_str);
-					return NULL;
-				}
-				cfw_string_set_nocopy(ret, ret_str, ret_len);
-
-				if (buf_len > i + 1) {
-					new_cache = malloc(buf_len - i - 1);
-					if (new_cache == NULL) {
-						free(buf);
-						return NULL;
-					}
-					memcpy(new_cache, buf + i + 1,
-					    buf_len - i - 1);
-				} else
-					new_cache = cfw_strdup("");
-
-				free(stream->cache);
-				stream->cache = new_cache;
-				stream->cache_len = buf_len - i - 1;
-
-				free(buf);
-				return ret;
-			}
+		for (j = i; j < cnt && n < IOV_BATCH; j++) {
+			vec[n].iov_base = (char*)iov[j].iov_base +
+			    (j == i ? off : 0);
+			vec[n++].iov_len = iov[j].iov_len - (j == i ? off : 0);
 		}
 
-		/* There was no newline or \0 */
-		if (stream->cache_len + buf_len > 0) {
-			new_cache = realloc(stream->cache,
-			    stream->cache_len + buf_len);
-			if (new_cache == NULL) {
-				free(buf);
-				return NULL;
+		if ((ret = stream->ops->writev(stream, vec, n)) <= 0) {
+			stream->write_len = 0;
+			return false;
+		}
+
+		if (stream->write_len > 0) {
+			size_t done = stream->write_len - pending;
+
+			if ((size_t)ret < done) {
+				pending += ret;
+				continue;
 			}
-			memcpy(new_cache + stream->cache_len, buf, buf_len);
-		} else {
-			free(stream->cache);
-			new_cache = cfw_strdup("");
+
+			ret -= done;
+			pending = 0;
+			stream->write_len = 0;
 		}
 
-		stream->cache = new_cache;
-		stream->cache_len += buf_len;
+		while (ret > 0) {
+			if ((size_t)ret < iov[i].iov_len - off) {
+				off += ret;
+				break;
+			}
+
+			ret -= iov[i].iov_len - off;
+			i++;
+			off = 0;
+		}
 	}
 }
 
 bool
-cfw_stream_write(void *ptr, const void *buf, size_t len)
+cfw_stream_writev(void *ptr, const struct iovec *iov, int cnt)
 {
 	CFWStream *stream = ptr;
+	size_t total = 0;
+	int i;
 
-	if (stream == NULL || stream->ops == NULL)
+	if (stream == NULL || stream->ops == NULL || cnt < 0)
 		return false;
 
-	return stream->ops->write(stream, buf, len);
+	for (i = 0; i < cnt; i++)
+		total += iov[i].iov_len;
+
+	/* Small writes are cheaper to coalesce in the buffer */
+	if (stream->ops->writev == NULL || stream->queue_write != NULL ||
+	    (stream->write_size > 0 &&
+	    total <= stream->write_size - stream->write_len)) {
+		for (i = 0; i < cnt; i++)
+			if (!cfw_stream_write(stream, iov[i].iov_base,
+			    iov[i].iov_len))
+				return false;
+
+		return true;
+	}
+
+	return write_vec(stream, iov, cnt);
+}
+
+bool
+cfw_stream_write_strings(void *ptr, CFWString **strs, size_t cnt)
+{
+	struct iovec iov[IOV_BATCH];
+	size_t i;
+	int n;
+
+	for (i = 0; i < cnt; i += n) {
+		for (n = 0; n < IOV_BATCH && i + n < cnt; n++) {
+			iov[n].iov_base = cfw_string_c(strs[i + n]);
+			iov[n].iov_len = cfw_string_length(strs[i + n]);
+		}
+
+		if (!cfw_stream_writev(ptr, iov, n))
+			return false;
+	}
+
+	return true;
+}
+
+ssize_t
+cfw_stream_readv(void *ptr, const struct iovec *iov, int cnt)
+{
+	CFWStream *stream = ptr;
+	ssize_t ret;
+	size_t done = 0;
+	int i;
+
+	if (stream == NULL || stream->ops == NULL || cnt < 0)
+		return -1;
+
+	if (stream->read_len > 0) {
+		for (i = 0; i < cnt && stream->read_len > 0; i++) {
+			size_t len = iov[i].iov_len;
+
+			if (len > stream->read_len)
+				len = stream->read_len;
+
+			memcpy(iov[i].iov_base, stream->read_buf +
+			    stream->read_pos, len);
+			consume(stream, len);
+			done += len;
+		}
+
+		return done;
+	}
+
+	for (i = 0; i < cnt; i++)
+		done += iov[i].iov_len;
+
+	if (done == 0)
+		return 0;
+
+	if (!write_pending(stream))
+		return -1;
+
+	if (stream->ops->readv == NULL) {
+		for (i = 0; i < cnt; i++)
+			if (iov[i].iov_len > 0)
+				return cfw_stream_read(stream, iov[i].iov_base,
+				    iov[i].iov_len);
+
+		return 0;
+	}
+
+	if ((ret = stream->ops->readv(stream, iov,
+	    (cnt > IOV_BATCH ? IOV_BATCH : cnt))) < -1)
+		ret = -1;
+
+	return ret;
+}
+
+#ifdef __linux__
+static bool
+unsupported(int err)
+{
+	return (err == EINVAL || err == ENOSYS || err == EXDEV ||
+	    err == EOPNOTSUPP || err == EBADF);
+}
+
+static ssize_t
+splice_pipe(int out, int in, int pipefd[2], size_t len)
+{
+	ssize_t ret, left, n;
+
+	if (len > SPLICE_SIZE)
+		len = SPLICE_SIZE;
+
+	if ((ret = splice(in, NULL, pipefd[1], NULL, len, SPLICE_F_MOVE)) <= 0)
+		return ret;
+
+	for (left = ret; left > 0; left -= n) {
+		if ((n = splice(pipefd[0], NULL, out, NULL, left,
+		    SPLICE_F_MOVE)) > 0)
+			continue;
+
+		if (n == -1 && errno == EINTR) {
+			n = 0;
+			continue;
+		}
+
+		/* The data is stuck in the pipe, so don't fall back */
+		if (n == 0 || unsupported(errno))
+			errno = EIO;
+
+		return -1;
+	}
+
+	return ret;
+}
+
+/*
+ * Copies between the descriptors without the data passing through user
+ * space and returns how much was copied. Stops early without setting failed
+ * when the kernel can't do it, so that the caller can continue through the
+ * buffer.
+ */
+static size_t
+kernel_copy(int out, int in, size_t len, bool *failed)
+{
+	static const struct timespec no_wait = { 0, 0 };
+	struct stat in_st, out_st;
+	sigset_t pipe_set, old_set;
+	int method, pipefd[2] = { -1, -1 }, err;
+	size_t done = 0;
+	ssize_t ret = 0;
+
+	*failed = false;
+
+	if (fstat(in, &in_st) == -1 || fstat(out, &out_st) == -1)
+		return 0;
+
+	if (S_ISREG(in_st.st_mode) && S_ISREG(out_st.st_mode))
+		method = COPY_FILE_RANGE;
+	else if (S_ISREG(in_st.st_mode))
+		method = COPY_SENDFILE;
+	else if (S_ISFIFO(in_st.st_mode) || S_ISFIFO(out_st.st_mode))
+		method = COPY_SPLICE;
+	else {
+		/* splice can't append, and would leave data in the pipe */
+		if (fcntl(out, F_GETFL) & O_APPEND ||
+		    pipe2(pipefd, O_CLOEXEC) == -1)
+			return 0;
+
+		method = COPY_PIPE;
+	}
+
+	/*
+	 * Unlike send() with MSG_NOSIGNAL, sendfile and splice to a socket
+	 * raise SIGPIPE when the peer is gone. It is blocked for the copy and
+	 * then dropped, so that the copy fails with EPIPE instead.
+	 */
+	sigemptyset(&pipe_set);
+	sigaddset(&pipe_set, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &pipe_set, &old_set);
+
+	while (done < len) {
+		size_t n = (len - done > COPY_SIZE ? COPY_SIZE : len - done);
+
+		switch (method) {
+		case COPY_FILE_RANGE:
+			ret = copy_file_range(in, NULL, out, NULL, n, 0);
+			break;
+		case COPY_SENDFILE:
+			ret = sendfile(out, in, NULL, n);
+			break;
+		case COPY_SPLICE:
+			ret = splice(in, NULL, out, NULL, n, SPLICE_F_MOVE);
+			break;
+		default:
+			ret = splice_pipe(out, in, pipefd, n);
+			break;
+		}
+
+		if (ret > 0) {
+			done += ret;
+			continue;
+		}
+
+		if (ret == -1 && errno == EINTR)
+			continue;
+
+		/* Older kernels can't copy_file_range across filesystems */
+		if (ret == -1 && method == COPY_FILE_RANGE &&
+		    unsupported(errno)) {
+			method = COPY_SENDFILE;
+			continue;
+		}
+
+		break;
+	}
+
+	err = errno;
+
+	if (ret == -1 && err == EPIPE && !sigismember(&old_set, SIGPIPE))
+		sigtimedwait(&pipe_set, NULL, &no_wait);
+
+	pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+
+	if (pipefd[0] != -1) {
+		close(pipefd[0]);
+		close(pipefd[1]);
+	}
+
+	errno = err;
+	*failed = (ret == -1 && !unsupported(err));
+
+	return done;
+}
+#endif
+
+ssize_t
+cfw_stream_copy(void *dst_ptr, void *src_ptr, size_t len)
+{
+	CFWStream *dst = dst_ptr, *src = src_ptr;
+	size_t done = 0, n;
+	ssize_t ret;
+#ifdef __linux__
+	bool failed;
+#endif
+
+	if (dst == NULL || dst->ops == NULL || src == NULL || src->ops == NULL)
+		return -1;
+
+	/* What is already buffered has to go out before the rest */
+	if (src->read_len > 0) {
+		n = (len > src->read_len ? src->read_len : len);
+
+		if (!cfw_stream_write(dst, src->read_buf + src->read_pos, n))
+			return -1;
+
+		consume(src, n);
+		done += n;
+	}
+
+#ifdef __linux__
+	/* The kernel can't queue for a run loop, so those copy as writes */
+	if (done < len && cfw_stream_fd(src) != -1 &&
+	    cfw_stream_fd(dst) != -1 && dst->queue_write == NULL) {
+		if (!write_pending(src) || !write_pending(dst))
+			return (done > 0 ? (ssize_t)done : -1);
+
+		done += kernel_copy(cfw_stream_fd(dst), cfw_stream_fd(src),
+		    len - done, &failed);
+
+		/* Like write(), an error after some progress is a short copy */
+		if (failed)
+			return (done > 0 ? (ssize_t)done : -1);
+	}
+#endif
+
+	/* Either the fallback or a final read that notices the end */
+	while (done < len) {
+		if (src->read_len == 0) {
+			if ((ret = fill(src)) == -1)
+				return (done > 0 ? (ssize_t)done : -1);
+
+			if (ret == 0)
+				break;
+		}
+
+		n = (len - done > src->read_len ? src->read_len : len - done);
+
+		if (!cfw_stream_write(dst, src->read_buf + src->read_pos, n))
+			return (done > 0 ? (ssize_t)done : -1);
+
+		consume(src, n);
+		done += n;
+	}
+
+	return done;
+}
+
+int
+cfw_stream_fd(void *ptr)
+{
+	CFWStream *stream = ptr;
+
+	if (stream == NULL || stream->ops == NULL || stream->ops->fd == NULL)
+		return -1;
+
+	return stream->ops->fd(stream);
 }
 
 bool
@@ -266,25 +892,39 @@ cfw_stream_write_string(void *ptr, const char *str)
 bool
 cfw_stream_write_line(void *ptr, const char *str)
 {
-	char *tmp;
-	size_t len;
+	CFWStream *stream = ptr;
+	char tmp[LINE_SIZE];
+	size_t len = strlen(str);
 
-	len = strlen(str);
+	/* Unbuffered, short lines still go out in a single write */
+	if (stream != NULL && stream->write_size == 0 && len < LINE_SIZE) {
+		memcpy(tmp, str, len);
+		tmp[len] = '\n';
 
-	if ((tmp = malloc(len + 2)) == NULL)
-		return false;
+		return cfw_stream_write(stream, tmp, len + 1);
+	}
 
-	memcpy(tmp, str, len);
-	tmp[len] = '\n';
-	tmp[len + 1] = '\0';
+	return (cfw_stream_write(stream, str, len) &&
+	    cfw_stream_write(stream, "\n", 1));
+}
 
-	if (!cfw_stream_write(ptr, tmp, len + 1)) {
-		free(tmp);
-		return false;
-	}
+bool
+cfw_stream_write_format(void *ptr, const char *fmt, ...)
+{
+	va_list args;
+	bool ret;
 
-	free(tmp);
-	return true;
+	va_start(args, fmt);
+	ret = cfw_vformat(cfw_stream_write, ptr, fmt, args);
+	va_end(args);
+
+	return ret;
+}
+
+bool
+cfw_stream_write_vformat(void *ptr, const char *fmt, va_list args)
+{
+	return cfw_vformat(cfw_stream_write, ptr, fmt, args);
 }
 
 bool
@@ -295,7 +935,7 @@ cfw_stream_at_end(void *ptr)
 	if (stream == NULL || stream->ops == NULL)
 		return true;
 
-	if (stream->cache != NULL)
+	if (stream->read_len > 0)
 		return false;
 
 	return stream->ops->at_end(stream);
@@ -309,6 +949,7 @@ cfw_stream_close(void *ptr)
 	if (stream == NULL || stream->ops == NULL)
 		return;
 
+	cfw_stream_flush(stream);
 	stream->ops->close(stream);
 }
 
@@ -29,30 +29,75 @@
 
 #include <unistd.h>
 
+#include <sys/uio.h>
+
 #include "class.h"
 #include "object.h"
 #include "string.h"
 
+#define CFW_STREAM_BUFSIZE 4096
+#define CFW_STREAM_BUFLIMIT (1024 * 1024)
+
 struct cfw_stream_ops {
 	ssize_t (*read)(void*, void*, size_t);
 	bool (*write)(void*, const void*, size_t);
 	bool (*at_end)(void*);
 	void (*close)(void*);
+	ssize_t (*readv)(void*, const struct iovec*, int);
+	ssize_t (*writev)(void*, const struct iovec*, int);
+	int (*fd)(void*);
+	bool (*flush)(void*);
 };
 
 typedef struct CFWStream {
 	CFWObject obj;
 	struct cfw_stream_ops *ops;
-	char *cache;
-	size_t cache_len;
+	char *read_buf;
+	size_t read_size, read_pos, read_len, read_limit;
+	char *write_buf;
+	size_t write_size, write_len;
+	bool line_buffered;
+	/* Set while a run loop queues the writes for a non-blocking fd */
+	bool (*queue_write)(void*, const void*, size_t);
+	void *queue_ctx;
 } CFWStream;
 
+typedef struct cfw_stream_line_iter_t {
+	const char *line;
+	size_t len;
+	/* private */
+	CFWStream *_stream;
+	const char *_delim;
+	size_t _delim_len;
+	bool _crlf;
+} cfw_stream_line_iter_t;
+
 extern CFWClass *cfw_stream;
 extern ssize_t cfw_stream_read(void*, void*, size_t);
+extern ssize_t cfw_stream_fill(void*);
 extern CFWString* cfw_stream_read_line(void*);
+extern bool cfw_stream_read_line_into(void*, CFWString*, const char*);
+extern void cfw_stream_line_iter(void*, cfw_stream_line_iter_t*,
+    const char*);
+extern bool cfw_stream_line_iter_next(cfw_stream_line_iter_t*);
+extern bool cfw_stream_set_read_buffer_size(void*, size_t);
+extern size_t cfw_stream_read_buffer_size(void*);
+extern void cfw_stream_set_read_buffer_limit(void*, size_t);
+extern size_t cfw_stream_read_buffer_limit(void*);
+extern bool cfw_stream_set_write_buffer_size(void*, size_t);
+extern size_t cfw_stream_write_buffer_size(void*);
+extern void cfw_stream_set_line_buffered(void*, bool);
+extern bool cfw_stream_flush(void*);
 extern bool cfw_stream_write(void*, const void*, size_t);
+extern bool cfw_stream_writev(void*, const struct iovec*, int);
+extern bool cfw_stream_write_strings(void*, CFWString**, size_t);
+extern ssize_t cfw_stream_readv(void*, const struct iovec*, int);
+extern ssize_t cfw_stream_copy(void*, void*, size_t);
+extern int cfw_stream_fd(void*);
 extern bool cfw_stream_write_string(void*, const char*);
 extern bool cfw_stream_write_line(void*, const char*);
+extern bool cfw_stream_write_format(void*, const char*, ...);
+extern bool cfw_stream_write_vformat(void*, const char*, va_list);
 extern bool cfw_stream_at_end(void*);
 extern void cfw_stream_close(void*);
 #endif
@@ -31,12 +31,38 @@
 
 #include "object.h"
 #include "string.h"
+#include "stringview.h"
+#include "array.h"
 #include "hash.h"
+#include "search.h"
+#include "utf8.h"
+#include "tokenizer.h"
+#include "number.h"
+#include "format.h"
+
+/* Strings shorter than this are stored inside the object */
+#define SMALL_SIZE 24
+
+/*
+ * Strings of at least UTF8_INDEX_MIN bytes get an index of the byte offset
+ * of every UTF8_STRIDE-th code point the first time they are indexed. It
+ * is dropped by the functions that modify the string.
+ */
+#define UTF8_INDEX_MIN 1024
+#define UTF8_STRIDE 256
+
+struct utf8_index {
+	size_t length;
+	size_t offsets[];
+};
 
 struct CFWString {
 	CFWObject obj;
 	char *data;
-	size_t len;
+	size_t len, cap;
+	void *owner;
+	struct utf8_index *utf8;
+	char small[SMALL_SIZE];
 };
 
 size_t
@@ -83,22 +109,140 @@ cfw_strndup(const char *s, size_t max)
 	return copy;
 }
 
+static void
+invalidate(CFWString *str)
+{
+	free(str->utf8);
+	str->utf8 = NULL;
+}
+
+/* Borrowed data belongs to the owner and is never written to */
+static void
+release(CFWString *str)
+{
+	if (str->owner != NULL) {
+		cfw_unref(str->owner);
+		str->owner = NULL;
+	} else if (str->data != str->small)
+		free(str->data);
+}
+
+static bool
+set_capacity(CFWString *str, size_t cap)
+{
+	char *data;
+
+	if (cap == SIZE_MAX)
+		return false;
+
+	if (str->data == str->small || str->owner != NULL) {
+		if ((data = malloc(cap + 1)) == NULL)
+			return false;
+
+		memcpy(data, str->data, str->len + 1);
+		release(str);
+	} else if ((data = realloc(str->data, cap + 1)) == NULL)
+		return false;
+
+	str->data = data;
+	str->cap = cap;
+
+	return true;
+}
+
+static bool
+grow(CFWString *str, size_t len)
+{
+	size_t cap;
+
+	if (len <= str->cap)
+		return true;
+
+	/* Grow by 1.5x so that appending is amortized O(1) */
+	if (str->cap <= SIZE_MAX / 3 * 2)
+		cap = str->cap + str->cap / 2;
+	else
+		cap = len;
+
+	if (cap < len)
+		cap = len;
+
+	return set_capacity(str, cap);
+}
+
+static bool
+set_bytes(CFWString *str, const char *bytes, size_t len)
+{
+	char *data;
+
+	invalidate(str);
+
+	if (len <= str->cap && str->owner == NULL) {
+		memmove(str->data, bytes, len);
+		str->data[len] = '\0';
+		str->len = len;
+
+		return true;
+	}
+
+	if (len == SIZE_MAX || (data = malloc(len + 1)) == NULL)
+		return false;
+
+	memcpy(data, bytes, len);
+	data[len] = '\0';
+
+	release(str);
+
+	str->data = data;
+	str->len = len;
+	str->cap = len;
+
+	return true;
+}
+
+static bool
+append_bytes(CFWString *str, const char *bytes, size_t len)
+{
+	size_t offset;
+	bool self;
+
+	if (len == 0)
+		return true;
+
+	if (len > SIZE_MAX - str->len)
+		return false;
+
+	invalidate(str);
+
+	/* Appending (part of) the string itself must survive the realloc */
+	self = (bytes >= str->data && bytes <= str->data + str->len);
+	offset = bytes - str->data;
+
+	if (!grow(str, str->len + len))
+		return false;
+
+	memmove(str->data + str->len, (self ? str->data + offset : bytes), len);
+	str->len += len;
+	str->data[str->len] = '\0';
+
+	return true;
+}
+
 static bool
 ctor(void *ptr, va_list args)
 {
 	CFWString *str = ptr;
 	const char *cstr = va_arg(args, const char*);
 
-	if (cstr != NULL) {
-		str->data = NULL;
-		if ((str->data = cfw_strdup(cstr)) == NULL)
-			return false;
+	str->data = str->small;
+	str->small[0] = '\0';
+	str->len = 0;
+	str->cap = SMALL_SIZE - 1;
+	str->owner = NULL;
+	str->utf8 = NULL;
 
-		str->len = strlen(cstr);
-	} else {
-		str->data = NULL;
-		str->len = 0;
-	}
+	if (cstr != NULL)
+		return set_bytes(str, cstr, strlen(cstr));
 
 	return true;
 }
@@ -108,8 +252,8 @@ dtor(void *ptr)
 {
 	CFWString *str = ptr;
 
-	if (str->data != NULL)
-		free(str->data);
+	release(str);
+	free(str->utf8);
 }
 
 static bool
@@ -118,10 +262,20 @@ equal(void *ptr1, void *ptr2)
 	CFWObject *obj2 = ptr2;
 	CFWString *str1, *str2;
 
+	str1 = ptr1;
+
+	/* Views compare equal to strings with the same bytes */
+	if (obj2->cls == cfw_stringview) {
+		if (str1->len != cfw_stringview_length(ptr2))
+			return false;
+
+		return !memcmp(str1->data, cfw_stringview_data(ptr2),
+		    str1->len);
+	}
+
 	if (obj2->cls != cfw_string)
 		return false;
 
-	str1 = ptr1;
 	str2 = ptr2;
 
 	if (str1->len != str2->len)
@@ -156,13 +310,10 @@ copy(void *ptr)
 	if ((new = cfw_new(cfw_string, (void*)NULL)) == NULL)
 		return NULL;
 
-	if ((new->data = malloc(str->len + 1)) == NULL) {
+	if (!set_bytes(new, str->data, str->len)) {
 		cfw_unref(new);
 		return NULL;
 	}
-	new->len = str->len;
-
-	memcpy(new->data, str->data, str->len + 1);
 
 	return new;
 }
@@ -182,81 +333,178 @@ cfw_string_length(CFWString *string)
 bool
 cfw_string_set(CFWString *str, const char *cstr)
 {
-	char *copy;
-	size_t len;
+	if (cstr == NULL)
+		return set_bytes(str, "", 0);
 
-	if (str != NULL) {
-		if ((copy = cfw_strdup(cstr)) == NULL)
-			return false;
+	return set_bytes(str, cstr, strlen(cstr));
+}
 
-		len = strlen(copy);
-	} else {
-		copy = NULL;
-		len = 0;
+bool
+cfw_string_set_buf(CFWString *str, const char *buf, size_t len)
+{
+	return set_bytes(str, buf, len);
+}
+
+void
+cfw_string_set_nocopy(CFWString *str, char *cstr, size_t len)
+{
+	invalidate(str);
+	release(str);
+
+	if (cstr == NULL) {
+		str->data = str->small;
+		str->small[0] = '\0';
+		str->len = 0;
+		str->cap = SMALL_SIZE - 1;
+
+		return;
 	}
 
-	if (str->data != NULL)
-		free(str->data);
+	str->data = cstr;
+	str->len = len;
+	str->cap = len;
+}
 
-	str->data = copy;
+bool
+cfw_string_set_borrowed(CFWString *str, void *owner, const char *buf,
+    size_t len)
+{
+	if (buf[len] != '\0')
+		return false;
+
+	invalidate(str);
+	release(str);
+
+	str->data = (char*)buf;
 	str->len = len;
+	str->cap = len;
+	str->owner = cfw_ref(owner);
 
 	return true;
 }
 
-void
-cfw_string_set_nocopy(CFWString *str, char *cstr, size_t len)
+bool
+cfw_string_reserve(CFWString *str, size_t cap)
 {
-	if (str->data != NULL)
-		free(str->data);
+	if (cap <= str->cap)
+		return true;
 
-	str->data = cstr;
-	str->len = len;
+	return set_capacity(str, cap);
 }
 
 bool
 cfw_string_append(CFWString *str, CFWString *append)
 {
-	char *new;
+	if (append == NULL)
+		return true;
 
+	return append_bytes(str, append->data, append->len);
+}
+
+bool
+cfw_string_append_c(CFWString *str, const char *append)
+{
 	if (append == NULL)
 		return true;
 
-	if ((new = realloc(str->data, str->len + append->len + 1)) == NULL)
-		return false;
+	return append_bytes(str, append, strlen(append));
+}
 
-	memcpy(new + str->len, append->data, append->len);
-	new[str->len + append->len] = 0;
+bool
+cfw_string_append_buf(CFWString *str, const char *buf, size_t len)
+{
+	return append_bytes(str, buf, len);
+}
 
-	str->data = new;
-	str->len += append->len;
+/* Formats straight into the string's buffer, no temporary needed */
+bool
+cfw_string_append_int(CFWString *str, intmax_t value)
+{
+	if (str->len > SIZE_MAX - CFW_INT_BUFSIZE ||
+	    !grow(str, str->len + CFW_INT_BUFSIZE))
+		return false;
+
+	invalidate(str);
+	str->len += cfw_format_int(str->data + str->len, value);
+	str->data[str->len] = '\0';
 
 	return true;
 }
 
 bool
-cfw_string_append_c(CFWString *str, const char *append)
+cfw_string_append_uint(CFWString *str, uintmax_t value)
 {
-	char *new;
-	size_t append_len;
+	if (str->len > SIZE_MAX - CFW_INT_BUFSIZE ||
+	    !grow(str, str->len + CFW_INT_BUFSIZE))
+		return false;
 
-	if (append == NULL)
-		return true;
+	invalidate(str);
+	str->len += cfw_format_uint(str->data + str->len, value);
+	str->data[str->len] = '\0';
 
-	append_len = strlen(append);
+	return true;
+}
 
-	if ((new = realloc(str->data, str->len + append_len + 1)) == NULL)
+bool
+cfw_string_append_double(CFWString *str, double value)
+{
+	if (str->len > SIZE_MAX - CFW_DOUBLE_BUFSIZE ||
+	    !grow(str, str->len + CFW_DOUBLE_BUFSIZE))
 		return false;
 
-	memcpy(new + str->len, append, append_len);
-	new[str->len + append_len] = 0;
-
-	str->data = new;
-	str->len += append_len;
+	invalidate(str);
+	str->len += cfw_format_double(str->data + str->len, value);
+	str->data[str->len] = '\0';
 
 	return true;
 }
 
+static bool
+write_string(void *ptr, const void *buf, size_t len)
+{
+	return append_bytes(ptr, buf, len);
+}
+
+bool
+cfw_string_append_format(CFWString *str, const char *fmt, ...)
+{
+	va_list args;
+	bool ret;
+
+	va_start(args, fmt);
+	ret = cfw_vformat(write_string, str, fmt, args);
+	va_end(args);
+
+	return ret;
+}
+
+bool
+cfw_string_append_vformat(CFWString *str, const char *fmt, va_list args)
+{
+	return cfw_vformat(write_string, str, fmt, args);
+}
+
+bool
+cfw_string_int_value(CFWString *str, intmax_t *value)
+{
+	return (str->len > 0 &&
+	    cfw_parse_int(str->data, str->len, value) == str->len);
+}
+
+bool
+cfw_string_uint_value(CFWString *str, uintmax_t *value)
+{
+	return (str->len > 0 &&
+	    cfw_parse_uint(str->data, str->len, value) == str->len);
+}
+
+bool
+cfw_string_double_value(CFWString *str, double *value)
+{
+	return (str->len > 0 &&
+	    cfw_parse_double(str->data, str->len, value) == str->len);
+}
+
 bool
 cfw_string_has_prefix(CFWString *str, CFWString *prefix)
 {
@@ -297,10 +545,10 @@ cfw_string_has_suffix_c(CFWString *str, const char *suffix)
 	return !memcmp(str->data, suffix, suffix_len);
 }
 
-size_t
-cfw_string_find(CFWString *str, CFWString *substr, cfw_range_t range)
+static size_t
+find(CFWString *str, const char *substr, size_t substr_len, cfw_range_t range)
 {
-	size_t i;
+	size_t pos;
 
 	if (range.start > str->len)
 		return SIZE_MAX;
@@ -308,38 +556,160 @@ cfw_string_find(CFWString *str, CFWString *substr, cfw_range_t range)
 	if (range.length == SIZE_MAX)
 		range.length = str->len - range.start;
 
-	if (range.start + range.length > str->len || substr->len > range.length)
+	if (range.start + range.length > str->len || substr_len > range.length)
+		return SIZE_MAX;
+
+	if ((pos = cfw_memmem(str->data + range.start, range.length, substr,
+	    substr_len)) == SIZE_MAX)
 		return SIZE_MAX;
 
-	for (i = range.start; i <= range.start + range.length - substr->len;
-	    i++)
-		if (!memcmp(str->data + i, substr->data, substr->len))
-			return i;
+	return range.start + pos;
+}
 
-	return SIZE_MAX;
+size_t
+cfw_string_find(CFWString *str, CFWString *substr, cfw_range_t range)
+{
+	return find(str, substr->data, substr->len, range);
 }
 
 size_t
 cfw_string_find_c(CFWString *str, const char *substr, cfw_range_t range)
 {
-	size_t substr_len = strlen(substr);
-	size_t i;
+	return find(str, substr, strlen(substr), range);
+}
 
-	if (range.start > str->len)
-		return SIZE_MAX;
+CFWArray*
+cfw_string_split(CFWString *str, const char *delim)
+{
+	cfw_range_t *ranges = NULL, *new;
+	size_t cnt = 0, cap = 0;
+	CFWArray *array;
+	cfw_tokenizer_t tok;
 
-	if (range.length == SIZE_MAX)
-		range.length = str->len - range.start;
+	cfw_tokenize_string(&tok, str, delim);
 
-	if (range.start + range.length > str->len || substr_len > range.length)
+	while (cfw_tokenizer_next(&tok)) {
+		if (cnt == cap) {
+			cap = (cap > 0 ? cap * 2 : 16);
+
+			if ((new = realloc(ranges, cap * sizeof(*ranges))) ==
+			    NULL) {
+				free(ranges);
+				return NULL;
+			}
+
+			ranges = new;
+		}
+
+		ranges[cnt++] = cfw_range(tok.token - str->data, tok.len);
+	}
+
+	/* All fields are allocated as one block instead of one by one */
+	array = cfw_stringview_array(str, ranges, cnt);
+	free(ranges);
+
+	return array;
+}
+
+CFWArray*
+cfw_string_split_buf(const char *buf, size_t len, const char *delim)
+{
+	CFWString *arena;
+	CFWArray *array;
+
+	/*
+	 * All fields share one copy of the input, which lives as long as
+	 * any of them does.
+	 */
+	if ((arena = cfw_new(cfw_string, (void*)NULL)) == NULL)
+		return NULL;
+
+	if (!set_bytes(arena, buf, len)) {
+		cfw_unref(arena);
+		return NULL;
+	}
+
+	array = cfw_string_split(arena, delim);
+	cfw_unref(arena);
+
+	return array;
+}
+
+bool
+cfw_string_utf8_valid(CFWString *str)
+{
+	return cfw_utf8_valid(str->data, str->len);
+}
+
+static struct utf8_index*
+utf8_index(CFWString *str)
+{
+	struct utf8_index *index, *other = NULL;
+	size_t i, count, length, pos;
+
+	if ((index = __atomic_load_n(&str->utf8, __ATOMIC_ACQUIRE)) != NULL)
+		return index;
+
+	length = cfw_utf8_length(str->data, str->len);
+	count = length / UTF8_STRIDE + 1;
+
+	if ((index = malloc(sizeof(*index) + count * sizeof(size_t))) == NULL)
+		return NULL;
+
+	index->length = length;
+	index->offsets[0] = pos = 0;
+
+	for (i = 1; i < count; i++) {
+		pos += cfw_utf8_offset(str->data + pos, str->len - pos,
+		    UTF8_STRIDE);
+		index->offsets[i] = pos;
+	}
+
+	/* Readers may build it at the same time, the first one is kept */
+	if (!__atomic_compare_exchange_n(&str->utf8, &other, index, false,
+	    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		free(index);
+		return other;
+	}
+
+	return index;
+}
+
+size_t
+cfw_string_utf8_length(CFWString *str)
+{
+	struct utf8_index *index;
+
+	if (str->len >= UTF8_INDEX_MIN && (index = utf8_index(str)) != NULL)
+		return index->length;
+
+	return cfw_utf8_length(str->data, str->len);
+}
+
+size_t
+cfw_string_utf8_offset(CFWString *str, size_t cp)
+{
+	struct utf8_index *index;
+	size_t pos;
+
+	if (str->len < UTF8_INDEX_MIN || (index = utf8_index(str)) == NULL)
+		return cfw_utf8_offset(str->data, str->len, cp);
+
+	if (cp > index->length)
 		return SIZE_MAX;
 
-	for (i = range.start; i <= range.start + range.length - substr_len;
-	    i++)
-		if (!memcmp(str->data + i, substr, substr_len))
-			return i;
+	pos = index->offsets[cp / UTF8_STRIDE];
+
+	return pos + cfw_utf8_offset(str->data + pos, str->len - pos,
+	    cp % UTF8_STRIDE);
+}
+
+static bool
+describe(void *ptr, cfw_writer_t write, void *ctx)
+{
+	CFWString *str = ptr;
 
-	return SIZE_MAX;
+	return write(ctx, str->data, str->len);
 }
 
 static CFWClass class = {
@@ -349,6 +719,7 @@ static CFWClass class = {
 	.dtor = dtor,
 	.equal = equal,
 	.hash = hash,
-	.copy = copy
+	.copy = copy,
+	.describe = describe
 };
 CFWClass *cfw_string = &class;
@@ -29,6 +29,7 @@
 
 #include "class.h"
 #include "range.h"
+#include "array.h"
 
 typedef struct CFWString CFWString;
 extern CFWClass *cfw_string;
@@ -38,14 +39,36 @@ extern char* cfw_strndup(const char*, size_t);
 extern char* cfw_string_c(CFWString*);
 extern size_t cfw_string_length(CFWString*);
 extern bool cfw_string_set(CFWString*, const char*);
+extern bool cfw_string_set_buf(CFWString*, const char*, size_t);
 extern void cfw_string_set_nocopy(CFWString*, char*, size_t);
+extern bool cfw_string_set_borrowed(CFWString*, void*, const char*, size_t);
+extern bool cfw_string_reserve(CFWString*, size_t);
 extern bool cfw_string_append(CFWString*, CFWString*);
 extern bool cfw_string_append_c(CFWString*, const char*);
+extern bool cfw_string_append_buf(CFWString*, const char*, size_t);
+extern bool cfw_string_append_int(CFWString*, intmax_t);
+extern bool cfw_string_append_uint(CFWString*, uintmax_t);
+extern bool cfw_string_append_double(CFWString*, double);
+extern bool cfw_string_append_format(CFWString*, const char*, ...);
+extern bool cfw_string_append_vformat(CFWString*, const char*, va_list);
+extern bool cfw_string_int_value(CFWString*, intmax_t*);
+extern bool cfw_string_uint_value(CFWString*, uintmax_t*);
+extern bool cfw_string_double_value(CFWString*, double*);
 extern bool cfw_string_has_prefix(CFWString*, CFWString*);
 extern bool cfw_string_has_prefix_c(CFWString*, const char*);
 extern bool cfw_string_has_suffix(CFWString*, CFWString*);
 extern bool cfw_string_has_suffix_c(CFWString*, const char*);
 extern size_t cfw_string_find(CFWString*, CFWString*, cfw_range_t);
 extern size_t cfw_string_find_c(CFWString*, const char*, cfw_range_t);
+extern CFWArray* cfw_string_split(CFWString*, const char*);
+extern CFWArray* cfw_string_split_buf(const char*, size_t, const char*);
+/*
+ * Long strings are indexed on first use, which is safe from several threads.
+ * Only the cfw_string_* functions that modify a string drop the index, so it
+ * becomes stale if the string is changed through cfw_string_c().
+ */
+extern bool cfw_string_utf8_valid(CFWString*);
+extern size_t cfw_string_utf8_length(CFWString*);
+extern size_t cfw_string_utf8_offset(CFWString*, size_t);
 
 #endif
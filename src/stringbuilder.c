@@ -0,0 +1,298 @@
+/*
+ * Copyright (c) 2012, Jonathan Schleifer <js@webkeks.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "object.h"
+#include "stringbuilder.h"
+#include "number.h"
+
+#define MIN_CHUNK_SIZE 256
+#define MAX_CHUNK_SIZE (1024 * 1024)
+
+/*
+ * Appended data goes into a list of chunks that double in size, so nothing
+ * that was already appended is ever copied until the string is built.
+ */
+struct chunk {
+	char *data;
+	size_t len, cap;
+};
+
+struct CFWStringBuilder {
+	CFWObject obj;
+	struct chunk *chunks;
+	size_t chunks_cnt, chunks_cap;
+	size_t len;
+};
+
+static bool
+ctor(void *ptr, va_list args)
+{
+	CFWStringBuilder *sb = ptr;
+
+	sb->chunks = NULL;
+	sb->chunks_cnt = 0;
+	sb->chunks_cap = 0;
+	sb->len = 0;
+
+	return true;
+}
+
+static void
+dtor(void *ptr)
+{
+	cfw_stringbuilder_reset(ptr);
+}
+
+static struct chunk*
+add_chunk(CFWStringBuilder *sb, size_t min)
+{
+	struct chunk *chunk;
+	size_t cap;
+
+	if (sb->chunks_cnt == sb->chunks_cap) {
+		struct chunk *new;
+		size_t new_cap = (sb->chunks_cap > 0 ? sb->chunks_cap * 2 : 4);
+
+		if ((new = realloc(sb->chunks,
+		    new_cap * sizeof(struct chunk))) == NULL)
+			return NULL;
+
+		sb->chunks = new;
+		sb->chunks_cap = new_cap;
+	}
+
+	if (sb->chunks_cnt > 0) {
+		cap = sb->chunks[sb->chunks_cnt - 1].cap;
+		if (cap < MAX_CHUNK_SIZE)
+			cap *= 2;
+	} else
+		cap = MIN_CHUNK_SIZE;
+
+	if (cap < min)
+		cap = min;
+
+	/* One extra byte so a single chunk can become a string as is */
+	if (cap == SIZE_MAX)
+		return NULL;
+
+	chunk = &sb->chunks[sb->chunks_cnt];
+	if ((chunk->data = malloc(cap + 1)) == NULL)
+		return NULL;
+
+	chunk->len = 0;
+	chunk->cap = cap;
+	sb->chunks_cnt++;
+
+	return chunk;
+}
+
+/* Returns a buffer with room for at least len bytes */
+static char*
+reserve(CFWStringBuilder *sb, size_t len)
+{
+	struct chunk *chunk;
+
+	if (sb->chunks_cnt > 0) {
+		chunk = &sb->chunks[sb->chunks_cnt - 1];
+
+		if (chunk->cap - chunk->len >= len)
+			return chunk->data + chunk->len;
+	}
+
+	if ((chunk = add_chunk(sb, len)) == NULL)
+		return NULL;
+
+	return chunk->data;
+}
+
+static void
+commit(CFWStringBuilder *sb, size_t len)
+{
+	sb->chunks[sb->chunks_cnt - 1].len += len;
+	sb->len += len;
+}
+
+size_t
+cfw_stringbuilder_length(CFWStringBuilder *sb)
+{
+	return sb->len;
+}
+
+bool
+cfw_stringbuilder_append(CFWStringBuilder *sb, const void *buf, size_t len)
+{
+	const char *bytes = buf;
+
+	if (len > SIZE_MAX - sb->len)
+		return false;
+
+	/* Fill up the current chunk first, then start a new one */
+	if (sb->chunks_cnt > 0) {
+		struct chunk *chunk = &sb->chunks[sb->chunks_cnt - 1];
+		size_t avail = chunk->cap - chunk->len;
+
+		if (avail > len)
+			avail = len;
+
+		memcpy(chunk->data + chunk->len, bytes, avail);
+		commit(sb, avail);
+
+		bytes += avail;
+		len -= avail;
+	}
+
+	if (len > 0) {
+		char *dst;
+
+		if ((dst = reserve(sb, len)) == NULL)
+			return false;
+
+		memcpy(dst, bytes, len);
+		commit(sb, len);
+	}
+
+	return true;
+}
+
+bool
+cfw_stringbuilder_append_c(CFWStringBuilder *sb, const char *cstr)
+{
+	return cfw_stringbuilder_append(sb, cstr, strlen(cstr));
+}
+
+bool
+cfw_stringbuilder_append_string(CFWStringBuilder *sb, CFWString *str)
+{
+	if (str == NULL)
+		return true;
+
+	return cfw_stringbuilder_append(sb, cfw_string_c(str),
+	    cfw_string_length(str));
+}
+
+bool
+cfw_stringbuilder_append_int(CFWStringBuilder *sb, intmax_t value)
+{
+	char *dst;
+
+	if ((dst = reserve(sb, CFW_INT_BUFSIZE)) == NULL)
+		return false;
+
+	commit(sb, cfw_format_int(dst, value));
+
+	return true;
+}
+
+bool
+cfw_stringbuilder_append_uint(CFWStringBuilder *sb, uintmax_t value)
+{
+	char *dst;
+
+	if ((dst = reserve(sb, CFW_INT_BUFSIZE)) == NULL)
+		return false;
+
+	commit(sb, cfw_format_uint(dst, value));
+
+	return true;
+}
+
+bool
+cfw_stringbuilder_append_double(CFWStringBuilder *sb, double value)
+{
+	char *dst;
+
+	if ((dst = reserve(sb, CFW_DOUBLE_BUFSIZE)) == NULL)
+		return false;
+
+	commit(sb, cfw_format_double(dst, value));
+
+	return true;
+}
+
+CFWString*
+cfw_stringbuilder_string(CFWStringBuilder *sb)
+{
+	CFWString *str;
+	char *data;
+	size_t i;
+
+	if ((str = cfw_create(cfw_string, (void*)NULL)) == NULL)
+		return NULL;
+
+	if (sb->len == 0)
+		return str;
+
+	if (sb->chunks_cnt == 1) {
+		/* Hand the only chunk over to the string without a copy */
+		data = sb->chunks[0].data;
+		sb->chunks_cnt = 0;
+	} else {
+		char *dst;
+
+		if ((data = malloc(sb->len + 1)) == NULL)
+			return NULL;
+
+		for (i = 0, dst = data; i < sb->chunks_cnt; i++) {
+			memcpy(dst, sb->chunks[i].data, sb->chunks[i].len);
+			dst += sb->chunks[i].len;
+		}
+	}
+
+	data[sb->len] = '\0';
+	cfw_string_set_nocopy(str, data, sb->len);
+
+	cfw_stringbuilder_reset(sb);
+
+	return str;
+}
+
+void
+cfw_stringbuilder_reset(CFWStringBuilder *sb)
+{
+	size_t i;
+
+	for (i = 0; i < sb->chunks_cnt; i++)
+		free(sb->chunks[i].data);
+
+	free(sb->chunks);
+
+	sb->chunks = NULL;
+	sb->chunks_cnt = 0;
+	sb->chunks_cap = 0;
+	sb->len = 0;
+}
+
+static CFWClass class = {
+	.name = "CFWStringBuilder",
+	.size = sizeof(CFWStringBuilder),
+	.ctor = ctor,
+	.dtor = dtor
+};
+CFWClass *cfw_stringbuilder = &class;
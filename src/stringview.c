@@ -0,0 +1,292 @@
+/*
+ * Copyright (c) 2012, Jonathan Schleifer <js@webkeks.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "object.h"
+#include "stringview.h"
+#include "hash.h"
+
+/*
+ * A range of a parent string. Only the offset is stored, so the view stays
+ * valid when the parent reallocates its buffer.
+ */
+struct CFWStringView {
+	CFWObject obj;
+	CFWString *parent;
+	size_t start, len;
+	struct view_block *block;
+};
+
+/* Views created together, which share one allocation and parent ref */
+struct view_block {
+	size_t ref_cnt;
+	CFWString *parent;
+	CFWStringView views[];
+};
+
+static CFWClass class;
+
+static bool
+ctor(void *ptr, va_list args)
+{
+	CFWStringView *view = ptr;
+	CFWString *parent = va_arg(args, CFWString*);
+	cfw_range_t range = va_arg(args, cfw_range_t);
+	size_t parent_len;
+
+	view->parent = NULL;
+	view->block = NULL;
+
+	if (parent == NULL)
+		return false;
+
+	parent_len = cfw_string_length(parent);
+
+	if (range.start > parent_len)
+		return false;
+
+	if (range.length == SIZE_MAX)
+		range.length = parent_len - range.start;
+
+	if (range.length > parent_len - range.start)
+		return false;
+
+	view->parent = cfw_ref(parent);
+	view->start = range.start;
+	view->len = range.length;
+
+	return true;
+}
+
+static void
+dtor(void *ptr)
+{
+	CFWStringView *view = ptr;
+
+	if (view->block == NULL)
+		cfw_unref(view->parent);
+}
+
+static void
+dealloc(void *ptr)
+{
+	CFWStringView *view = ptr;
+	struct view_block *block = view->block;
+
+	if (block == NULL) {
+		free(view);
+		return;
+	}
+
+	if (__atomic_sub_fetch(&block->ref_cnt, 1, __ATOMIC_ACQ_REL) == 0) {
+		cfw_unref(block->parent);
+		free(block);
+	}
+}
+
+static bool
+equal(void *ptr1, void *ptr2)
+{
+	CFWObject *obj2 = ptr2;
+	CFWStringView *view = ptr1;
+	const char *data2;
+	size_t len2;
+
+	if (obj2->cls == cfw_stringview) {
+		data2 = cfw_stringview_data(ptr2);
+		len2 = cfw_stringview_length(ptr2);
+	} else if (obj2->cls == cfw_string) {
+		data2 = cfw_string_c(ptr2);
+		len2 = cfw_string_length(ptr2);
+	} else
+		return false;
+
+	if (cfw_stringview_length(view) != len2)
+		return false;
+
+	return !memcmp(cfw_stringview_data(view), data2, len2);
+}
+
+static uint32_t
+hash(void *ptr)
+{
+	CFWStringView *view = ptr;
+	const char *data = cfw_stringview_data(view);
+	size_t i, len = cfw_stringview_length(view);
+	uint32_t hash;
+
+	/* Must match CFWString so views can look up string keys */
+	CFW_HASH_INIT(hash);
+
+	for (i = 0; i < len; i++)
+		CFW_HASH_ADD(hash, data[i]);
+
+	CFW_HASH_FINALIZE(hash);
+
+	return hash;
+}
+
+static void*
+copy(void *ptr)
+{
+	CFWStringView *view = ptr;
+	CFWString *str;
+
+	/*
+	 * A copy must not change with the parent, so this is where the view
+	 * becomes a real string. This is also what a CFWMap stores as key.
+	 */
+	if ((str = cfw_new(cfw_string, (void*)NULL)) == NULL)
+		return NULL;
+
+	if (!cfw_string_append_buf(str, cfw_stringview_data(view),
+	    cfw_stringview_length(view))) {
+		cfw_unref(str);
+		return NULL;
+	}
+
+	return str;
+}
+
+const char*
+cfw_stringview_data(CFWStringView *view)
+{
+	return cfw_string_c(view->parent) + view->start;
+}
+
+size_t
+cfw_stringview_length(CFWStringView *view)
+{
+	size_t parent_len = cfw_string_length(view->parent);
+
+	/* The parent might have been shortened since */
+	if (view->start > parent_len)
+		return 0;
+
+	if (view->len > parent_len - view->start)
+		return parent_len - view->start;
+
+	return view->len;
+}
+
+CFWString*
+cfw_stringview_parent(CFWStringView *view)
+{
+	return view->parent;
+}
+
+cfw_range_t
+cfw_stringview_range(CFWStringView *view)
+{
+	return cfw_range(view->start, cfw_stringview_length(view));
+}
+
+CFWString*
+cfw_stringview_string(CFWStringView *view)
+{
+	CFWString *str;
+
+	if ((str = cfw_create(cfw_string, (void*)NULL)) == NULL)
+		return NULL;
+
+	if (!cfw_string_append_buf(str, cfw_stringview_data(view),
+	    cfw_stringview_length(view)))
+		return NULL;
+
+	return str;
+}
+
+CFWArray*
+cfw_stringview_array(CFWString *parent, const cfw_range_t *ranges, size_t cnt)
+{
+	struct view_block *block;
+	CFWStringView *view;
+	CFWArray *array;
+	size_t i;
+	bool ok = true;
+
+	if ((array = cfw_create(cfw_array, (void*)NULL)) == NULL)
+		return NULL;
+
+	if (cnt == 0)
+		return array;
+
+	if (parent == NULL || !cfw_array_reserve(array, cnt))
+		return NULL;
+
+	if (cnt > (SIZE_MAX - sizeof(*block)) / sizeof(CFWStringView))
+		return NULL;
+
+	if ((block = malloc(sizeof(*block) + cnt * sizeof(CFWStringView))) ==
+	    NULL)
+		return NULL;
+
+	block->ref_cnt = cnt;
+	block->parent = cfw_ref(parent);
+
+	for (i = 0; i < cnt; i++) {
+		view = &block->views[i];
+		view->obj.cls = &class;
+		view->obj.ref_cnt = 1;
+		view->parent = parent;
+		view->start = ranges[i].start;
+		view->len = ranges[i].length;
+		view->block = block;
+	}
+
+	/* The array takes over the reference each view was created with */
+	for (i = 0; i < cnt; i++) {
+		ok = (cfw_array_push(array, &block->views[i]) && ok);
+		cfw_unref(&block->views[i]);
+	}
+
+	return (ok ? array : NULL);
+}
+
+static bool
+describe(void *ptr, cfw_writer_t write, void *ctx)
+{
+	CFWStringView *view = ptr;
+
+	return write(ctx, cfw_stringview_data(view),
+	    cfw_stringview_length(view));
+}
+
+static CFWClass class = {
+	.name = "CFWStringView",
+	.size = sizeof(CFWStringView),
+	.ctor = ctor,
+	.dtor = dtor,
+	.equal = equal,
+	.hash = hash,
+	.copy = copy,
+	.describe = describe,
+	.dealloc = dealloc
+};
+CFWClass *cfw_stringview = &class;
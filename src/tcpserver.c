@@ -0,0 +1,310 @@
+/*
+ * Copyright (c) 2012, Jonathan Schleifer <js@webkeks.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+
+#include "object.h"
+#include "array.h"
+#include "tcpserver.h"
+#include "tcpsocket.h"
+
+#ifndef SOCK_NONBLOCK
+# define SOCK_NONBLOCK 0
+#endif
+#ifndef SOCK_CLOEXEC
+# define SOCK_CLOEXEC 0
+#endif
+
+struct CFWTCPServer {
+	CFWObject obj;
+	int fd;
+	bool reuseport, nonblocking;
+};
+
+static bool
+ctor(void *ptr, va_list args)
+{
+	CFWTCPServer *server = ptr;
+
+	server->fd = -1;
+	server->reuseport = false;
+	server->nonblocking = false;
+
+	return true;
+}
+
+static void
+dtor(void *ptr)
+{
+	cfw_tcpserver_close(ptr);
+}
+
+void
+cfw_tcpserver_set_reuseport(CFWTCPServer *server, bool reuseport)
+{
+	server->reuseport = reuseport;
+}
+
+void
+cfw_tcpserver_set_nonblocking(CFWTCPServer *server, bool nonblocking)
+{
+	server->nonblocking = nonblocking;
+}
+
+bool
+cfw_tcpserver_listen(CFWTCPServer *server, const char *host, uint16_t port,
+    int backlog)
+{
+	struct addrinfo hints, *res, *res0;
+	char portstr[7];
+	int one = 1;
+
+	if (server->fd != -1)
+		return false;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	snprintf(portstr, 7, "%" PRIu16, port);
+
+	if (getaddrinfo(host, portstr, &hints, &res0))
+		return false;
+
+	for (res = res0; res != NULL; res = res->ai_next) {
+		/* Always non-blocking, so that accepting can stop at EAGAIN */
+		if ((server->fd = socket(res->ai_family, res->ai_socktype |
+		    SOCK_NONBLOCK | SOCK_CLOEXEC, res->ai_protocol)) == -1)
+			continue;
+
+		setsockopt(server->fd, SOL_SOCKET, SO_REUSEADDR, &one,
+		    sizeof(one));
+
+#ifdef SO_REUSEPORT
+		if (server->reuseport && setsockopt(server->fd, SOL_SOCKET,
+		    SO_REUSEPORT, &one, sizeof(one)) == -1) {
+			close(server->fd);
+			server->fd = -1;
+			continue;
+		}
+#endif
+
+		if (bind(server->fd, res->ai_addr, res->ai_addrlen) == -1 ||
+		    listen(server->fd, (backlog > 0 ? backlog : SOMAXCONN)) ==
+		    -1) {
+			close(server->fd);
+			server->fd = -1;
+			continue;
+		}
+
+		break;
+	}
+
+	freeaddrinfo(res0);
+
+	return (server->fd != -1);
+}
+
+/*
+ * Opens one listener per acceptor thread. The kernel spreads incoming
+ * connections over them, so the threads don't contend on one queue.
+ */
+CFWArray*
+cfw_tcpserver_listen_reuseport(const char *host, uint16_t port, size_t cnt,
+    int backlog)
+{
+	CFWArray *servers;
+	size_t i;
+
+	if ((servers = cfw_create(cfw_array, (void*)NULL)) == NULL)
+		return NULL;
+
+	for (i = 0; i < cnt; i++) {
+		CFWTCPServer *server;
+
+		if ((server = cfw_create(cfw_tcpserver)) == NULL)
+			return NULL;
+
+		cfw_tcpserver_set_reuseport(server, true);
+
+		if (!cfw_tcpserver_listen(server, host, port, backlog) ||
+		    !cfw_array_push(servers, server))
+			return NULL;
+
+		/* All others have to share the port the first one got */
+		if (port == 0)
+			port = cfw_tcpserver_port(server);
+	}
+
+	return servers;
+}
+
+uint16_t
+cfw_tcpserver_port(CFWTCPServer *server)
+{
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof(addr);
+
+	if (server->fd == -1 ||
+	    getsockname(server->fd, (struct sockaddr*)&addr, &len) == -1)
+		return 0;
+
+	if (addr.ss_family == AF_INET)
+		return ntohs(((struct sockaddr_in*)&addr)->sin_port);
+	if (addr.ss_family == AF_INET6)
+		return ntohs(((struct sockaddr_in6*)&addr)->sin6_port);
+
+	return 0;
+}
+
+int
+cfw_tcpserver_fd(CFWTCPServer *server)
+{
+	return server->fd;
+}
+
+static int
+accept_fd(CFWTCPServer *server, bool wait)
+{
+	int fd;
+
+	for (;;) {
+#ifdef __linux__
+		fd = accept4(server->fd, NULL, NULL, SOCK_CLOEXEC |
+		    (server->nonblocking ? SOCK_NONBLOCK : 0));
+#else
+		/* Elsewhere, the listener's O_NONBLOCK may be inherited */
+		if ((fd = accept(server->fd, NULL, NULL)) != -1 &&
+		    fcntl(fd, F_SETFL, (server->nonblocking ? O_NONBLOCK : 0)) ==
+		    -1) {
+			close(fd);
+			return -1;
+		}
+#endif
+
+		if (fd != -1)
+			return fd;
+
+		/* The connection was gone before it could be accepted */
+		if (errno == EINTR || errno == ECONNABORTED)
+			continue;
+
+		if ((errno == EAGAIN || errno == EWOULDBLOCK) && wait) {
+			struct pollfd pfd = { .fd = server->fd, .events = POLLIN };
+
+			if (poll(&pfd, 1, -1) == -1 && errno != EINTR)
+				return -1;
+
+			continue;
+		}
+
+		return -1;
+	}
+}
+
+static CFWTCPSocket*
+make_socket(int fd)
+{
+	CFWTCPSocket *sock;
+
+	if ((sock = cfw_create(cfw_tcpsocket)) == NULL) {
+		close(fd);
+		return NULL;
+	}
+
+	cfw_tcpsocket_adopt_fd(sock, fd);
+
+	return sock;
+}
+
+CFWTCPSocket*
+cfw_tcpserver_accept(CFWTCPServer *server)
+{
+	int fd;
+
+	if (server->fd == -1 ||
+	    (fd = accept_fd(server, !server->nonblocking)) == -1)
+		return NULL;
+
+	return make_socket(fd);
+}
+
+/*
+ * Accepts whatever is queued up to cnt connections, waiting only for the
+ * first one and only if the server is blocking.
+ */
+size_t
+cfw_tcpserver_accept_many(CFWTCPServer *server, CFWTCPSocket **socks,
+    size_t cnt)
+{
+	size_t i;
+	int fd;
+
+	if (server->fd == -1)
+		return 0;
+
+	for (i = 0; i < cnt; i++) {
+		if ((fd = accept_fd(server, (i == 0 && !server->nonblocking))) ==
+		    -1)
+			break;
+
+		if ((socks[i] = make_socket(fd)) == NULL)
+			break;
+	}
+
+	return i;
+}
+
+void
+cfw_tcpserver_close(CFWTCPServer *server)
+{
+	if (server->fd != -1)
+		close(server->fd);
+
+	server->fd = -1;
+}
+
+static CFWClass class = {
+	.name = "CFWTCPServer",
+	.size = sizeof(CFWTCPServer),
+	.ctor = ctor,
+	.dtor = dtor
+};
+CFWClass *cfw_tcpserver = &class;
@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2012, Jonathan Schleifer <js@webkeks.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __COREFW_TCPSERVER_H__
+#define __COREFW_TCPSERVER_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "class.h"
+#include "array.h"
+#include "tcpsocket.h"
+
+typedef struct CFWTCPServer CFWTCPServer;
+
+extern CFWClass *cfw_tcpserver;
+extern void cfw_tcpserver_set_reuseport(CFWTCPServer*, bool);
+extern void cfw_tcpserver_set_nonblocking(CFWTCPServer*, bool);
+extern bool cfw_tcpserver_listen(CFWTCPServer*, const char*, uint16_t, int);
+extern CFWArray* cfw_tcpserver_listen_reuseport(const char*, uint16_t, size_t,
+    int);
+extern uint16_t cfw_tcpserver_port(CFWTCPServer*);
+extern int cfw_tcpserver_fd(CFWTCPServer*);
+extern CFWTCPSocket* cfw_tcpserver_accept(CFWTCPServer*);
+extern size_t cfw_tcpserver_accept_many(CFWTCPServer*, CFWTCPSocket**,
+    size_t);
+extern void cfw_tcpserver_close(CFWTCPServer*);
+
+#endif
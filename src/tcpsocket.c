@@ -25,25 +25,47 @@
  */
 
 #define _C99_SOURCE
-#define _POSIX_SOURCE
+#define _POSIX_C_SOURCE 200112L
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <inttypes.h>
+#include <time.h>
 
+#include <fcntl.h>
 #include <unistd.h>
+#include <poll.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 
 #include "stream.h"
 #include "tcpsocket.h"
 
+#ifndef MSG_NOSIGNAL
+# define MSG_NOSIGNAL 0
+#endif
+
+/* RFC 8305 recommends 250 ms between connection attempts */
+#define ATTEMPT_DELAY 250
+
 struct CFWTCPSocket {
 	CFWStream stream;
 	int fd;
 	bool at_end;
+	int options, sndbuf, rcvbuf;
+	int keepalive_idle, keepalive_interval, keepalive_count;
+	int connect_timeout, attempt_timeout;
+};
+
+struct attempt {
+	int fd;
+	int64_t started;
 };
 
 static ssize_t
@@ -62,14 +84,50 @@ static bool
 sock_write(void *ptr, const void *buf, size_t len)
 {
 	CFWTCPSocket *sock = ptr;
+	const char *pos = buf;
 	ssize_t ret;
 
-	if ((ret = send(sock->fd, buf, len, 0)) < len)
-		return false;
+	while (len > 0) {
+		if ((ret = send(sock->fd, pos, len, MSG_NOSIGNAL)) <= 0)
+			return false;
+
+		pos += ret;
+		len -= ret;
+	}
 
 	return true;
 }
 
+static ssize_t
+sock_readv(void *ptr, const struct iovec *iov, int cnt)
+{
+	CFWTCPSocket *sock = ptr;
+	struct msghdr msg;
+	ssize_t ret;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = (struct iovec*)iov;
+	msg.msg_iovlen = cnt;
+
+	if ((ret = recvmsg(sock->fd, &msg, 0)) == 0)
+		sock->at_end = true;
+
+	return ret;
+}
+
+static ssize_t
+sock_writev(void *ptr, const struct iovec *iov, int cnt)
+{
+	CFWTCPSocket *sock = ptr;
+	struct msghdr msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = (struct iovec*)iov;
+	msg.msg_iovlen = cnt;
+
+	return sendmsg(sock->fd, &msg, MSG_NOSIGNAL);
+}
+
 static bool
 sock_at_end(void *ptr)
 {
@@ -85,13 +143,27 @@ sock_close(void *ptr)
 
 	if (sock->fd != -1)
 		close(sock->fd);
+
+	/* The descriptor may be reused before the socket is released */
+	sock->fd = -1;
+}
+
+static int
+sock_fd(void *ptr)
+{
+	CFWTCPSocket *sock = ptr;
+
+	return sock->fd;
 }
 
 static struct cfw_stream_ops stream_ops = {
 	.read = sock_read,
 	.write = sock_write,
 	.at_end = sock_at_end,
-	.close = sock_close
+	.close = sock_close,
+	.readv = sock_readv,
+	.writev = sock_writev,
+	.fd = sock_fd
 };
 
 static bool
@@ -104,6 +176,14 @@ ctor(void *ptr, va_list args)
 	sock->fd = -1;
 	sock->stream.ops = &stream_ops;
 	sock->at_end = false;
+	sock->options = 0;
+	sock->sndbuf = 0;
+	sock->rcvbuf = 0;
+	sock->keepalive_idle = 0;
+	sock->keepalive_interval = 0;
+	sock->keepalive_count = 0;
+	sock->connect_timeout = 0;
+	sock->attempt_timeout = 0;
 
 	return true;
 }
@@ -114,11 +194,313 @@ dtor(void *ptr)
 	cfw_stream->dtor(ptr);
 }
 
+/* Buffer sizes only affect the window scale if set before connecting */
+static bool
+apply_buffer_sizes(CFWTCPSocket *sock, int fd)
+{
+	if (sock->sndbuf > 0 && setsockopt(fd, SOL_SOCKET, SO_SNDBUF,
+	    &sock->sndbuf, sizeof(sock->sndbuf)) == -1)
+		return false;
+
+	if (sock->rcvbuf > 0 && setsockopt(fd, SOL_SOCKET, SO_RCVBUF,
+	    &sock->rcvbuf, sizeof(sock->rcvbuf)) == -1)
+		return false;
+
+	return true;
+}
+
+static bool
+apply_options(CFWTCPSocket *sock, int fd)
+{
+	int on = 1;
+
+	if (sock->options & CFW_TCPSOCKET_NODELAY && setsockopt(fd,
+	    IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) == -1)
+		return false;
+
+#ifdef TCP_QUICKACK
+	/* Linux clears this again on its own, so it only helps early on */
+	if (sock->options & CFW_TCPSOCKET_QUICKACK && setsockopt(fd,
+	    IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on)) == -1)
+		return false;
+#endif
+
+	if (sock->keepalive_idle > 0) {
+		if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on,
+		    sizeof(on)) == -1)
+			return false;
+
+#ifdef TCP_KEEPIDLE
+		if (setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE,
+		    &sock->keepalive_idle, sizeof(int)) == -1)
+			return false;
+#endif
+#ifdef TCP_KEEPINTVL
+		if (sock->keepalive_interval > 0 && setsockopt(fd, IPPROTO_TCP,
+		    TCP_KEEPINTVL, &sock->keepalive_interval, sizeof(int)) == -1)
+			return false;
+#endif
+#ifdef TCP_KEEPCNT
+		if (sock->keepalive_count > 0 && setsockopt(fd, IPPROTO_TCP,
+		    TCP_KEEPCNT, &sock->keepalive_count, sizeof(int)) == -1)
+			return false;
+#endif
+	}
+
+	return true;
+}
+
+bool
+cfw_tcpsocket_set_options(CFWTCPSocket *sock, int options)
+{
+	sock->options = options;
+
+	return (sock->fd == -1 || apply_options(sock, sock->fd));
+}
+
+bool
+cfw_tcpsocket_set_keepalive(CFWTCPSocket *sock, int idle, int interval,
+    int cnt)
+{
+	sock->keepalive_idle = idle;
+	sock->keepalive_interval = interval;
+	sock->keepalive_count = cnt;
+
+	return (sock->fd == -1 || apply_options(sock, sock->fd));
+}
+
+bool
+cfw_tcpsocket_set_buffer_sizes(CFWTCPSocket *sock, int sndbuf, int rcvbuf)
+{
+	sock->sndbuf = sndbuf;
+	sock->rcvbuf = rcvbuf;
+
+	return (sock->fd == -1 || apply_buffer_sizes(sock, sock->fd));
+}
+
+void
+cfw_tcpsocket_set_connect_timeouts(CFWTCPSocket *sock, int timeout,
+    int attempt_timeout)
+{
+	sock->connect_timeout = timeout;
+	sock->attempt_timeout = attempt_timeout;
+}
+
+static int64_t
+now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static struct addrinfo*
+next_family(struct addrinfo *res, int family, bool same)
+{
+	while (res != NULL && (res->ai_family == family) != same)
+		res = res->ai_next;
+
+	return res;
+}
+
+/*
+ * Alternates between address families, starting with the one the resolver
+ * preferred, so that a broken family costs only one attempt delay.
+ */
+static size_t
+interleave(struct addrinfo *res0, struct addrinfo **addrs)
+{
+	int family = res0->ai_family;
+	struct addrinfo *a, *b;
+	size_t i;
+
+	a = next_family(res0, family, true);
+	b = next_family(res0, family, false);
+
+	for (i = 0; a != NULL || b != NULL; i++) {
+		if (b == NULL || (a != NULL && i % 2 == 0)) {
+			addrs[i] = a;
+			a = next_family(a->ai_next, family, true);
+		} else {
+			addrs[i] = b;
+			b = next_family(b->ai_next, family, false);
+		}
+	}
+
+	return i;
+}
+
+static int
+start_attempt(CFWTCPSocket *sock, struct addrinfo *addr)
+{
+	int fd, flags;
+
+	if ((fd = socket(addr->ai_family, addr->ai_socktype,
+	    addr->ai_protocol)) == -1)
+		return -1;
+
+	if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1 ||
+	    (flags = fcntl(fd, F_GETFL)) == -1 ||
+	    fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1 ||
+	    !apply_buffer_sizes(sock, fd)) {
+		close(fd);
+		return -1;
+	}
+
+	if (connect(fd, addr->ai_addr, addr->ai_addrlen) == -1 &&
+	    errno != EINPROGRESS) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static bool
+finish(CFWTCPSocket *sock, int fd)
+{
+	int flags;
+
+	if ((flags = fcntl(fd, F_GETFL)) == -1 ||
+	    fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) == -1 ||
+	    !apply_options(sock, fd)) {
+		close(fd);
+		return false;
+	}
+
+	sock->fd = fd;
+	sock->at_end = false;
+
+	return true;
+}
+
+/*
+ * Happy Eyeballs (RFC 8305): attempts are started one attempt delay apart,
+ * or right away when the previous one failed, and the first to connect wins.
+ */
+static int
+race(CFWTCPSocket *sock, struct addrinfo **addrs, size_t cnt)
+{
+	struct attempt *active;
+	struct pollfd *pfds;
+	int64_t now, deadline, next_start;
+	size_t i, next = 0, nactive = 0;
+	int winner = -1;
+
+	active = malloc(cnt * sizeof(*active));
+	pfds = malloc(cnt * sizeof(*pfds));
+	if (active == NULL || pfds == NULL) {
+		free(active);
+		free(pfds);
+		return -1;
+	}
+
+	now = now_ms();
+	deadline = (sock->connect_timeout > 0 ? now + sock->connect_timeout :
+	    INT64_MAX);
+	next_start = now;
+
+	while (winner == -1 && (next < cnt || nactive > 0)) {
+		int64_t wake = deadline;
+		int fd, ret;
+
+		now = now_ms();
+
+		if (now >= deadline) {
+			errno = ETIMEDOUT;
+			break;
+		}
+
+		if (next < cnt && (nactive == 0 || now >= next_start)) {
+			if ((fd = start_attempt(sock, addrs[next++])) != -1) {
+				active[nactive].fd = fd;
+				active[nactive].started = now;
+				nactive++;
+				next_start = now + ATTEMPT_DELAY;
+			} else
+				next_start = now;
+
+			continue;
+		}
+
+		if (next < cnt && next_start < wake)
+			wake = next_start;
+
+		for (i = 0; i < nactive; i++) {
+			pfds[i].fd = active[i].fd;
+			pfds[i].events = POLLOUT;
+			pfds[i].revents = 0;
+
+			if (sock->attempt_timeout > 0 && active[i].started +
+			    sock->attempt_timeout < wake)
+				wake = active[i].started + sock->attempt_timeout;
+		}
+
+		if ((ret = poll(pfds, nactive, (wake == INT64_MAX ? -1 :
+		    (int)(wake > now ? wake - now : 0)))) == -1) {
+			if (errno == EINTR)
+				continue;
+
+			break;
+		}
+
+		now = now_ms();
+
+		for (i = 0; i < nactive; i++) {
+			bool failed = false;
+
+			if (pfds[i].revents != 0) {
+				socklen_t len = sizeof(int);
+				int err = 0;
+
+				if (getsockopt(active[i].fd, SOL_SOCKET,
+				    SO_ERROR, &err, &len) == -1 || err != 0) {
+					errno = (err != 0 ? err : errno);
+					failed = true;
+				} else if (winner == -1) {
+					winner = active[i].fd;
+					active[i].fd = -1;
+				}
+			} else if (sock->attempt_timeout > 0 && now >=
+			    active[i].started + sock->attempt_timeout) {
+				errno = ETIMEDOUT;
+				failed = true;
+			}
+
+			/* A failure lets the next attempt start right away */
+			if (failed) {
+				close(active[i].fd);
+				active[i].fd = -1;
+				next_start = now;
+			}
+		}
+
+		for (i = 0; i < nactive;)
+			if (active[i].fd == -1)
+				active[i] = active[--nactive];
+			else
+				i++;
+	}
+
+	for (i = 0; i < nactive; i++)
+		close(active[i].fd);
+
+	free(active);
+	free(pfds);
+
+	return winner;
+}
+
 bool
 cfw_tcpsocket_connect(CFWTCPSocket *sock, const char *host, uint16_t port)
 {
-	struct addrinfo hints, *res, *res0;
+	struct addrinfo hints, *res0, **addrs;
+	struct addrinfo *res;
 	char portstr[7];
+	size_t cnt = 0;
+	int fd;
 
 	if (sock->fd != -1)
 		return false;
@@ -131,23 +513,32 @@ cfw_tcpsocket_connect(CFWTCPSocket *sock, const char *host, uint16_t port)
 	if (getaddrinfo(host, portstr, &hints, &res0))
 		return false;
 
-	for (res = res0; res != NULL; res = res->ai_next) {
-		if ((sock->fd = socket(res->ai_family, res->ai_socktype,
-		    res->ai_protocol)) == -1)
-			continue;
+	for (res = res0; res != NULL; res = res->ai_next)
+		cnt++;
 
-		if (connect(sock->fd, res->ai_addr, res->ai_addrlen) == -1) {
-			close(sock->fd);
-			sock->fd = -1;
-			continue;
-		}
-
-		break;
+	if ((addrs = malloc(cnt * sizeof(*addrs))) == NULL) {
+		freeaddrinfo(res0);
+		return false;
 	}
 
+	fd = race(sock, addrs, interleave(res0, addrs));
+
+	free(addrs);
 	freeaddrinfo(res0);
 
-	return (sock->fd != -1);
+	return (fd != -1 && finish(sock, fd));
+}
+
+bool
+cfw_tcpsocket_adopt_fd(CFWTCPSocket *sock, int fd)
+{
+	if (sock->fd != -1 || fd < 0)
+		return false;
+
+	sock->fd = fd;
+	sock->at_end = false;
+
+	return true;
 }
 
 static CFWClass class = {
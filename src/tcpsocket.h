@@ -27,9 +27,19 @@
 #ifndef __COREFW_TCPSOCKET_H__
 #define __COREFW_TCPSOCKET_H__
 
+enum {
+	CFW_TCPSOCKET_NODELAY = 1,
+	CFW_TCPSOCKET_QUICKACK = 2
+};
+
 typedef struct CFWTCPSocket CFWTCPSocket;
 
 extern CFWClass *cfw_tcpsocket;
+extern bool cfw_tcpsocket_set_options(CFWTCPSocket*, int);
+extern bool cfw_tcpsocket_set_keepalive(CFWTCPSocket*, int, int, int);
+extern bool cfw_tcpsocket_set_buffer_sizes(CFWTCPSocket*, int, int);
+extern void cfw_tcpsocket_set_connect_timeouts(CFWTCPSocket*, int, int);
 extern bool cfw_tcpsocket_connect(CFWTCPSocket*, const char*, uint16_t);
+extern bool cfw_tcpsocket_adopt_fd(CFWTCPSocket*, int);
 
 #endif
@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) 2012, Jonathan Schleifer <js@webkeks.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__) && defined(__GNUC__)
+# include <emmintrin.h>
+# define HAVE_X86
+#endif
+
+#include "tokenizer.h"
+#include "search.h"
+
+void
+cfw_tokenize(cfw_tokenizer_t *tok, const void *buf, size_t len,
+    const char *delim)
+{
+	tok->token = NULL;
+	tok->len = 0;
+	tok->_pos = tok->_scan = tok->_block = buf;
+	tok->_end = tok->_pos + len;
+	tok->_delim = delim;
+	tok->_delim_len = strlen(delim);
+	tok->_mask = 0;
+	tok->_done = false;
+}
+
+void
+cfw_tokenize_string(cfw_tokenizer_t *tok, CFWString *str, const char *delim)
+{
+	cfw_tokenize(tok, cfw_string_c(str), cfw_string_length(str), delim);
+}
+
+/*
+ * Single byte delimiters are found by keeping a bit mask of all matches in
+ * the current 16 byte block, so short fields don't rescan anything.
+ */
+static const char*
+next_byte(cfw_tokenizer_t *tok)
+{
+#ifdef HAVE_X86
+	const __m128i delim = _mm_set1_epi8(tok->_delim[0]);
+	size_t i, n;
+
+	for (;;) {
+		if (tok->_mask != 0) {
+			const char *ret = tok->_block + __builtin_ctz(tok->_mask);
+
+			tok->_mask &= tok->_mask - 1;
+			return ret;
+		}
+
+		if (tok->_scan == tok->_end)
+			return NULL;
+
+		tok->_block = tok->_scan;
+
+		if ((n = tok->_end - tok->_scan) >= 16) {
+			tok->_mask = _mm_movemask_epi8(_mm_cmpeq_epi8(
+			    _mm_loadu_si128((const __m128i*)tok->_scan), delim));
+			tok->_scan += 16;
+			continue;
+		}
+
+		for (i = 0; i < n; i++)
+			if (tok->_scan[i] == tok->_delim[0])
+				tok->_mask |= (uint32_t)1 << i;
+
+		tok->_scan = tok->_end;
+	}
+#else
+	return memchr(tok->_pos, tok->_delim[0], tok->_end - tok->_pos);
+#endif
+}
+
+bool
+cfw_tokenizer_next(cfw_tokenizer_t *tok)
+{
+	const char *found = NULL;
+	size_t pos;
+
+	if (tok->_done)
+		return false;
+
+	if (tok->_delim_len == 1)
+		found = next_byte(tok);
+	else if (tok->_delim_len > 1) {
+		pos = cfw_memmem(tok->_pos, tok->_end - tok->_pos,
+		    tok->_delim, tok->_delim_len);
+
+		if (pos != SIZE_MAX)
+			found = tok->_pos + pos;
+	}
+
+	tok->token = tok->_pos;
+
+	if (found == NULL) {
+		tok->len = tok->_end - tok->_pos;
+		tok->_done = true;
+
+		return true;
+	}
+
+	tok->len = found - tok->_pos;
+	tok->_pos = found + tok->_delim_len;
+
+	return true;
+}
@@ -0,0 +1,330 @@
+/*
+ * Copyright (c) 2012, Jonathan Schleifer <js@webkeks.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__) && defined(__GNUC__)
+# include <immintrin.h>
+# define HAVE_X86
+#endif
+
+#include "utf8.h"
+
+/* Returns the length of the sequence at s, or 0 if it is invalid */
+static size_t
+sequence(const unsigned char *s, size_t len)
+{
+	unsigned char lo = 0x80, hi = 0xBF;
+	size_t i, n;
+
+	if (s[0] >= 0xC2 && s[0] <= 0xDF)
+		n = 2;
+	else if (s[0] >= 0xE0 && s[0] <= 0xEF) {
+		n = 3;
+
+		/* Overlong forms and surrogates */
+		if (s[0] == 0xE0)
+			lo = 0xA0;
+		else if (s[0] == 0xED)
+			hi = 0x9F;
+	} else if (s[0] >= 0xF0 && s[0] <= 0xF4) {
+		n = 4;
+
+		/* Overlong forms and anything above U+10FFFF */
+		if (s[0] == 0xF0)
+			lo = 0x90;
+		else if (s[0] == 0xF4)
+			hi = 0x8F;
+	} else
+		return 0;
+
+	if (len < n || s[1] < lo || s[1] > hi)
+		return 0;
+
+	for (i = 2; i < n; i++)
+		if ((s[i] & 0xC0) != 0x80)
+			return 0;
+
+	return n;
+}
+
+static bool
+valid_scalar(const unsigned char *s, size_t len)
+{
+	size_t i = 0, n;
+
+	while (i < len) {
+		if (s[i] < 0x80) {
+			uint64_t word;
+
+			while (i + 8 <= len) {
+				memcpy(&word, s + i, 8);
+
+				if (word & UINT64_C(0x8080808080808080))
+					break;
+
+				i += 8;
+			}
+
+			while (i < len && s[i] < 0x80)
+				i++;
+
+			continue;
+		}
+
+		if ((n = sequence(s + i, len - i)) == 0)
+			return false;
+
+		i += n;
+	}
+
+	return true;
+}
+
+#ifdef HAVE_X86
+/*
+ * Lookup validation after Keiser and Lemire, "Validating UTF-8 In Less
+ * Than One Instruction Per Byte". Each error class is a bit; a byte pair
+ * is invalid if the nibble tables agree on one.
+ */
+# define TOO_SHORT	(1 << 0)
+# define TOO_LONG	(1 << 1)
+# define OVERLONG_3	(1 << 2)
+# define TOO_LARGE	(1 << 3)
+# define SURROGATE	(1 << 4)
+# define OVERLONG_2	(1 << 5)
+# define TOO_LARGE_1000	(1 << 6)
+# define OVERLONG_4	(1 << 6)
+# define TWO_CONTS	(1 << 7)
+# define CARRY		(TOO_SHORT | TOO_LONG | TWO_CONTS)
+# define B(x)		((char)(x))
+# define TABLE(a, b, c, d, e, f, g, h, i, j, k, l, m, n, o, p)	\
+	_mm256_setr_epi8(B(a), B(b), B(c), B(d), B(e), B(f), B(g),	\
+	    B(h), B(i), B(j), B(k), B(l), B(m), B(n), B(o), B(p),	\
+	    B(a), B(b), B(c), B(d), B(e), B(f), B(g), B(h), B(i), B(j),	\
+	    B(k), B(l), B(m), B(n), B(o), B(p))
+
+__attribute__((__target__("avx2")))
+static bool
+valid_avx2(const unsigned char *s, size_t len)
+{
+	const __m256i byte_1_high = TABLE(
+	    TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+	    TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+	    TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+	    TOO_SHORT | OVERLONG_2,
+	    TOO_SHORT,
+	    TOO_SHORT | OVERLONG_3 | SURROGATE,
+	    TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4);
+	const __m256i byte_1_low = TABLE(
+	    CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+	    CARRY | OVERLONG_2,
+	    CARRY,
+	    CARRY,
+	    CARRY | TOO_LARGE,
+	    CARRY | TOO_LARGE | TOO_LARGE_1000,
+	    CARRY | TOO_LARGE | TOO_LARGE_1000,
+	    CARRY | TOO_LARGE | TOO_LARGE_1000,
+	    CARRY | TOO_LARGE | TOO_LARGE_1000,
+	    CARRY | TOO_LARGE | TOO_LARGE_1000,
+	    CARRY | TOO_LARGE | TOO_LARGE_1000,
+	    CARRY | TOO_LARGE | TOO_LARGE_1000,
+	    CARRY | TOO_LARGE | TOO_LARGE_1000,
+	    CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+	    CARRY | TOO_LARGE | TOO_LARGE_1000,
+	    CARRY | TOO_LARGE | TOO_LARGE_1000);
+	const __m256i byte_2_high = TABLE(
+	    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+	    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+	    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 |
+	    OVERLONG_4,
+	    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+	    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+	    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+	    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT);
+	/* A block must not end in the middle of a sequence */
+	const __m256i max_value = _mm256_setr_epi8(
+	    B(0xFF), B(0xFF), B(0xFF), B(0xFF), B(0xFF), B(0xFF), B(0xFF),
+	    B(0xFF), B(0xFF), B(0xFF), B(0xFF), B(0xFF), B(0xFF), B(0xFF),
+	    B(0xFF), B(0xFF), B(0xFF), B(0xFF), B(0xFF), B(0xFF), B(0xFF),
+	    B(0xFF), B(0xFF), B(0xFF), B(0xFF), B(0xFF), B(0xFF), B(0xFF),
+	    B(0xFF), B(0xEF), B(0xDF), B(0xBF));
+	const __m256i nibble = _mm256_set1_epi8(0x0F);
+	__m256i prev = _mm256_setzero_si256();
+	__m256i incomplete = _mm256_setzero_si256();
+	__m256i error = _mm256_setzero_si256();
+	unsigned char tail[32];
+	size_t i;
+
+	for (i = 0; i < len; i += 32) {
+		__m256i in, shifted, prev1, prev2, prev3, special, must23;
+
+		if (len - i >= 32)
+			in = _mm256_loadu_si256((const __m256i*)(s + i));
+		else {
+			/* Zero padding makes a truncated sequence TOO_SHORT */
+			memset(tail, 0, sizeof(tail));
+			memcpy(tail, s + i, len - i);
+			in = _mm256_loadu_si256((const __m256i*)tail);
+		}
+
+		if (_mm256_movemask_epi8(in) == 0) {
+			error = _mm256_or_si256(error, incomplete);
+			incomplete = _mm256_setzero_si256();
+			prev = in;
+			continue;
+		}
+
+		shifted = _mm256_permute2x128_si256(prev, in, 0x21);
+		prev1 = _mm256_alignr_epi8(in, shifted, 15);
+		prev2 = _mm256_alignr_epi8(in, shifted, 14);
+		prev3 = _mm256_alignr_epi8(in, shifted, 13);
+
+		special = _mm256_and_si256(_mm256_and_si256(
+		    _mm256_shuffle_epi8(byte_1_high, _mm256_and_si256(
+		    _mm256_srli_epi16(prev1, 4), nibble)),
+		    _mm256_shuffle_epi8(byte_1_low,
+		    _mm256_and_si256(prev1, nibble))),
+		    _mm256_shuffle_epi8(byte_2_high, _mm256_and_si256(
+		    _mm256_srli_epi16(in, 4), nibble)));
+
+		/* Bytes two or three after a 3 or 4 byte lead */
+		must23 = _mm256_and_si256(_mm256_or_si256(
+		    _mm256_subs_epu8(prev2, _mm256_set1_epi8(0xE0 - 0x80)),
+		    _mm256_subs_epu8(prev3, _mm256_set1_epi8(0xF0 - 0x80))),
+		    _mm256_set1_epi8(B(0x80)));
+
+		error = _mm256_or_si256(error, _mm256_xor_si256(must23, special));
+		incomplete = _mm256_subs_epu8(in, max_value);
+		prev = in;
+	}
+
+	error = _mm256_or_si256(error, incomplete);
+
+	return _mm256_testz_si256(error, error);
+}
+
+static bool valid_dispatch(const unsigned char*, size_t);
+static bool (*valid_simd)(const unsigned char*, size_t) = valid_dispatch;
+
+static bool
+valid_dispatch(const unsigned char *s, size_t len)
+{
+	bool (*func)(const unsigned char*, size_t);
+
+	__builtin_cpu_init();
+	func = (__builtin_cpu_supports("avx2") ? valid_avx2 : valid_scalar);
+	__atomic_store_n(&valid_simd, func, __ATOMIC_RELAXED);
+
+	return func(s, len);
+}
+#endif
+
+bool
+cfw_utf8_valid(const void *buf, size_t len)
+{
+#ifdef HAVE_X86
+	return __atomic_load_n(&valid_simd, __ATOMIC_RELAXED)(buf, len);
+#else
+	return valid_scalar(buf, len);
+#endif
+}
+
+/*
+ * Both of the following count lead bytes, i.e. everything that is not a
+ * continuation byte. As signed chars, continuation bytes are -128 to -65.
+ */
+size_t
+cfw_utf8_length(const void *buf, size_t len)
+{
+	const unsigned char *s = buf;
+	size_t i = 0, count = 0;
+
+#ifdef HAVE_X86
+	const __m128i cont = _mm_set1_epi8(-65);
+
+	while (i + 16 <= len) {
+		__m128i acc = _mm_setzero_si128();
+		unsigned n;
+
+		/* Byte counters in acc must not wrap */
+		for (n = 0; n < 255 && i + 16 <= len; n++, i += 16)
+			acc = _mm_sub_epi8(acc, _mm_cmpgt_epi8(_mm_loadu_si128(
+			    (const __m128i*)(s + i)), cont));
+
+		acc = _mm_sad_epu8(acc, _mm_setzero_si128());
+		count += _mm_cvtsi128_si32(acc) +
+		    _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+	}
+#endif
+
+	for (; i < len; i++)
+		if ((s[i] & 0xC0) != 0x80)
+			count++;
+
+	return count;
+}
+
+size_t
+cfw_utf8_offset(const void *buf, size_t len, size_t index)
+{
+	const unsigned char *s = buf;
+	size_t i = 0;
+
+#ifdef HAVE_X86
+	const __m128i cont = _mm_set1_epi8(-65);
+
+	for (; i + 16 <= len; i += 16) {
+		unsigned mask, count;
+
+		mask = _mm_movemask_epi8(_mm_cmpgt_epi8(
+		    _mm_loadu_si128((const __m128i*)(s + i)), cont));
+		count = __builtin_popcount(mask);
+
+		if (index < count) {
+			for (; index > 0; index--)
+				mask &= mask - 1;
+
+			return i + __builtin_ctz(mask);
+		}
+
+		index -= count;
+	}
+#endif
+
+	for (; i < len; i++) {
+		if ((s[i] & 0xC0) == 0x80)
+			continue;
+
+		if (index == 0)
+			return i;
+
+		index--;
+	}
+
+	return (index == 0 ? len : SIZE_MAX);
+}
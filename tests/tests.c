@@ -24,14 +24,1783 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <float.h>
+#include <math.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+
+#include <sys/socket.h>
+
+#include "object.h"
+#include "refpool.h"
+#include "string.h"
+#include "stringbuilder.h"
+#include "int.h"
+#include "array.h"
+#include "map.h"
+#include "executor.h"
+#include "queue.h"
+#include "rope.h"
+#include "regex.h"
+#include "stringview.h"
+#include "tcpserver.h"
+#include "tcpsocket.h"
+#include "stream.h"
+#include "number.h"
+#include "mappedfile.h"
+#include "file.h"
+#include "ioring.h"
+#include "lzstream.h"
+#include "runloop.h"
+#include "connpool.h"
+#include "utf8.h"
+#include "search.h"
+#include "matcher.h"
+#include "tokenizer.h"
+
+static int failures = 0;
+
+static const struct {
+	double value;
+	const char *str;
+} format_cases[] = {
+	{ 0x1p-1074, "5e-324" },
+	{ 0x1p-1022, "2.2250738585072014e-308" },
+	{ 0x0.fffffffffffffp-1022, "2.225073858507201e-308" },
+	{ DBL_MAX, "1.7976931348623157e+308" },
+	{ 0.1, "0.1" },
+	{ -0.0, "-0" },
+	{ 1e16, "1e+16" },
+	{ 1e15, "1000000000000000" },
+	{ 1e-5, "1e-05" },
+	{ 0.0001, "0.0001" }
+};
+
+/* used is how much of str must be consumed, 0 meaning none may be */
+static const struct {
+	const char *str;
+	size_t used;
+	double value;
+} parse_cases[] = {
+	{ "4.9406564584124654e-324", 23, 0x1p-1074 },
+	/* Just below and above 2^-1075, which is halfway to the first one */
+	{ "2.4703282292062327e-324", 23, 0.0 },
+	{ "2.4703282292062328e-324", 23, 0x1p-1074 },
+	{ "2.47032822920623272088284396434110686182529901307162382212792"
+	  "84125033775363510437593264991e-324", 95, 0.0 },
+	{ "2.47032822920623272088284396434110686182529901307162382212792"
+	  "84125033775363510437593264992e-324", 95, 0x1p-1074 },
+	{ "9007199254740993", 16, 0x1p53 },
+	{ "9007199254740995", 16, 0x1p53 + 4 },
+	{ "1.7976931348623157e308", 22, DBL_MAX },
+	{ "1.7976931348623158e308", 22, DBL_MAX },
+	{ "1.7976931348623159e308", 22, HUGE_VAL },
+	{ "-1e400", 6, -HUGE_VAL },
+	{ "1e-400", 6, 0.0 },
+	{ "1e", 1, 1.0 },
+	{ "1e+", 1, 1.0 },
+	{ ".5", 2, 0.5 },
+	{ "5.", 2, 5.0 },
+	{ "+.5e1x", 5, 5.0 },
+	{ ".", 0, 0.0 },
+	{ "-", 0, 0.0 },
+	{ "e5", 0, 0.0 }
+};
+
+static void
+check(bool ok, const char *what)
+{
+	if (!ok) {
+		printf("FAILED: %s\n", what);
+		failures++;
+	}
+}
+
+/* Width and precision are not limited, only floats need a buffer */
+static void
+check_format(void)
+{
+	static char long_str[1200];
+	char expected[1200];
+	CFWString *str;
+
+	memset(long_str, 'x', sizeof(long_str) - 1);
+
+	str = cfw_new(cfw_string, (void*)NULL);
+	cfw_string_append_format(str, "%.1000s|%300d|%-300u|", long_str, 1, 2u);
+	check(cfw_string_length(str) == 1603 &&
+	    cfw_string_c(str)[1300] == '1' && cfw_string_c(str)[1302] == '2',
+	    "%.1000s %300d %-300u");
+
+	cfw_string_set(str, NULL);
+	cfw_string_append_format(str, "%.1000f", 1.0 / 3);
+	snprintf(expected, sizeof(expected), "%.1000f", 1.0 / 3);
+	check(cfw_string_length(str) == 1002 &&
+	    !strcmp(cfw_string_c(str), expected), "%.1000f");
+
+	check(!cfw_string_append_format(str, "%99999999999d", 1),
+	    "%99999999999d");
+
+	cfw_unref(str);
+}
+
+/* Returns a connected client and the server's side, both autoreleased */
+static bool
+connect_pair(CFWTCPSocket **client, CFWTCPSocket **peer)
+{
+	CFWTCPServer *server = cfw_create(cfw_tcpserver);
+
+	if (!cfw_tcpserver_listen(server, "127.0.0.1", 0, 0))
+		return false;
+
+	*client = cfw_create(cfw_tcpsocket);
+	if (!cfw_tcpsocket_connect(*client, "127.0.0.1",
+	    cfw_tcpserver_port(server)))
+		return false;
+
+	return ((*peer = cfw_tcpserver_accept(server)) != NULL);
+}
+
+/* Nothing listens on the other family's port, so that attempt is refused */
+static void
+check_connect_fallback(void)
+{
+	struct addrinfo hints, *res0, *last;
+	CFWTCPServer *server = cfw_create(cfw_tcpserver);
+	CFWTCPSocket *client = cfw_create(cfw_tcpsocket), *peer;
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof(addr);
+	char host[64];
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if (getaddrinfo("localhost", NULL, &hints, &res0))
+		return;
+
+	for (last = res0; last->ai_next != NULL; last = last->ai_next);
+
+	/* Only a resolver returning both families gives something to race */
+	if (last->ai_family == res0->ai_family || getnameinfo(last->ai_addr,
+	    last->ai_addrlen, host, sizeof(host), NULL, 0, NI_NUMERICHOST)) {
+		freeaddrinfo(res0);
+		return;
+	}
+
+	check(cfw_tcpserver_listen(server, host, 0, 0) &&
+	    cfw_tcpsocket_connect(client, "localhost",
+	    cfw_tcpserver_port(server)) &&
+	    (peer = cfw_tcpserver_accept(server)) != NULL &&
+	    getsockname(cfw_stream_fd(client), (struct sockaddr*)&addr,
+	    &len) == 0 && addr.ss_family == last->ai_family,
+	    "connect after refused address");
+
+	freeaddrinfo(res0);
+}
+
+/* A full backlog makes further connections hang until they time out */
+static void
+check_connect(void)
+{
+	CFWRefPool *pool = cfw_new(cfw_refpool);
+	CFWTCPServer *server = cfw_create(cfw_tcpserver);
+	CFWTCPSocket *sock;
+	uint16_t port;
+	size_t i;
+
+	if (!cfw_tcpserver_listen(server, "127.0.0.1", 0, 1)) {
+		check(false, "listen");
+		cfw_unref(pool);
+		return;
+	}
+	port = cfw_tcpserver_port(server);
+
+	/* How many fit into the backlog is up to the system */
+	for (i = 0; i < 16; i++) {
+		sock = cfw_create(cfw_tcpsocket);
+		cfw_tcpsocket_set_connect_timeouts(sock, 100, 0);
+
+		if (!cfw_tcpsocket_connect(sock, "127.0.0.1", port))
+			break;
+	}
+	check(i < 16 && errno == ETIMEDOUT, "fill backlog");
+
+	sock = cfw_create(cfw_tcpsocket);
+	cfw_tcpsocket_set_connect_timeouts(sock, 1, 0);
+	check(!cfw_tcpsocket_connect(sock, "127.0.0.1", port) &&
+	    errno == ETIMEDOUT, "connect timeout");
+
+	sock = cfw_create(cfw_tcpsocket);
+	cfw_tcpsocket_set_connect_timeouts(sock, 0, 50);
+	check(!cfw_tcpsocket_connect(sock, "127.0.0.1", port) &&
+	    errno == ETIMEDOUT, "attempt timeout");
+
+	check_connect_fallback();
+
+	cfw_unref(pool);
+}
+
+/* Closing again must not close a descriptor that was reused meanwhile */
+static void
+check_close(void)
+{
+	CFWRefPool *pool = cfw_new(cfw_refpool);
+	CFWTCPSocket *client, *peer;
+	int fds[2];
+	char c;
+
+	if (!connect_pair(&client, &peer) || pipe(fds) == -1) {
+		check(false, "connect_pair");
+		cfw_unref(pool);
+		return;
+	}
+	close(fds[0]);
+	close(fds[1]);
+
+	cfw_stream_close(peer);
+	if (pipe(fds) == -1) {
+		check(false, "pipe");
+		cfw_unref(pool);
+		return;
+	}
+	cfw_stream_close(peer);
+
+	check(cfw_stream_fd(peer) == -1 && write(fds[1], "x", 1) == 1 &&
+	    read(fds[0], &c, 1) == 1, "close twice");
+	close(fds[0]);
+	close(fds[1]);
+
+	cfw_unref(pool);
+}
+
+/* A line that never ends must not grow the buffer without bound */
+static void
+check_line_limit(void)
+{
+	CFWRefPool *pool = cfw_new(cfw_refpool);
+	CFWTCPSocket *client, *peer;
+	char buf[1000];
+	size_t i;
+
+	if (!connect_pair(&client, &peer)) {
+		check(false, "connect_pair");
+		cfw_unref(pool);
+		return;
+	}
+
+	memset(buf, 'x', sizeof(buf));
+	for (i = 0; i < 40; i++)
+		cfw_stream_write(client, buf, sizeof(buf));
+	cfw_stream_flush(client);
+
+	cfw_stream_set_read_buffer_limit(peer, 16384);
+	check(cfw_stream_read_line(peer) == NULL && errno == EMSGSIZE &&
+	    cfw_stream_read_buffer_size(peer) == 16384, "read buffer limit");
+
+	cfw_unref(pool);
+}
+
+struct line_writer {
+	int fd;
+	CFWString **parts;
+	size_t cnt;
+};
+
+/* Pauses between parts, so that the reader sees each one on its own */
+static void
+write_parts(void *ctx)
+{
+	struct line_writer *writer = ctx;
+	struct timespec pause = { 0, 10000000 };
+	size_t i, done;
+	ssize_t ret;
+
+	for (i = 0; i < writer->cnt; i++) {
+		const char *data = cfw_string_c(writer->parts[i]);
+		size_t len = cfw_string_length(writer->parts[i]);
+
+		for (done = 0; done < len; done += ret)
+			if ((ret = write(writer->fd, data + done,
+			    len - done)) <= 0)
+				goto out;
+
+		nanosleep(&pause, NULL);
+	}
+
+out:
+	close(writer->fd);
+}
+
+/*
+ * Returns every line read from a pipe the parts are written to, each followed
+ * by a '|'.
+ */
+static CFWString*
+read_lines(CFWString **parts, size_t cnt, const char *delim, bool into)
+{
+	CFWExecutor *executor;
+	CFWTaskGroup *group;
+	struct line_writer writer;
+	cfw_stream_line_iter_t iter;
+	CFWString *ret, *line;
+	CFWFile *in;
+	char path[32];
+	int fds[2];
+
+	if (pipe(fds) == -1)
+		return NULL;
+
+	snprintf(path, sizeof(path), "/dev/fd/%d", fds[0]);
+	in = cfw_new(cfw_file, path, "r");
+	close(fds[0]);
+
+	executor = cfw_new(cfw_executor, (size_t)1);
+	group = cfw_new(cfw_taskgroup, executor);
+	ret = cfw_new(cfw_string, (void*)NULL);
+	line = cfw_new(cfw_string, (void*)NULL);
+
+	writer.fd = fds[1];
+	writer.parts = parts;
+	writer.cnt = cnt;
+	if (!cfw_executor_submit(executor, group, write_parts, &writer))
+		close(fds[1]);
+
+	/* A line is only valid until the next one is read, which may slide */
+	if (into)
+		while (cfw_stream_read_line_into(in, line, delim)) {
+			cfw_string_append(ret, line);
+			cfw_string_append_c(ret, "|");
+		}
+	else {
+		cfw_stream_line_iter(in, &iter, delim);
+		while (cfw_stream_line_iter_next(&iter)) {
+			cfw_string_append_buf(ret, iter.line, iter.len);
+			cfw_string_append_c(ret, "|");
+		}
+	}
+
+	cfw_taskgroup_join(group);
+	cfw_unref(group);
+	cfw_unref(executor);
+	cfw_unref(line);
+	cfw_unref(in);
+
+	return ret;
+}
+
+static bool
+lines_are(CFWString **parts, size_t cnt, const char *delim, bool into,
+    CFWString *expected)
+{
+	CFWString *lines = read_lines(parts, cnt, delim, into);
+	bool ret = cfw_equal(lines, expected);
+
+	cfw_unref(lines);
+
+	return ret;
+}
+
+/* Lines longer than the buffer and delimiters split between two reads */
+static void
+check_lines(void)
+{
+	CFWRefPool *pool = cfw_new(cfw_refpool);
+	CFWString *parts[4], *big, *expected;
+	unsigned i;
+
+	big = cfw_create(cfw_string, (void*)NULL);
+	for (i = 0; i < 2 * CFW_STREAM_BUFSIZE + 1000; i++)
+		cfw_string_append_buf(big, &"abcdefghijklmnopqrstuvwxyz"[i % 26],
+		    1);
+
+	/* The many short lines straddle refills of the buffer */
+	parts[0] = cfw_create(cfw_string, "one\r");
+	parts[1] = cfw_create(cfw_string, "\n");
+	cfw_string_append(parts[1], big);
+	cfw_string_append_c(parts[1], "\r\n");
+	expected = cfw_create(cfw_string, "one|");
+	cfw_string_append(expected, big);
+	cfw_string_append_c(expected, "|");
+	for (i = 0; i < 1000; i++) {
+		cfw_string_append_format(parts[1], "line %u\r\n", i);
+		cfw_string_append_format(expected, "line %u|", i);
+	}
+	cfw_string_append_c(parts[1], "last\r");
+	parts[2] = cfw_create(cfw_string, "\nlf only\n\r\n");
+	parts[3] = cfw_create(cfw_string, "tail");
+	cfw_string_append_c(expected, "last|lf only||tail|");
+	check(lines_are(parts, 4, NULL, false, expected), "line iterator");
+	check(lines_are(parts, 4, NULL, true, expected), "read_line_into");
+
+	/* Only the delimiter is removed when one is given */
+	parts[0] = cfw_create(cfw_string, "a\r");
+	parts[1] = cfw_create(cfw_string, "\nb\r\r\n");
+	cfw_string_append(parts[1], big);
+	cfw_string_append_c(parts[1], "\r");
+	parts[2] = cfw_create(cfw_string, "\n\rc\n");
+	expected = cfw_create(cfw_string, "a|b\r|");
+	cfw_string_append(expected, big);
+	cfw_string_append_c(expected, "|\rc\n|");
+	check(lines_are(parts, 3, "\r\n", false, expected),
+	    "line iterator with \\r\\n");
+	check(lines_are(parts, 3, "\r\n", true, expected),
+	    "read_line_into with \\r\\n");
+
+	parts[0] = cfw_create(cfw_string, "x<");
+	parts[1] = cfw_create(cfw_string, "=");
+	parts[2] = cfw_create(cfw_string, ">y<=");
+	parts[3] = cfw_create(cfw_string, "><=><z");
+	expected = cfw_create(cfw_string, "x|y||<z|");
+	check(lines_are(parts, 4, "<=>", false, expected),
+	    "line iterator with <=>");
+	check(lines_are(parts, 4, "<=>", true, expected),
+	    "read_line_into with <=>");
+
+	cfw_unref(pool);
+}
+
+#define SHORT_WRITEV 1000
+
+/* Accepts no more than SHORT_WRITEV bytes per call, like a full pipe */
+static ssize_t
+short_writev(void *ptr, const struct iovec *iov, int cnt)
+{
+	struct iovec vec[1024];
+	size_t total = 0;
+	int n;
+
+	for (n = 0; n < cnt && n < 1024 && total < SHORT_WRITEV; n++) {
+		vec[n] = iov[n];
+
+		if (vec[n].iov_len > SHORT_WRITEV - total)
+			vec[n].iov_len = SHORT_WRITEV - total;
+		total += vec[n].iov_len;
+	}
+
+	return writev(cfw_stream_fd(ptr), vec, n);
+}
+
+struct vec_reader {
+	CFWFile *in;
+	char *buf;
+	size_t size, len;
+};
+
+/* Scatters into three vectors, so that a read ends in each of them */
+static void
+read_vecs(void *ctx)
+{
+	struct vec_reader *reader = ctx;
+	struct iovec iov[3];
+	size_t left;
+	ssize_t ret;
+
+	while ((left = reader->size - reader->len) > 0) {
+		iov[0].iov_base = reader->buf + reader->len;
+		iov[0].iov_len = (left < 7 ? left : 7);
+		iov[1].iov_base = (char*)iov[0].iov_base + iov[0].iov_len;
+		iov[1].iov_len = (left - iov[0].iov_len > 0 ? 1 : 0);
+		iov[2].iov_base = (char*)iov[1].iov_base + iov[1].iov_len;
+		iov[2].iov_len = left - iov[0].iov_len - iov[1].iov_len;
+
+		if ((ret = cfw_stream_readv(reader->in, iov, 3)) <= 0)
+			break;
+
+		reader->len += ret;
+	}
+}
+
+#define VEC_CNT 300
+
+/*
+ * Writes many more vectors than fit into one call, after something already
+ * buffered, to a pipe read with cfw_stream_readv.
+ */
+static bool
+writev_round_trip(ssize_t (*writev_fn)(void*, const struct iovec*, int))
+{
+	static char data[VEC_CNT * 1500], head[2000];
+	struct cfw_stream_ops ops;
+	struct iovec iov[VEC_CNT];
+	struct vec_reader reader;
+	CFWExecutor *executor;
+	CFWTaskGroup *group;
+	CFWFile *out;
+	char path[32];
+	size_t i, len;
+	int fds[2];
+	bool ret;
+
+	if (pipe(fds) == -1)
+		return false;
+
+	snprintf(path, sizeof(path), "/dev/fd/%d", fds[0]);
+	reader.in = cfw_new(cfw_file, path, "r");
+	close(fds[0]);
+	snprintf(path, sizeof(path), "/dev/fd/%d", fds[1]);
+	out = cfw_new(cfw_file, path, "w");
+	close(fds[1]);
+
+	if (reader.in == NULL || out == NULL) {
+		cfw_unref(reader.in);
+		cfw_unref(out);
+		return false;
+	}
+
+	ops = *((CFWStream*)out)->ops;
+	ops.writev = writev_fn;
+	((CFWStream*)out)->ops = &ops;
+
+	memset(head, '#', sizeof(head));
+	for (i = 0; i < sizeof(data); i++)
+		data[i] = i * 13 % 251;
+
+	/* Some vectors are empty, all of them more than the pipe holds */
+	for (i = len = 0; i < VEC_CNT; i++) {
+		iov[i].iov_base = data + len;
+		iov[i].iov_len = i * 37 % 1500;
+		len += iov[i].iov_len;
+	}
+
+	reader.size = sizeof(head) + len + 1;
+	reader.len = 0;
+	if ((reader.buf = malloc(reader.size)) == NULL) {
+		cfw_unref(reader.in);
+		cfw_unref(out);
+		return false;
+	}
+
+	executor = cfw_new(cfw_executor, (size_t)1);
+	group = cfw_new(cfw_taskgroup, executor);
+	cfw_executor_submit(executor, group, read_vecs, &reader);
+
+	ret = (cfw_stream_write(out, head, sizeof(head)) &&
+	    cfw_stream_writev(out, iov, VEC_CNT) && cfw_stream_flush(out));
+	/* Closing the pipe is what ends the reader */
+	cfw_unref(out);
+
+	cfw_taskgroup_join(group);
+	cfw_unref(group);
+	cfw_unref(executor);
+
+	ret = (ret && reader.len == sizeof(head) + len &&
+	    !memcmp(reader.buf, head, sizeof(head)) &&
+	    !memcmp(reader.buf + sizeof(head), data, len));
+
+	free(reader.buf);
+	cfw_unref(reader.in);
+
+	return ret;
+}
+
+static void
+check_writev(void)
+{
+	check(writev_round_trip(short_writev), "short writev");
+	check(writev_round_trip(NULL), "emulated writev");
+}
+
+#define COPY_SIZE (8 * 1024 * 1024)
+
+static bool
+same_contents(const char *path, const char *data, size_t len)
+{
+	CFWMappedFile *mf = cfw_new(cfw_mappedfile, path, 0);
+	bool ret;
+
+	ret = (mf != NULL && cfw_mappedfile_length(mf) == len &&
+	    !memcmp(cfw_mappedfile_data(mf), data, len));
+	cfw_unref(mf);
+
+	return ret;
+}
+
+/* File to file, through a pipe and to a socket whose peer has gone */
+static void
+check_copy(void)
+{
+	CFWRefPool *pool = cfw_new(cfw_refpool);
+	char src_path[] = "/tmp/corefw-XXXXXX", dst_path[] = "/tmp/corefw-XXXXXX";
+	char pipe_path[32], *data;
+	CFWTCPSocket *client, *peer;
+	CFWFile *src, *dst, *pipe_in, *pipe_out;
+	int src_fd, dst_fd, fds[2];
+	size_t i;
+
+	if ((data = malloc(COPY_SIZE)) == NULL)
+		return;
+
+	for (i = 0; i < COPY_SIZE; i++)
+		data[i] = i * 7 % 251;
+
+	if ((src_fd = mkstemp(src_path)) == -1 ||
+	    write(src_fd, data, COPY_SIZE) != COPY_SIZE ||
+	    (dst_fd = mkstemp(dst_path)) == -1) {
+		check(false, "mkstemp");
+		goto out;
+	}
+	close(src_fd);
+	close(dst_fd);
+
+	/* Streams are released rather than closed, so they close only once */
+	src = cfw_new(cfw_file, src_path, "r");
+	dst = cfw_new(cfw_file, dst_path, "w");
+	check(cfw_stream_copy(dst, src, SIZE_MAX) == COPY_SIZE,
+	    "copy file to file");
+	cfw_unref(src);
+	cfw_unref(dst);
+	check(same_contents(dst_path, data, COPY_SIZE), "copied file");
+
+	/* Small enough to fit into the pipe without a reader */
+	if (pipe(fds) == -1) {
+		check(false, "pipe");
+		goto out;
+	}
+
+	snprintf(pipe_path, sizeof(pipe_path), "/dev/fd/%d", fds[1]);
+	pipe_out = cfw_new(cfw_file, pipe_path, "w");
+	close(fds[1]);
+	snprintf(pipe_path, sizeof(pipe_path), "/dev/fd/%d", fds[0]);
+	pipe_in = cfw_new(cfw_file, pipe_path, "r");
+	close(fds[0]);
+
+	src = cfw_new(cfw_file, src_path, "r");
+	dst = cfw_new(cfw_file, dst_path, "w");
+	check(cfw_stream_copy(pipe_out, src, 32768) == 32768, "copy to pipe");
+	cfw_unref(pipe_out);
+	check(cfw_stream_copy(dst, pipe_in, SIZE_MAX) == 32768,
+	    "copy from pipe");
+	cfw_unref(pipe_in);
+	cfw_unref(src);
+	cfw_unref(dst);
+	check(same_contents(dst_path, data, 32768), "copied pipe");
+
+	/* Must fail with EPIPE instead of being killed by SIGPIPE */
+	if (connect_pair(&client, &peer)) {
+		cfw_stream_close(peer);
+		src = cfw_new(cfw_file, src_path, "r");
+		check(cfw_stream_copy(client, src, COPY_SIZE) < COPY_SIZE,
+		    "copy to closed socket");
+		cfw_unref(src);
+	} else
+		check(false, "connect_pair");
+
+out:
+	unlink(src_path);
+	unlink(dst_path);
+	free(data);
+	cfw_unref(pool);
+}
+
+static void
+check_mapped_lines(CFWMappedFile *mf, const char *what)
+{
+	static const char *lines[] = { "one", "two", "", "three" };
+	cfw_mappedfile_line_iter_t iter;
+	size_t i = 0;
+	bool ok = true;
+
+	cfw_mappedfile_line_iter(mf, &iter, NULL);
+	while (cfw_mappedfile_line_iter_next(&iter))
+		ok = ok && i < 4 && iter.len == strlen(lines[i]) &&
+		    !memcmp(iter.line, lines[i++], iter.len);
+
+	check(ok && i == 4, what);
+}
+
+/* Regular files are mapped, pipes are read in full */
+/* Must stay followed by a NUL when the file grows */
+static bool
+mapped_after_append(size_t len)
+{
+	char path[] = "/tmp/corefw-XXXXXX", *data;
+	CFWMappedFile *mf = NULL;
+	bool ret = false;
+	int fd;
+
+	if ((data = malloc(len)) == NULL)
+		return false;
+	memset(data, 'x', len);
+
+	if ((fd = mkstemp(path)) == -1) {
+		free(data);
+		return false;
+	}
+
+	if (write(fd, data, len) == (ssize_t)len &&
+	    (mf = cfw_new(cfw_mappedfile, path, 0)) != NULL &&
+	    write(fd, "appended", 8) == 8)
+		ret = (cfw_mappedfile_is_mapped(mf) &&
+		    cfw_mappedfile_length(mf) == len &&
+		    !memcmp(cfw_mappedfile_data(mf), data, len) &&
+		    cfw_mappedfile_data(mf)[len] == '\0');
+
+	cfw_unref(mf);
+	close(fd);
+	unlink(path);
+	free(data);
+
+	return ret;
+}
+
+static void
+check_mappedfile(void)
+{
+	static const char data[] = "one\r\ntwo\n\r\nthree";
+	char path[] = "/tmp/corefw-XXXXXX", fd_path[32];
+	CFWMappedFile *mf;
+	int fd, fds[2];
+
+	if ((fd = mkstemp(path)) == -1 ||
+	    write(fd, data, sizeof(data) - 1) != sizeof(data) - 1) {
+		check(false, "mkstemp");
+		return;
+	}
+	close(fd);
+
+	mf = cfw_new(cfw_mappedfile, path, CFW_MAPPEDFILE_SEQUENTIAL);
+	unlink(path);
+
+	check(mf != NULL && cfw_mappedfile_is_mapped(mf) &&
+	    cfw_mappedfile_length(mf) == sizeof(data) - 1 &&
+	    !memcmp(cfw_mappedfile_data(mf), data, sizeof(data)),
+	    "mapped file");
+	if (mf != NULL)
+		check_mapped_lines(mf, "mapped file lines");
+	cfw_unref(mf);
+
+	check(mapped_after_append(1), "append to small mapped file");
+	check(mapped_after_append(5000), "append to mapped file");
+	check(mapped_after_append(8192), "append to page sized file");
+
+	if (pipe(fds) == -1 ||
+	    write(fds[1], data, sizeof(data) - 1) != sizeof(data) - 1) {
+		check(false, "pipe");
+		return;
+	}
+	close(fds[1]);
+
+	snprintf(fd_path, sizeof(fd_path), "/dev/fd/%d", fds[0]);
+	mf = cfw_new(cfw_mappedfile, fd_path, 0);
+	close(fds[0]);
+
+	check(mf != NULL && !cfw_mappedfile_is_mapped(mf) &&
+	    cfw_mappedfile_length(mf) == sizeof(data) - 1 &&
+	    !memcmp(cfw_mappedfile_data(mf), data, sizeof(data)),
+	    "pipe fallback");
+	if (mf != NULL)
+		check_mapped_lines(mf, "pipe fallback lines");
+	cfw_unref(mf);
+}
+
+/* Queues one operation and waits for its result */
+static ssize_t
+ring_io(CFWIORing *ring, void *stream, bool write, void *buf, size_t len)
+{
+	cfw_ioring_completion_t done;
+	bool ok;
+
+	if (write)
+		ok = cfw_ioring_write(ring, stream, buf, len, buf);
+	else
+		ok = cfw_ioring_read(ring, stream, buf, len, buf);
+
+	if (!ok || cfw_ioring_submit(ring) == -1 ||
+	    cfw_ioring_wait(ring, &done, 1, 1) != 1 || done.ctx != buf)
+		return -1;
+
+	return done.res;
+}
+
+static bool
+ring_round_trip(CFWIORing *ring, void *out, void *in)
+{
+	char data[] = "through the ring", buf[sizeof(data)];
+
+	return (ring_io(ring, out, true, data, sizeof(data)) == sizeof(data) &&
+	    ring_io(ring, in, false, buf, sizeof(buf)) == sizeof(buf) &&
+	    !memcmp(buf, data, sizeof(data)));
+}
+
+/* Sockets and files go to the kernel, streams without a descriptor do not */
+static void
+check_ioring(void)
+{
+	CFWRefPool *pool = cfw_new(cfw_refpool);
+	CFWIORing *ring = cfw_new(cfw_ioring, (size_t)0);
+	char path[] = "/tmp/corefw-XXXXXX", data[] = "reused", buf[6];
+	static char block[256 * 1024];
+	CFWTCPSocket *client, *peer;
+	CFWFile *file;
+	CFWLZStream *lz;
+	uint32_t seed;
+	size_t i;
+	int fd;
+
+	if (ring == NULL || !connect_pair(&client, &peer)) {
+		check(false, "ioring setup");
+		goto out;
+	}
+
+	check(cfw_ioring_register_stream(ring, client) &&
+	    cfw_ioring_register_stream(ring, peer), "ioring register");
+	check(ring_round_trip(ring, client, peer) &&
+	    ring_round_trip(ring, peer, client), "ioring socket round trip");
+
+	if ((fd = mkstemp(path)) == -1) {
+		check(false, "mkstemp");
+		goto out;
+	}
+	close(fd);
+
+	/* The file gets the closed socket's descriptor, but not its slot */
+	fd = cfw_stream_fd(client);
+	cfw_stream_close(client);
+	file = cfw_new(cfw_file, path, "w");
+	check(file != NULL && cfw_stream_fd(file) == fd &&
+	    ring_io(ring, file, true, data, 6) == 6, "ioring reused fd");
+	cfw_unref(file);
+	check(same_contents(path, data, 6), "ioring reused fd contents");
+
+	/* Must fail with an error instead of being killed by SIGPIPE */
+	cfw_stream_close(peer);
+	if (connect_pair(&client, &peer)) {
+		struct timespec rst = { 0, 10000000 };
+
+		cfw_stream_close(peer);
+		ring_io(ring, client, true, data, 6);
+		nanosleep(&rst, NULL);
+		check(ring_io(ring, client, true, data, 6) < 0,
+		    "ioring write to closed socket");
+	} else
+		check(false, "connect_pair");
+
+	/* Without a descriptor, operations complete when they are queued */
+	file = cfw_new(cfw_file, path, "w");
+	lz = cfw_new(cfw_lzstream, file, (size_t)0);
+	cfw_unref(file);
+	check(lz != NULL && ring_io(ring, lz, true, data, 6) == 6,
+	    "ioring fallback write");
+	cfw_unref(lz);
+
+	file = cfw_new(cfw_file, path, "r");
+	lz = cfw_new(cfw_lzstream, file, (size_t)0);
+	cfw_unref(file);
+	check(lz != NULL && ring_io(ring, lz, false, buf, 6) == 6 &&
+	    !memcmp(buf, data, 6), "ioring fallback read");
+	cfw_unref(lz);
+
+	/* Too random to compress, so it goes straight to a read-only file */
+	for (i = 0, seed = 1; i < sizeof(block); i++) {
+		seed = seed * 1103515245 + 12345;
+		block[i] = seed >> 24;
+	}
+	file = cfw_new(cfw_file, path, "r");
+	lz = cfw_new(cfw_lzstream, file, (size_t)0);
+	cfw_unref(file);
+	check(lz != NULL && ring_io(ring, lz, true, block,
+	    sizeof(block)) == -EBADF, "ioring fallback write error");
+	cfw_unref(lz);
+
+	unlink(path);
+out:
+	cfw_unref(ring);
+	cfw_unref(pool);
+}
+
+struct received {
+	size_t len;
+	bool same;
+};
+
+static void
+receive(CFWRunLoop *loop, void *stream, int events, void *ctx)
+{
+	struct received *rcvd = ctx;
+	unsigned char buf[4096];
+	ssize_t i, n;
+
+	while ((n = cfw_stream_read(stream, buf, sizeof(buf))) > 0)
+		for (i = 0; i < n; i++)
+			rcvd->same &= (buf[i] == (rcvd->len++ * 7 % 251));
+}
+
+static void
+ignore(CFWRunLoop *loop, void *stream, int events, void *ctx)
+{
+}
+
+/* More than the socket takes at once has to be queued, not half sent */
+static void
+check_runloop(void)
+{
+	CFWRefPool *pool = cfw_new(cfw_refpool);
+	CFWRunLoop *loop = cfw_new(cfw_runloop);
+	struct received rcvd = { 0, true };
+	CFWTCPSocket *client, *peer;
+	char *data;
+	size_t i;
+
+	if ((data = malloc(COPY_SIZE)) == NULL)
+		goto out;
+
+	for (i = 0; i < COPY_SIZE; i++)
+		data[i] = i * 7 % 251;
+
+	if (loop == NULL || !connect_pair(&client, &peer) ||
+	    !cfw_runloop_add(loop, client, CFW_RUNLOOP_READ, ignore, NULL) ||
+	    !cfw_runloop_add(loop, peer, CFW_RUNLOOP_READ, receive, &rcvd)) {
+		check(false, "runloop setup");
+		goto out;
+	}
+
+	check(cfw_stream_write(client, data, COPY_SIZE),
+	    "runloop stream write");
+
+	for (i = 0; i < 1000 && rcvd.len < COPY_SIZE; i++)
+		if (cfw_runloop_run_once(loop, 10) == -1)
+			break;
+
+	check(rcvd.len == COPY_SIZE && rcvd.same, "runloop queued write");
+
+	cfw_stream_close(client);
+	check(cfw_runloop_remove(loop, client) && cfw_runloop_count(loop) == 1,
+	    "runloop remove closed stream");
+
+out:
+	free(data);
+	cfw_unref(loop);
+	cfw_unref(pool);
+}
+
+/* Readable before anything was asked means the peer closed it */
+static bool
+is_fresh(CFWTCPSocket *sock)
+{
+	struct pollfd pfd = { cfw_stream_fd(sock), POLLIN, 0 };
+
+	return (pfd.fd != -1 && poll(&pfd, 1, 0) == 0);
+}
+
+static void
+check_connpool(void)
+{
+	CFWRefPool *refpool = cfw_new(cfw_refpool);
+	CFWConnPool *pool = cfw_new(cfw_connpool);
+	CFWTCPServer *server = cfw_create(cfw_tcpserver);
+	CFWTCPSocket *sock, *again, *peer;
+	uint16_t port;
+
+	if (pool == NULL || !cfw_tcpserver_listen(server, "127.0.0.1", 0, 0)) {
+		check(false, "connpool setup");
+		goto out;
+	}
+	port = cfw_tcpserver_port(server);
+
+	if ((sock = cfw_connpool_get(pool, "127.0.0.1", port)) == NULL ||
+	    (peer = cfw_tcpserver_accept(server)) == NULL) {
+		check(false, "connpool get");
+		goto out;
+	}
+
+	cfw_connpool_put(pool, sock, true);
+	again = cfw_connpool_get(pool, "127.0.0.1", port);
+	check(again == sock, "connpool reuse");
+	cfw_connpool_put(pool, again, true);
+
+	/* Once the peer is gone, the idle one is replaced */
+	cfw_stream_close(peer);
+	check(cfw_connpool_idle(pool, "127.0.0.1", port) == 1, "connpool idle");
+	sock = cfw_connpool_get(pool, "127.0.0.1", port);
+	check(sock != NULL && is_fresh(sock) &&
+	    cfw_connpool_idle(pool, "127.0.0.1", port) == 0, "connpool stale");
+	if (sock == NULL)
+		goto out;
+
+	cfw_connpool_set_max_per_key(pool, 1);
+	check(cfw_connpool_try_get(pool, "127.0.0.1", port) == NULL,
+	    "connpool max per key");
+
+	/* Still checked out, so it must outlive the pool */
+	cfw_unref(pool);
+	pool = NULL;
+	check(is_fresh(sock), "connpool checked out");
+	cfw_unref(sock);
+
+out:
+	cfw_unref(pool);
+	cfw_unref(refpool);
+}
+
+/* Writes data compressed to path, reads it back and compares */
+static bool
+lz_round_trip(const char *path, const char *data, size_t len)
+{
+	CFWFile *file = cfw_new(cfw_file, path, "w");
+	CFWLZStream *lz = cfw_new(cfw_lzstream, file, (size_t)4096);
+	char *buf;
+	size_t got = 0;
+	ssize_t ret;
+	bool ok;
+
+	cfw_unref(file);
+	ok = (lz != NULL && cfw_stream_write(lz, data, len) &&
+	    cfw_lzstream_finish(lz));
+	cfw_unref(lz);
+
+	if (!ok || (buf = malloc(len + 1)) == NULL)
+		return false;
+
+	file = cfw_new(cfw_file, path, "r");
+	lz = cfw_new(cfw_lzstream, file, (size_t)0);
+	cfw_unref(file);
+
+	while (lz != NULL && (ret = cfw_stream_read(lz, buf + got,
+	    len + 1 - got)) > 0)
+		got += ret;
+
+	ok = (lz != NULL && ret == 0 && got == len && !memcmp(buf, data, len));
+	cfw_unref(lz);
+	free(buf);
+
+	return ok;
+}
+
+static void
+check_lzstream(void)
+{
+	char path[] = "/tmp/corefw-XXXXXX", *data, buf[100];
+	CFWMappedFile *mf;
+	CFWFile *file;
+	CFWLZStream *lz, *reader;
+	uint32_t seed = 1;
+	size_t i;
+	int fd;
+
+	if ((data = malloc(COPY_SIZE)) == NULL)
+		return;
+
+	if ((fd = mkstemp(path)) == -1) {
+		check(false, "mkstemp");
+		free(data);
+		return;
+	}
+
+	for (i = 0; i < COPY_SIZE; i++)
+		data[i] = "compressible "[i % 13];
+	check(lz_round_trip(path, data, 100000), "lz compressible");
+	mf = cfw_new(cfw_mappedfile, path, 0);
+	check(mf != NULL && cfw_mappedfile_length(mf) < 10000,
+	    "lz compressed size");
+	cfw_unref(mf);
 
-#include "object.h"
-#include "refpool.h"
-#include "string.h"
-#include "int.h"
-#include "array.h"
-#include "map.h"
+	for (i = 0; i < COPY_SIZE; i++) {
+		seed = seed * 1103515245 + 12345;
+		data[i] = seed >> 24;
+	}
+	check(lz_round_trip(path, data, 100000), "lz incompressible");
+	check(lz_round_trip(path, data, 0), "lz empty");
+
+	/* What was flushed can be read while the stream is still open */
+	file = cfw_new(cfw_file, path, "w");
+	lz = cfw_new(cfw_lzstream, file, (size_t)0);
+	cfw_unref(file);
+	file = cfw_new(cfw_file, path, "r");
+	reader = cfw_new(cfw_lzstream, file, (size_t)0);
+	cfw_unref(file);
+	check(cfw_stream_write(lz, data, 60) && cfw_stream_flush(lz) &&
+	    cfw_stream_read(reader, buf, sizeof(buf)) == 60 &&
+	    !memcmp(buf, data, 60), "lz flushed block");
+	check(cfw_stream_write(lz, data + 60, 40) && cfw_lzstream_finish(lz) &&
+	    cfw_stream_read(reader, buf, sizeof(buf)) == 40 &&
+	    !memcmp(buf, data + 60, 40) &&
+	    cfw_stream_read(reader, buf, sizeof(buf)) == 0, "lz last block");
+	cfw_unref(lz);
+	cfw_unref(reader);
+
+	/* Flip a bit in the first checksum, then read it with r+ */
+	mf = cfw_new(cfw_mappedfile, path, 0);
+	if (mf == NULL || (i = cfw_mappedfile_length(mf)) < 17) {
+		check(false, "lz corrupt");
+		cfw_unref(mf);
+		goto out;
+	}
+	memcpy(data, cfw_mappedfile_data(mf), i);
+	cfw_unref(mf);
+
+	data[13] ^= 1;
+	if (pwrite(fd, data + 13, 1, 13) != 1) {
+		check(false, "lz corrupt");
+		goto out;
+	}
+
+	file = cfw_new(cfw_file, path, "r+");
+	reader = cfw_new(cfw_lzstream, file, (size_t)0);
+	cfw_unref(file);
+	check(cfw_stream_read(reader, buf, sizeof(buf)) == -1,
+	    "lz corrupted checksum");
+
+	/* Closing what was read must not append an end mark */
+	cfw_unref(reader);
+	check(same_contents(path, data, i), "lz reader close");
+
+out:
+	close(fd);
+	unlink(path);
+	free(data);
+}
+
+#define SCAN_SIZE (1024 * 1024)
+
+/* Scans of two inputs are interleaved while the DFA cache is flushed */
+static void
+check_regex(void)
+{
+	CFWRefPool *pool = cfw_new(cfw_refpool);
+	static const char *empty[] = { "a*", "(b)?", "x?", "^$" };
+	char path[32], *data[2];
+	cfw_regex_scan_t scan[2];
+	CFWRegex *regex;
+	CFWFile *file;
+	uint32_t seed = 7;
+	size_t i, j, end;
+	int fds[2];
+
+	for (i = 0; i < sizeof(empty) / sizeof(*empty); i++) {
+		if (pipe(fds) == -1) {
+			check(false, "pipe");
+			break;
+		}
+
+		snprintf(path, sizeof(path), "/dev/fd/%d", fds[0]);
+		file = cfw_new(cfw_file, path, "r");
+		close(fds[0]);
+		close(fds[1]);
+
+		regex = cfw_create(cfw_regex, empty[i]);
+		check(file != NULL && regex != NULL &&
+		    cfw_regex_search_stream(regex, file) &&
+		    cfw_regex_search(regex, "", 0), empty[i]);
+		cfw_unref(file);
+	}
+
+	/* Needs far more states than fit into the cache */
+	regex = cfw_create(cfw_regex, "a[ab]{16}c");
+
+	for (i = 0; i < 2; i++) {
+		if ((data[i] = malloc(SCAN_SIZE)) == NULL)
+			goto out;
+
+		for (j = 0; j < SCAN_SIZE; j++) {
+			seed = seed * 1103515245 + 12345;
+			data[i][j] = ((seed >> 16) & 1 ? 'a' : 'b');
+		}
+
+		data[i][SCAN_SIZE - 1] = 'c';
+		data[i][SCAN_SIZE - 18] = (i == 0 ? 'a' : 'b');
+		cfw_regex_scan(regex, &scan[i]);
+	}
+
+	for (j = 0; j < SCAN_SIZE; j += 4096)
+		for (i = 0; i < 2; i++)
+			cfw_regex_feed(&scan[i], data[i] + j, 4096, &end);
+
+	check(cfw_regex_finish(&scan[0], &end) && end == SCAN_SIZE &&
+	    !cfw_regex_finish(&scan[1], &end), "regex scans across flushes");
+
+	free(data[1]);
+out:
+	free(data[0]);
+	cfw_unref(pool);
+}
+
+static const struct {
+	const char *str;
+	size_t len;
+	bool valid;
+} utf8_cases[] = {
+	{ "", 0, true },
+	{ "h\xC3\xA9llo \xE2\x82\xAC \xF0\x9F\x98\x80", 15, true },
+	{ "\xC0\xAF", 2, false },			/* overlong */
+	{ "\xE0\x80\xAF", 3, false },			/* overlong */
+	{ "\xF0\x80\x80\xAF", 4, false },		/* overlong */
+	{ "\xED\xA0\x80", 3, false },			/* surrogate */
+	{ "\xF4\x90\x80\x80", 4, false },		/* above U+10FFFF */
+	{ "\x80", 1, false },
+	{ "0123456789abcdef0123456789abcde\xE2\x82", 33, false },
+	{ "0123456789abcdef0123456789abcd\xF0\x9F\x98", 33, false },
+	{ "0123456789abcdef0123456789abcdef\xE2\x82\xAC", 35, true }
+};
+
+/* Counts code points by their lead bytes, the slow way */
+static size_t
+utf8_reference(const char *s, size_t len, size_t cp)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		if ((s[i] & 0xC0) != 0x80 && cp-- == 0)
+			return i;
+
+	return (cp == 0 ? len : SIZE_MAX);
+}
+
+static void
+check_utf8(void)
+{
+	static const char *chars[] = { "a", "\xC3\xA9", "\xE2\x82\xAC",
+	    "\xF0\x9F\x98\x80" };
+	CFWRefPool *pool = cfw_new(cfw_refpool);
+	CFWString *str = cfw_create(cfw_string, (void*)NULL);
+	size_t i, cp, len;
+	bool ok;
+
+	for (i = 0; i < sizeof(utf8_cases) / sizeof(*utf8_cases); i++)
+		check(cfw_utf8_valid(utf8_cases[i].str, utf8_cases[i].len) ==
+		    utf8_cases[i].valid, utf8_cases[i].str);
+
+	check(cfw_utf8_length(utf8_cases[1].str, 15) == 9 &&
+	    cfw_utf8_offset(utf8_cases[1].str, 15, 2) == 3 &&
+	    cfw_utf8_offset(utf8_cases[1].str, 15, 9) == 15 &&
+	    cfw_utf8_offset(utf8_cases[1].str, 15, 10) == SIZE_MAX,
+	    "utf8 length and offset");
+
+	/* Below, at and well above the size that gets an index */
+	for (i = 0; cfw_string_length(str) < 5000; i++) {
+		if (!cfw_string_append_c(str, chars[i % 4]))
+			break;
+
+		len = cfw_string_length(str);
+		if (len < 1020 || (len > 1030 && len % 997 > 3))
+			continue;
+
+		ok = (cfw_string_utf8_length(str) == i + 1);
+		for (cp = 0; cp <= i + 2; cp++)
+			ok &= (cfw_string_utf8_offset(str, cp) == utf8_reference(
+			    cfw_string_c(str), len, cp));
+
+		check(ok && cfw_string_utf8_valid(str), "utf8 index");
+	}
+
+	cfw_unref(pool);
+}
+
+static size_t
+memmem_reference(const char *hay, size_t hay_len, const char *needle,
+    size_t needle_len)
+{
+	size_t i;
+
+	for (i = 0; i + needle_len <= hay_len; i++)
+		if (!memcmp(hay + i, needle, needle_len))
+			return i;
+
+	return SIZE_MAX;
+}
+
+/* Only at the very end, for many haystack lengths */
+static bool
+memmem_at_end(const char *hay, size_t len)
+{
+	char needle[128], tail[256];
+	size_t i;
+	bool ok = true;
+
+	if (len == 0 || len > sizeof(needle))
+		return false;
+
+	memset(needle, 'a', len);
+	needle[len - 1] = 'c';
+
+	for (i = len; i < len + 80; i++) {
+		memcpy(tail, hay, i - len);
+		memcpy(tail + i - len, needle, len);
+		ok &= (cfw_memmem(tail, i, needle, len) == i - len);
+		ok &= (cfw_memmem(tail, i - 1, needle, len) == SIZE_MAX);
+	}
+
+	return ok;
+}
+
+/* Each length takes a different path: memchr, SIMD and Two-Way */
+static void
+check_memmem(void)
+{
+	static const size_t lens[] = { 1, 2, 31, 32, 33, 100 };
+	char hay[4096], needle[100], what[64];
+	uint32_t seed = 3;
+	size_t i, pos;
+	bool ok;
+
+	for (i = 0; i < sizeof(hay); i++) {
+		seed = seed * 1103515245 + 12345;
+		hay[i] = ((seed >> 16) & 3 ? 'a' : 'b');
+	}
+
+	for (i = 0; i < sizeof(lens) / sizeof(*lens); i++) {
+		size_t len = lens[i];
+
+		ok = true;
+
+		/* Taken from the haystack, so each occurs somewhere */
+		for (pos = 0; pos + len <= sizeof(hay); pos += 97) {
+			memcpy(needle, hay + pos, len);
+			ok &= (cfw_memmem(hay, sizeof(hay), needle, len) ==
+			    memmem_reference(hay, sizeof(hay), needle, len));
+		}
+
+		ok &= memmem_at_end(hay, len);
+		ok &= (cfw_memmem("", 0, hay, len) == SIZE_MAX);
+
+		snprintf(what, sizeof(what), "memmem %zu", len);
+		check(ok, what);
+	}
+
+	check(cfw_memmem(hay, sizeof(hay), "", 0) == 0 &&
+	    cfw_memmem("", 0, "", 0) == 0, "memmem empty needle");
+}
+
+static CFWMatcher*
+create_matcher(const char **patterns, size_t cnt)
+{
+	CFWArray *array = cfw_create(cfw_array, (void*)NULL);
+	size_t i;
+
+	for (i = 0; i < cnt; i++)
+		cfw_array_push(array, cfw_create(cfw_string, patterns[i]));
+
+	return cfw_create(cfw_matcher, array);
+}
+
+/* Collects all matches as "pattern@offset", feeding a few bytes at a time */
+static bool
+matches(CFWMatcher *matcher, const char *text, size_t chunk,
+    const char *expected)
+{
+	cfw_matcher_scan_t scan;
+	cfw_matcher_match_t match;
+	char got[256];
+	size_t pos = 0, len = strlen(text), got_len = 0, n, consumed;
+
+	got[0] = '\0';
+	cfw_matcher_scan(matcher, &scan);
+
+	while (pos < len) {
+		n = (len - pos < chunk ? len - pos : chunk);
+
+		if (cfw_matcher_feed(&scan, text + pos, n, &consumed, &match))
+			got_len += snprintf(got + got_len,
+			    sizeof(got) - got_len, "%zu@%zu ", match.pattern,
+			    match.offset);
+
+		pos += consumed;
+	}
+
+	return !strcmp(got, expected);
+}
+
+static void
+check_matcher(void)
+{
+	static const char *words[] = { "he", "she", "his", "hers" };
+	static const char *nested[] = { "abcd", "bc", "" };
+	static const char *single[] = { "aa" };
+	static const char *last[] = { "xyz", "q" };
+	CFWRefPool *pool = cfw_new(cfw_refpool);
+	CFWMatcher *matcher;
+	cfw_matcher_match_t match;
+	size_t chunk;
+	bool ok = true;
+
+	/* The result must not depend on where the input is split */
+	matcher = create_matcher(words, 4);
+	for (chunk = 1; chunk <= 8; chunk++)
+		ok &= matches(matcher, "ushers his", chunk, "1@1 3@2 2@7 ");
+	check(ok, "matcher overlapping");
+
+	matcher = create_matcher(nested, 3);
+	check(matches(matcher, "abcd", 4, "1@1 0@0 ") &&
+	    !cfw_matcher_find(matcher, "", 0, &match), "matcher nested");
+
+	matcher = create_matcher(single, 1);
+	check(matches(matcher, "aaaa", 4, "0@0 0@1 0@2 "), "matcher repeated");
+
+	matcher = create_matcher(last, 2);
+	check(cfw_matcher_find(matcher, "------xyz", 9, &match) &&
+	    match.pattern == 0 && match.offset == 6 && match.length == 3,
+	    "matcher last byte");
+
+	matcher = create_matcher(NULL, 0);
+	check(matcher != NULL && cfw_matcher_patterns(matcher) == 0 &&
+	    !cfw_matcher_find(matcher, "abc", 3, &match), "matcher empty");
+
+	cfw_unref(pool);
+}
+
+#define PARALLEL_SIZE 10000
+
+static void*
+square(void *obj, void *ctx)
+{
+	intmax_t value = cfw_int_value(obj);
+
+	return cfw_create(cfw_int, value * value);
+}
+
+static bool
+is_odd(void *obj, void *ctx)
+{
+	return (cfw_int_value(obj) % 2 != 0);
+}
+
+static void*
+add(void *a, void *b, void *ctx)
+{
+	return cfw_create(cfw_int, cfw_int_value(a) + cfw_int_value(b));
+}
+
+static void*
+get_value(void *key, void *obj, void *ctx)
+{
+	return obj;
+}
+
+static void
+add_value(void *key, void *obj, void *ctx)
+{
+	__atomic_add_fetch((intmax_t*)ctx, cfw_int_value(obj),
+	    __ATOMIC_RELAXED);
+}
+
+/* Everything must come out as it does from a sequential loop */
+static bool
+parallel_matches(CFWArray *array, CFWMap *map, CFWExecutor *executor)
+{
+	CFWArray *squares, *odd;
+	CFWInt *sum;
+	cfw_map_iter_t iter;
+	intmax_t total = 0, each = 0;
+	size_t i, j;
+	bool ret = true;
+
+	squares = cfw_array_parallel_map(array, executor, square, NULL);
+	odd = cfw_array_parallel_filter(array, executor, is_odd, NULL);
+	sum = cfw_array_parallel_reduce(array, executor, add, NULL);
+
+	if (squares == NULL || odd == NULL || sum == NULL ||
+	    cfw_array_size(squares) != cfw_array_size(array))
+		return false;
+
+	for (i = j = 0; i < cfw_array_size(array); i++) {
+		intmax_t v = cfw_int_value(cfw_array_get(array, i));
+
+		ret &= (cfw_int_value(cfw_array_get(squares, i)) == v * v);
+
+		if (v % 2 != 0)
+			ret &= (j < cfw_array_size(odd) &&
+			    cfw_array_get(odd, j++) == cfw_array_get(array, i));
+
+		total += v;
+	}
+	ret &= (j == cfw_array_size(odd) && cfw_int_value(sum) == total);
+
+	total = 0;
+	for (cfw_map_iter(map, &iter); iter.key != NULL;
+	    cfw_map_iter_next(&iter))
+		total += cfw_int_value(iter.obj);
+
+	sum = cfw_map_parallel_reduce(map, executor, get_value, add, NULL);
+	ret &= (sum != NULL && cfw_int_value(sum) == total);
+	ret &= (cfw_map_parallel_each(map, executor, add_value, &each) &&
+	    each == total);
+
+	return ret;
+}
+
+static void
+check_parallel(void)
+{
+	CFWRefPool *pool = cfw_new(cfw_refpool);
+	CFWExecutor *executor = cfw_new(cfw_executor, (size_t)4);
+	CFWArray *array = cfw_create(cfw_array, (void*)NULL);
+	CFWMap *map = cfw_create(cfw_map, (void*)NULL);
+	size_t i;
+
+	for (i = 0; i < PARALLEL_SIZE; i++) {
+		CFWInt *obj = cfw_create(cfw_int, (intmax_t)(i * 7919 % 10007));
+		CFWString *key = cfw_create(cfw_string, (void*)NULL);
+
+		cfw_string_append_uint(key, i);
+		cfw_array_push(array, obj);
+		cfw_map_set(map, key, obj);
+	}
+
+	check(parallel_matches(array, map, executor), "parallel");
+	check(parallel_matches(array, map, NULL), "parallel without executor");
+
+	array = cfw_create(cfw_array, (void*)NULL);
+	map = cfw_create(cfw_map, (void*)NULL);
+	check(cfw_array_size(cfw_array_parallel_map(array, executor, square,
+	    NULL)) == 0 && cfw_array_parallel_reduce(array, executor, add,
+	    NULL) == NULL && cfw_map_parallel_reduce(map, executor,
+	    get_value, add, NULL) == NULL, "parallel on empty");
+
+	cfw_unref(executor);
+	cfw_unref(pool);
+}
+
+static bool
+same_as_string(CFWStringView *view, const char *bytes, size_t len)
+{
+	CFWString *str = cfw_create(cfw_string, (void*)NULL);
+
+	cfw_string_set_buf(str, bytes, len);
+
+	return (cfw_equal(view, str) && cfw_equal(str, view) &&
+	    cfw_hash(view) == cfw_hash(str));
+}
+
+/* Views are interchangeable with strings and may outlive what made them */
+static void
+check_stringview(void)
+{
+	static const cfw_range_t ranges[] = {
+		{ 0, 5 }, { 6, 5 }, { 12, 0 }, { 12, 3 }
+	};
+	CFWRefPool *pool = cfw_new(cfw_refpool), *inner;
+	CFWString *parent, *other;
+	CFWStringView *view, *first, *last;
+	CFWArray *array;
+	CFWMap *map;
+
+	parent = cfw_new(cfw_string, (void*)NULL);
+	cfw_string_set_buf(parent, "hello world\0\xff\x80z", 15);
+
+	view = cfw_create(cfw_stringview, parent, cfw_range(6, 5));
+	check(same_as_string(view, "world", 5), "view equals string");
+	view = cfw_create(cfw_stringview, parent, cfw_range(11, 4));
+	check(same_as_string(view, "\0\xff\x80z", 4), "view of binary");
+	view = cfw_create(cfw_stringview, parent, cfw_range(3, 0));
+	check(same_as_string(view, "", 0), "empty view");
+	other = cfw_create(cfw_string, "worlds");
+	view = cfw_create(cfw_stringview, parent, cfw_range(6, 5));
+	check(!cfw_equal(view, other) && !cfw_equal(other, view),
+	    "view differs from longer string");
+
+	/* Either one finds what the other was stored under */
+	map = cfw_create(cfw_map, (void*)NULL);
+	cfw_map_set_c(map, "world", other);
+	check(cfw_map_get(map, view) == other, "string key found by view");
+	cfw_map_set(map, cfw_create(cfw_stringview, parent, cfw_range(0, 5)),
+	    other);
+	check(cfw_map_get_c(map, "hello") == other, "view key found by string");
+
+	/* The views keep the block and parent alive after everything else */
+	inner = cfw_new(cfw_refpool);
+	array = cfw_stringview_array(parent, ranges, 4);
+	first = cfw_ref(cfw_array_get(array, 0));
+	last = cfw_ref(cfw_array_get(array, 3));
+	cfw_unref(inner);
+	cfw_unref(parent);
+
+	check(same_as_string(first, "hello", 5) &&
+	    same_as_string(last, "\xff\x80z", 3), "views outlive array");
+	cfw_unref(first);
+	check(same_as_string(last, "\xff\x80z", 3), "last view of block");
+	cfw_unref(last);
+
+	cfw_unref(pool);
+}
+
+/* Each field of buf, followed by a '|', found the slow way */
+static CFWString*
+split_reference(const char *buf, size_t len, const char *delim)
+{
+	CFWString *ret = cfw_create(cfw_string, (void*)NULL);
+	size_t i, start = 0, delim_len = strlen(delim);
+
+	for (i = 0; delim_len > 0 && i + delim_len <= len; i++) {
+		if (memcmp(buf + i, delim, delim_len))
+			continue;
+
+		cfw_string_append_buf(ret, buf + start, i - start);
+		cfw_string_append_c(ret, "|");
+		start = i + delim_len;
+		i = start - 1;
+	}
+
+	cfw_string_append_buf(ret, buf + start, len - start);
+	cfw_string_append_c(ret, "|");
+
+	return ret;
+}
+
+static CFWString*
+join_fields(CFWArray *fields)
+{
+	CFWString *ret = cfw_create(cfw_string, (void*)NULL);
+	size_t i;
+
+	for (i = 0; fields != NULL && i < cfw_array_size(fields); i++) {
+		CFWStringView *view = cfw_array_get(fields, i);
+
+		cfw_string_append_buf(ret, cfw_stringview_data(view),
+		    cfw_stringview_length(view));
+		cfw_string_append_c(ret, "|");
+	}
+
+	return ret;
+}
+
+static bool
+splits_like_reference(const char *buf, size_t len, const char *delim)
+{
+	CFWString *expected = split_reference(buf, len, delim);
+	CFWString *str = cfw_create(cfw_string, (void*)NULL), *tokens;
+	cfw_tokenizer_t tok;
+
+	tokens = cfw_create(cfw_string, (void*)NULL);
+	cfw_tokenize(&tok, buf, len, delim);
+	while (cfw_tokenizer_next(&tok)) {
+		cfw_string_append_buf(tokens, tok.token, tok.len);
+		cfw_string_append_c(tokens, "|");
+	}
+
+	cfw_string_set_buf(str, buf, len);
+
+	return (cfw_equal(tokens, expected) &&
+	    cfw_equal(join_fields(cfw_string_split(str, delim)), expected) &&
+	    cfw_equal(join_fields(cfw_string_split_buf(buf, len, delim)),
+	    expected));
+}
+
+/*
+ * Delimiters at both ends, around the 16 byte blocks the tokenizer scans and
+ * next to each other.
+ */
+static void
+check_split(void)
+{
+	static const size_t lengths[] = { 1, 2, 15, 16, 17, 31, 32, 33, 40 };
+	static const char *delims[] = { ",", ",;", ";;" };
+	CFWRefPool *pool = cfw_new(cfw_refpool);
+	size_t i, j, k, l, positions[6];
+	char buf[64], what[64];
+	bool ok;
+
+	for (i = 0; i < sizeof(lengths) / sizeof(*lengths); i++) {
+		size_t len = lengths[i];
+
+		for (j = 0; j < sizeof(delims) / sizeof(*delims); j++) {
+			const char *delim = delims[j];
+			size_t delim_len = strlen(delim);
+
+			positions[0] = 0;
+			positions[1] = 15;
+			positions[2] = 16;
+			positions[3] = len - 1;
+			positions[4] = len / 2;
+			positions[5] = SIZE_MAX;
+
+			/* Each position, none, then three in a row */
+			for (k = 0; k <= 6; k++) {
+				for (l = 0; l < len; l++)
+					buf[l] = 'a' + l % 26;
+
+				for (l = 0; l < (k < 6 ? 1 : 3); l++) {
+					size_t pos = (k < 6 ? positions[k] :
+					    len / 3 + l * delim_len);
+
+					if (pos < len && pos + delim_len <= len)
+						memcpy(buf + pos, delim,
+						    delim_len);
+				}
+
+				ok = splits_like_reference(buf, len, delim);
+				snprintf(what, sizeof(what),
+				    "split %zu bytes on \"%s\", case %zu", len,
+				    delim, k);
+				check(ok, what);
+			}
+		}
+	}
+
+	check(splits_like_reference("", 0, ","), "split nothing");
+	check(splits_like_reference(",,,", 3, ","), "split only delimiters");
+	check(splits_like_reference("abc", 3, ""), "split on nothing");
+
+	cfw_unref(pool);
+}
+
+static void
+check_numbers(void)
+{
+	char buf[CFW_DOUBLE_BUFSIZE], ref[CFW_INT_BUFSIZE];
+	size_t i, len;
+	intmax_t i_value;
+	uintmax_t u_value;
+	double value;
+
+	for (i = 0; i < sizeof(format_cases) / sizeof(*format_cases); i++) {
+		len = cfw_format_double(buf, format_cases[i].value);
+		check(len == strlen(format_cases[i].str) &&
+		    !memcmp(buf, format_cases[i].str, len),
+		    format_cases[i].str);
+
+		check(cfw_parse_double(buf, len, &value) == len &&
+		    !memcmp(&value, &format_cases[i].value, sizeof(value)),
+		    format_cases[i].str);
+	}
+
+	for (i = 0; i < sizeof(parse_cases) / sizeof(*parse_cases); i++) {
+		len = cfw_parse_double(parse_cases[i].str,
+		    strlen(parse_cases[i].str), &value);
+		check(len == parse_cases[i].used && (len == 0 ||
+		    !memcmp(&value, &parse_cases[i].value, sizeof(value))),
+		    parse_cases[i].str);
+	}
+
+	snprintf(ref, sizeof(ref), "%jd", INTMAX_MIN);
+	len = cfw_format_int(buf, INTMAX_MIN);
+	check(len == strlen(ref) && !memcmp(buf, ref, len), ref);
+	check(cfw_parse_int(ref, len, &i_value) == len &&
+	    i_value == INTMAX_MIN, ref);
+
+	snprintf(ref, sizeof(ref), "%jd", INTMAX_MAX);
+	ref[strlen(ref) - 1]++;
+	check(cfw_parse_int(ref, strlen(ref), &i_value) == 0, ref);
+
+	snprintf(ref, sizeof(ref), "%ju", UINTMAX_MAX);
+	len = cfw_format_uint(buf, UINTMAX_MAX);
+	check(len == strlen(ref) && !memcmp(buf, ref, len), ref);
+	check(cfw_parse_uint(ref, len, &u_value) == len &&
+	    u_value == UINTMAX_MAX, ref);
+
+	ref[strlen(ref) - 1]++;
+	check(cfw_parse_uint(ref, strlen(ref), &u_value) == 0, ref);
+	check(cfw_parse_uint("-1", 2, &u_value) == 0, "-1");
+}
+
+static void
+sum_range(void *ctx, size_t start, size_t end)
+{
+	size_t i, sum = 0;
+
+	for (i = start; i < end; i++)
+		sum += i;
+
+	__atomic_add_fetch((size_t*)ctx, sum, __ATOMIC_RELAXED);
+}
 
 static void
 print_map(CFWMap *map)
@@ -63,7 +1832,15 @@ main()
 	CFWArray *array;
 	CFWString *str, *str2;
 	CFWMap *map;
-	size_t i;
+	CFWQueue *queue;
+	CFWExecutor *executor;
+	CFWStringBuilder *sb;
+	CFWRope *rope;
+	CFWRegex *regex;
+	CFWTCPServer *server;
+	CFWTCPSocket *sock;
+	void *objs[4];
+	size_t i, cnt, sum;
 
 	pool = cfw_new(cfw_refpool);
 
@@ -111,5 +1888,100 @@ main()
 
 	cfw_unref(pool);
 
-	return 0;
+	pool = cfw_new(cfw_refpool);
+
+	queue = cfw_create(cfw_queue, (size_t)3);
+	printf("%zu\n", cfw_queue_capacity(queue));
+
+	objs[0] = cfw_create(cfw_string, "a");
+	objs[1] = cfw_create(cfw_string, "b");
+	objs[2] = cfw_create(cfw_string, "c");
+	objs[3] = cfw_create(cfw_string, "d");
+	cfw_queue_push_many(queue, objs, 4);
+	printf("%d\n", cfw_queue_try_push(queue, objs[0]));
+
+	cfw_queue_close(queue);
+	while ((cnt = cfw_queue_pop_many(queue, objs, 3)) > 0) {
+		for (i = 0; i < cnt; i++) {
+			fputs(cfw_string_c(objs[i]), stdout);
+			cfw_unref(objs[i]);
+		}
+		putchar('\n');
+	}
+
+	cfw_unref(pool);
+
+	pool = cfw_new(cfw_refpool);
+
+	sb = cfw_create(cfw_stringbuilder);
+	for (i = 0; i < 3; i++) {
+		cfw_stringbuilder_append_c(sb, "item ");
+		cfw_stringbuilder_append_uint(sb, i);
+		cfw_stringbuilder_append(sb, ", ", 2);
+	}
+	cfw_stringbuilder_append_double(sb, 0.5);
+	puts(cfw_string_c(cfw_stringbuilder_string(sb)));
+
+	rope = cfw_create(cfw_rope, "Hello world!");
+	cfw_rope_insert_c(rope, 5, ",");
+	cfw_rope_delete(rope, cfw_range(6, 6));
+	cfw_rope_insert_c(rope, 6, " rope");
+	puts(cfw_string_c(cfw_rope_string(rope)));
+	cfw_rope_delete(rope, cfw_range_all);
+	printf("%zu\n", cfw_rope_length(rope));
+
+	regex = cfw_create(cfw_regex, "[0-9]+(\\.[0-9]+)?");
+	array = cfw_regex_find_all(regex,
+	    cfw_create(cfw_string, "pi 3.14, e 2.718, answer 42"));
+	for (i = 0; i < cfw_array_size(array); i++)
+		printf("%s%s", (i > 0 ? " " : ""), cfw_string_c(
+		    cfw_stringview_string(cfw_array_get(array, i))));
+	putchar('\n');
+
+	cfw_unref(pool);
+
+	pool = cfw_new(cfw_refpool);
+
+	server = cfw_create(cfw_tcpserver);
+	if (cfw_tcpserver_listen(server, "127.0.0.1", 0, 0)) {
+		sock = cfw_create(cfw_tcpsocket);
+		cfw_tcpsocket_connect(sock, "127.0.0.1",
+		    cfw_tcpserver_port(server));
+		cfw_stream_write_line(sock, "Hello, server!");
+		cfw_stream_flush(sock);
+
+		sock = cfw_tcpserver_accept(server);
+		puts(cfw_string_c(cfw_stream_read_line(sock)));
+	}
+
+	cfw_unref(pool);
+
+	executor = cfw_new(cfw_executor, (size_t)4);
+	sum = 0;
+	cfw_executor_parallel_for(executor, 0, 100000, 0, sum_range, &sum);
+	printf("%zu\n", sum);
+	cfw_unref(executor);
+
+	check_numbers();
+	check_parallel();
+	check_utf8();
+	check_memmem();
+	check_matcher();
+	check_stringview();
+	check_split();
+	check_regex();
+	check_format();
+	check_close();
+	check_connect();
+	check_line_limit();
+	check_lines();
+	check_writev();
+	check_mappedfile();
+	check_copy();
+	check_ioring();
+	check_runloop();
+	check_connpool();
+	check_lzstream();
+
+	return (failures > 0);
 }